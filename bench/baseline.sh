@@ -0,0 +1,55 @@
+#!/bin/sh
+# Runs each benchmark ROM through the headless benchmark and writes the
+# results to OUTPUT as one JSON document, one ROM per line. If OUTPUT
+# already exists, the fps of each ROM is compared with it first.
+#
+# Usage: bench/baseline.sh HEADLESS FRAMES OUTPUT ROM...
+
+set -e
+
+headless=$1
+frames=$2
+out=$3
+shift 3
+
+tmp="$out.tmp"
+
+{
+  printf '{"frames":%s,"commit":"%s","results":[\n' "$frames" \
+    "$(git rev-parse --short HEAD 2>/dev/null || echo unknown)"
+
+  first=1
+
+  for rom in "$@"; do
+    [ -n "$first" ] || printf ',\n'
+    first=
+    "$headless" -b -f "$frames" "$rom" | tr -d '\n'
+  done
+
+  printf '\n]}\n'
+} > "$tmp"
+
+if [ -f "$out" ]; then
+  awk '
+    function field(line, name,    s) {
+      if (!match(line, "\"" name "\":\"?[^,\"}]*"))
+        return ""
+      s = substr(line, RSTART, RLENGTH)
+      sub(/^"[^"]*":"?/, "", s)
+      return s
+    }
+    FNR == 1 { file++ }
+    /"rom":/ {
+      rom = field($0, "rom")
+      fps = field($0, "fps")
+      if (file == 1)
+        old[rom] = fps
+      else if (rom in old && old[rom] > 0)
+        printf "%-28s %10.1f -> %10.1f fps  %+6.1f%%\n", rom, old[rom], fps,
+               (fps / old[rom] - 1) * 100
+    }
+  ' "$out" "$tmp"
+fi
+
+mv "$tmp" "$out"
+echo "Wrote $out"
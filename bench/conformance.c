@@ -0,0 +1,890 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "glitzboy.h"
+
+/*
+ * Single-step conformance vectors. Each vector holds a CPU state and the
+ * memory an instruction touches, the state and memory expected after
+ * executing it, and its bus cycles. This loads them in the JSON format of
+ * the SingleStepTests sm83 suite (one file per opcode, "cb xx.json" for
+ * CB-prefixed ones), or in the binary form -o writes, runs each through
+ * cpu_step, and prints pass/fail counts and host ns per instruction for
+ * every opcode.
+ *
+ * Vectors assume a flat 64 KB of RAM. Here the ROM and cartridge RAM areas
+ * are backed by one 64 KB array, with MBC writes replaced by stores to it
+ * so that ROM acts as RAM, and the rest is the core's own memory. Vectors
+ * that touch I/O, echo RAM or the unused area are skipped, as those do not
+ * behave as RAM on a Game Boy.
+ *
+ * Timing replays an opcode's passing vectors until the target time is
+ * reached, less the time taken by loading the vectors alone.
+ */
+
+#define MAX_RAM 16
+#define VECTOR_MAGIC "GBSV"
+#define VECTOR_VERSION 1
+
+struct cpu_state
+{
+  u8 a, f, b, c, d, e, h, l;
+  u16 sp, pc;
+  u8 ime, ie;
+
+  u8 ram_count;
+  u16 ram_address[MAX_RAM];
+  u8 ram_value[MAX_RAM];
+};
+
+struct vector
+{
+  char name[32];
+  struct cpu_state initial;
+  struct cpu_state final;
+  /* T-cycles. */
+  u8 cycles;
+  u8 skip;
+  /* 0x00-0xFF, or 0x100 plus a CB-prefixed opcode. */
+  u16 opcode;
+};
+
+struct opcode_result
+{
+  uf32 pass;
+  uf32 fail;
+  uf32 skip;
+  double ns;
+  char failure[160];
+};
+
+enum json_type
+{
+  JSON_NULL,
+  JSON_BOOL,
+  JSON_NUMBER,
+  JSON_STRING,
+  JSON_ARRAY,
+  JSON_OBJECT
+};
+
+struct json
+{
+  enum json_type type;
+  double number;
+  char *string;
+  /* Member name within an object. */
+  char *key;
+  /* First element or member, and the next one in the parent. */
+  struct json *child;
+  struct json *next;
+};
+
+static u8 mem[0x10000];
+static Gameboy gb;
+static struct opcode_result results[0x200];
+static u32 invalid_opcode;
+
+u8 read_rom(Gameboy *gb, const uf32 address)
+{
+  (void)gb;
+  return mem[address & 0x7FFF];
+}
+
+u8 read_ram(Gameboy *gb, const uf32 address)
+{
+  (void)gb;
+  return mem[CART_RAM_ADDR + (address & 0x1FFF)];
+}
+
+void write_ram(Gameboy *gb, const uf32 address, const u8 value)
+{
+  (void)gb;
+  mem[CART_RAM_ADDR + (address & 0x1FFF)] = value;
+}
+
+/* Installed as the MBC so that writes to ROM store to it. */
+static void write_rom(Gameboy *gb, const uint_fast16_t address, const u8 value)
+{
+  (void)gb;
+  mem[address] = value;
+}
+
+void Error(Gameboy *gb, const enum Error gb_err, const u16 value)
+{
+  (void)gb;
+  (void)value;
+
+  if (gb_err == INVALID_OPCODE)
+    invalid_opcode = 1;
+}
+
+static u64 now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void json_free(struct json *j)
+{
+  while (j != NULL)
+  {
+    struct json *next = j->next;
+
+    json_free(j->child);
+    free(j->string);
+    free(j->key);
+    free(j);
+    j = next;
+  }
+}
+
+static const char *json_skip(const char *p)
+{
+  while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+    p++;
+
+  return p;
+}
+
+/* Escapes other than \" and \\ are kept as the escaped character. */
+static char *json_parse_string(const char **p)
+{
+  const char *s = json_skip(*p);
+  char *out;
+  size_t n = 0;
+
+  if (*s++ != '"')
+    return NULL;
+
+  if ((out = malloc(strlen(s) + 1)) == NULL)
+    return NULL;
+
+  while (*s != '"')
+  {
+    if (*s == '\0')
+    {
+      free(out);
+      return NULL;
+    }
+
+    if (*s == '\\' && s[1] != '\0')
+      s++;
+
+    out[n++] = *s++;
+  }
+
+  out[n] = '\0';
+  *p = s + 1;
+  return out;
+}
+
+static struct json *json_parse(const char **p, const uf32 depth)
+{
+  struct json *j;
+
+  *p = json_skip(*p);
+
+  if (depth > 64 || (j = calloc(1, sizeof(*j))) == NULL)
+    return NULL;
+
+  switch (**p)
+  {
+  case '{':
+  case '[':
+  {
+    const char close = **p == '{' ? '}' : ']';
+    struct json **tail = &j->child;
+
+    j->type = close == '}' ? JSON_OBJECT : JSON_ARRAY;
+    *p = json_skip(*p + 1);
+
+    if (**p == close)
+    {
+      (*p)++;
+      return j;
+    }
+
+    for (;;)
+    {
+      char *key = NULL;
+      struct json *v;
+
+      if (j->type == JSON_OBJECT)
+      {
+        if ((key = json_parse_string(p)) == NULL)
+          goto fail;
+
+        *p = json_skip(*p);
+
+        if (**p != ':')
+        {
+          free(key);
+          goto fail;
+        }
+
+        (*p)++;
+      }
+
+      if ((v = json_parse(p, depth + 1)) == NULL)
+      {
+        free(key);
+        goto fail;
+      }
+
+      v->key = key;
+      *tail = v;
+      tail = &v->next;
+      *p = json_skip(*p);
+
+      if (**p == close)
+      {
+        (*p)++;
+        return j;
+      }
+
+      if (**p != ',')
+        goto fail;
+
+      (*p)++;
+    }
+  }
+
+  case '"':
+    j->type = JSON_STRING;
+
+    if ((j->string = json_parse_string(p)) == NULL)
+      goto fail;
+
+    return j;
+
+  case 't':
+  case 'f':
+  case 'n':
+  {
+    static const char *const literals[] = {"true", "false", "null"};
+
+    for (uf8 i = 0; i < 3; i++)
+    {
+      if (strncmp(*p, literals[i], strlen(literals[i])) == 0)
+      {
+        j->type = i < 2 ? JSON_BOOL : JSON_NULL;
+        j->number = i == 0;
+        *p += strlen(literals[i]);
+        return j;
+      }
+    }
+
+    goto fail;
+  }
+
+  default:
+  {
+    char *end;
+
+    j->type = JSON_NUMBER;
+    j->number = strtod(*p, &end);
+
+    if (end == *p)
+      goto fail;
+
+    *p = end;
+    return j;
+  }
+  }
+
+fail:
+  json_free(j);
+  return NULL;
+}
+
+static const struct json *json_get(const struct json *j, const char *key)
+{
+  if (j == NULL || j->type != JSON_OBJECT)
+    return NULL;
+
+  for (j = j->child; j != NULL; j = j->next)
+  {
+    if (strcmp(j->key, key) == 0)
+      return j;
+  }
+
+  return NULL;
+}
+
+/* Element i of an array, or NULL. */
+static const struct json *json_at(const struct json *j, uf32 i)
+{
+  if (j == NULL || j->type != JSON_ARRAY)
+    return NULL;
+
+  for (j = j->child; j != NULL && i; j = j->next)
+    i--;
+
+  return j;
+}
+
+static int json_int(const struct json *j, const char *key, long *out)
+{
+  const struct json *v = key != NULL ? json_get(j, key) : j;
+
+  if (v == NULL || (v->type != JSON_NUMBER && v->type != JSON_BOOL))
+    return -1;
+
+  *out = (long)v->number;
+  return 0;
+}
+
+/* Memory that behaves as RAM here. */
+static int plain(const uf32 address)
+{
+  return address < ECHO_ADDR || (address >= OAM_ADDR && address < UNUSED_ADDR) ||
+         (address >= HRAM_ADDR && address < INTR_EN_ADDR);
+}
+
+static int state_from_json(const struct json *j, struct cpu_state *s)
+{
+  static const char *const names[] = {"a", "f", "b", "c", "d", "e", "h", "l"};
+  u8 *const regs[] = {&s->a, &s->f, &s->b, &s->c, &s->d, &s->e, &s->h, &s->l};
+  const struct json *ram = json_get(j, "ram");
+  const struct json *e;
+  long v;
+
+  memset(s, 0, sizeof(*s));
+
+  for (uf8 i = 0; i < 8; i++)
+  {
+    if (json_int(j, names[i], &v) != 0)
+      return -1;
+
+    *regs[i] = v;
+  }
+
+  if (json_int(j, "sp", &v) != 0)
+    return -1;
+
+  s->sp = v;
+
+  if (json_int(j, "pc", &v) != 0)
+    return -1;
+
+  s->pc = v;
+
+  if (json_int(j, "ime", &v) == 0)
+    s->ime = v;
+
+  if (json_int(j, "ie", &v) == 0)
+    s->ie = v;
+
+  if (ram == NULL || ram->type != JSON_ARRAY)
+    return -1;
+
+  for (e = ram->child; e != NULL; e = e->next)
+  {
+    long address, value;
+
+    if (s->ram_count == MAX_RAM || json_int(json_at(e, 0), NULL, &address) != 0 ||
+        json_int(json_at(e, 1), NULL, &value) != 0)
+      return -1;
+
+    s->ram_address[s->ram_count] = address;
+    s->ram_value[s->ram_count] = value;
+    s->ram_count++;
+  }
+
+  return 0;
+}
+
+static int ram_find(const struct cpu_state *s, const u16 address)
+{
+  for (uf8 i = 0; i < s->ram_count; i++)
+  {
+    if (s->ram_address[i] == address)
+      return s->ram_value[i];
+  }
+
+  return -1;
+}
+
+static int vector_from_json(const struct json *j, struct vector *v)
+{
+  const struct json *name = json_get(j, "name");
+  const struct json *cycles = json_get(j, "cycles");
+  const struct json *c;
+  int op;
+
+  memset(v, 0, sizeof(*v));
+
+  if (name != NULL && name->type == JSON_STRING)
+    snprintf(v->name, sizeof(v->name), "%s", name->string);
+
+  if (state_from_json(json_get(j, "initial"), &v->initial) != 0 ||
+      state_from_json(json_get(j, "final"), &v->final) != 0 ||
+      cycles == NULL || cycles->type != JSON_ARRAY)
+    return -1;
+
+  if ((op = ram_find(&v->initial, v->initial.pc)) < 0)
+    return -1;
+
+  v->opcode = op;
+
+  if (op == 0xCB)
+  {
+    if ((op = ram_find(&v->initial, (v->initial.pc + 1) & 0xFFFF)) < 0)
+      return -1;
+
+    v->opcode = 0x100 | op;
+  }
+
+  for (uf8 i = 0; i < v->initial.ram_count; i++)
+    v->skip |= !plain(v->initial.ram_address[i]);
+
+  for (uf8 i = 0; i < v->final.ram_count; i++)
+    v->skip |= !plain(v->final.ram_address[i]);
+
+  /* [address, value, "r-m"] or [address, value, "-wm"]; null when idle. */
+  for (c = cycles->child; c != NULL; c = c->next)
+  {
+    const struct json *kind = json_at(c, 2);
+    long address;
+
+    v->cycles += 4;
+
+    if (kind == NULL || kind->type != JSON_STRING ||
+        json_int(json_at(c, 0), NULL, &address) != 0)
+      continue;
+
+    if (strchr(kind->string, 'w') != NULL || strchr(kind->string, 'r') != NULL)
+      v->skip |= !plain(address);
+  }
+
+  return 0;
+}
+
+static int load_file(const char *file_name, struct vector **vectors,
+                     size_t *count, size_t *capacity)
+{
+  FILE *f = fopen(file_name, "rb");
+  char *text = NULL;
+  long size;
+  int ret = -1;
+
+  if (f == NULL)
+  {
+    printf("%s: %s\n", file_name, strerror(errno));
+    return -1;
+  }
+
+  if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 ||
+      fseek(f, 0, SEEK_SET) != 0 || (text = malloc(size + 1)) == NULL ||
+      fread(text, 1, size, f) != (size_t)size)
+  {
+    printf("%s: %s\n", file_name, strerror(errno));
+    goto out;
+  }
+
+  text[size] = '\0';
+
+  if (size >= 12 && memcmp(text, VECTOR_MAGIC, 4) == 0)
+  {
+    u32 version, n;
+
+    memcpy(&version, text + 4, sizeof(version));
+    memcpy(&n, text + 8, sizeof(n));
+
+    if (version != VECTOR_VERSION ||
+        (size_t)size != 12 + (size_t)n * sizeof(struct vector))
+    {
+      printf("%s: not a version %d vector file\n", file_name, VECTOR_VERSION);
+      goto out;
+    }
+
+    for (u32 i = 0; i < n; i++)
+    {
+      if (*count == *capacity)
+      {
+        struct vector *grown;
+
+        *capacity = *capacity ? 2 * *capacity : 4096;
+
+        if ((grown = realloc(*vectors, *capacity * sizeof(*grown))) == NULL)
+        {
+          printf("%d: %s\n", __LINE__, strerror(errno));
+          goto out;
+        }
+
+        *vectors = grown;
+      }
+
+      memcpy(&(*vectors)[*count], text + 12 + i * sizeof(struct vector),
+             sizeof(struct vector));
+
+      if ((*vectors)[*count].opcode >= 0x200)
+      {
+        printf("%s: invalid vector %lu\n", file_name, (unsigned long)*count);
+        goto out;
+      }
+
+      (*count)++;
+    }
+  }
+  else
+  {
+    const char *p = text;
+    struct json *root = json_parse(&p, 0);
+    const struct json *t;
+
+    if (root == NULL || root->type != JSON_ARRAY)
+    {
+      printf("%s: invalid JSON\n", file_name);
+      json_free(root);
+      goto out;
+    }
+
+    for (t = root->child; t != NULL; t = t->next)
+    {
+      if (*count == *capacity)
+      {
+        struct vector *grown;
+
+        *capacity = *capacity ? 2 * *capacity : 4096;
+
+        if ((grown = realloc(*vectors, *capacity * sizeof(*grown))) == NULL)
+        {
+          printf("%d: %s\n", __LINE__, strerror(errno));
+          json_free(root);
+          goto out;
+        }
+
+        *vectors = grown;
+      }
+
+      if (vector_from_json(t, &(*vectors)[*count]) != 0)
+      {
+        printf("%s: invalid vector %lu\n", file_name, (unsigned long)*count);
+        json_free(root);
+        goto out;
+      }
+
+      (*count)++;
+    }
+
+    json_free(root);
+  }
+
+  ret = 0;
+
+out:
+  fclose(f);
+  free(text);
+  return ret;
+}
+
+static int write_vectors(const char *file_name, const struct vector *vectors,
+                         const size_t count)
+{
+  FILE *f = fopen(file_name, "wb");
+  const u32 version = VECTOR_VERSION, n = count;
+  int ok;
+
+  if (f == NULL)
+    return -1;
+
+  ok = fwrite(VECTOR_MAGIC, 1, 4, f) == 4 &&
+       fwrite(&version, sizeof(version), 1, f) == 1 &&
+       fwrite(&n, sizeof(n), 1, f) == 1 &&
+       fwrite(vectors, sizeof(*vectors), count, f) == count;
+
+  return fclose(f) == 0 && ok ? 0 : -1;
+}
+
+/* A cartridge with 8 KB of RAM and writable ROM, backed by mem. */
+static int setup(void)
+{
+  u8 x = 0;
+
+  memset(mem, 0, sizeof(mem));
+  mem[0x0147] = 0x00;
+  mem[0x0148] = 0x00;
+  mem[0x0149] = 0x02;
+
+  for (u16 i = 0x0134; i <= 0x014C; i++)
+    x = x - mem[i] - 1;
+
+  mem[ROM_HEADER_HASH_LOC] = x;
+
+  if (gb_init(&gb, &read_rom, &read_ram, &write_ram, &Error, NULL) !=
+      INIT_NO_ERROR)
+    return -1;
+
+  audio_set_synth(&gb.apu, 0);
+  gb.mbc_write = &write_rom;
+  gb.cartridge_ram = 1;
+  gb.enable_cart_ram = 1;
+  gb.num_ram_banks = 1;
+  gb.cart_ram_bank = 0;
+  gb.selected_rom_bank = 1;
+  return 0;
+}
+
+static void poke(const u16 address, const u8 value)
+{
+  write_byte(&gb, address, value);
+}
+
+static void load_vector(const struct vector *v)
+{
+  const struct cpu_state *s = &v->initial;
+
+  gb.cpu_reg.a = s->a;
+  gb.cpu_reg.f = s->f;
+  gb.cpu_reg.B = s->b;
+  gb.cpu_reg.C = s->c;
+  gb.cpu_reg.D = s->d;
+  gb.cpu_reg.E = s->e;
+  gb.cpu_reg.H = s->h;
+  gb.cpu_reg.L = s->l;
+  gb.cpu_reg.SP = s->sp;
+  gb.cpu_reg.PC = s->pc;
+  gb.ime = s->ime;
+  gb.halt = 0;
+  gb.hw_reg.IE = s->ie;
+  gb.hw_reg.IF = 0;
+  gb.hw_reg.LCDC = 0;
+  gb.hw_reg.TAC = 0;
+
+  for (uf8 i = 0; i < s->ram_count; i++)
+    poke(s->ram_address[i], s->ram_value[i]);
+}
+
+/* Runs v once; on failure describes the first difference in why. */
+static int run_vector(const struct vector *v, char *why, const size_t len)
+{
+  const struct cpu_state *s = &v->final;
+  u64 cycles;
+
+  load_vector(v);
+  invalid_opcode = 0;
+  cycles = gb.timer.cycles;
+  cpu_step(&gb);
+  cycles = gb.timer.cycles - cycles;
+
+#define CHECK(what, got, expected)                                          \
+  if ((got) != (expected))                                                  \
+  {                                                                         \
+    snprintf(why, len, "%s: %s %X, expected %X", v->name, what,             \
+             (unsigned)(got), (unsigned)(expected));                        \
+    return -1;                                                              \
+  }
+
+  CHECK("invalid opcode", invalid_opcode, 0);
+  CHECK("A", gb.cpu_reg.a, s->a);
+  CHECK("F", gb.cpu_reg.f, s->f);
+  CHECK("B", gb.cpu_reg.B, s->b);
+  CHECK("C", gb.cpu_reg.C, s->c);
+  CHECK("D", gb.cpu_reg.D, s->d);
+  CHECK("E", gb.cpu_reg.E, s->e);
+  CHECK("H", gb.cpu_reg.H, s->h);
+  CHECK("L", gb.cpu_reg.L, s->l);
+  CHECK("SP", gb.cpu_reg.SP, s->sp);
+  CHECK("PC", gb.cpu_reg.PC, s->pc);
+  CHECK("IME", gb.ime, s->ime);
+  CHECK("cycles", cycles, v->cycles);
+
+  for (uf8 i = 0; i < s->ram_count; i++)
+  {
+    char name[16];
+
+    snprintf(name, sizeof(name), "[%04X]", (unsigned)s->ram_address[i]);
+    CHECK(name, read_byte(&gb, s->ram_address[i]), s->ram_value[i]);
+  }
+
+#undef CHECK
+
+  return 0;
+}
+
+/* Host ns per instruction over the n vectors at v, all passing. */
+static double time_vectors(const struct vector *const *v, const size_t n,
+                           const double target_ns)
+{
+  u64 reps = 1, start, step_ns, load_ns;
+
+  if (n == 0)
+    return 0.0;
+
+  for (;;)
+  {
+    start = now_ns();
+
+    for (u64 r = 0; r < reps; r++)
+    {
+      for (size_t i = 0; i < n; i++)
+      {
+        load_vector(v[i]);
+        cpu_step(&gb);
+      }
+    }
+
+    step_ns = now_ns() - start;
+
+    if (step_ns >= target_ns || reps >= ((u64)1 << 30))
+      break;
+
+    reps *= 2;
+  }
+
+  start = now_ns();
+
+  for (u64 r = 0; r < reps; r++)
+  {
+    for (size_t i = 0; i < n; i++)
+      load_vector(v[i]);
+  }
+
+  load_ns = now_ns() - start;
+
+  return step_ns > load_ns ? (double)(step_ns - load_ns) / (reps * n) : 0.0;
+}
+
+static void usage(const char *name)
+{
+  printf("Usage: %s [OPTIONS] VECTORS...\n", name);
+  puts("  -o FILE  Also write the loaded vectors to FILE in binary form.");
+  puts("  -t MS    Target timing per opcode in ms (default 5; 0 for none).");
+  puts("  -v       List every failing vector, not just the first per opcode.");
+  puts("VECTORS are SingleStepTests sm83 JSON files or binary files from -o.");
+}
+
+int main(int argc, char **argv)
+{
+  struct vector *vectors = NULL;
+  const struct vector **passed = NULL;
+  size_t count = 0, capacity = 0;
+  const char *out_file_name = NULL;
+  double target_ms = 5.0;
+  int verbose = 0;
+  int files = 0;
+  uf32 pass = 0, fail = 0, skip = 0;
+  int ret = EXIT_SUCCESS;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+      out_file_name = argv[++i];
+    else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+      target_ms = atof(argv[++i]);
+    else if (strcmp(argv[i], "-v") == 0)
+      verbose = 1;
+    else if (argv[i][0] == '-')
+    {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    else if (load_file(argv[i], &vectors, &count, &capacity) != 0)
+    {
+      ret = EXIT_FAILURE;
+      goto out;
+    }
+    else
+      files++;
+  }
+
+  if (files == 0)
+  {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (out_file_name != NULL && write_vectors(out_file_name, vectors, count) != 0)
+  {
+    printf("%s: %s\n", out_file_name, strerror(errno));
+    ret = EXIT_FAILURE;
+    goto out;
+  }
+
+  if (setup() != 0 || (passed = malloc(count * sizeof(*passed) + 1)) == NULL)
+  {
+    printf("%d: setup failed\n", __LINE__);
+    ret = EXIT_FAILURE;
+    goto out;
+  }
+
+  for (size_t i = 0; i < count; i++)
+  {
+    struct opcode_result *r = &results[vectors[i].opcode];
+    char why[sizeof(r->failure)];
+
+    if (vectors[i].skip)
+      r->skip++;
+    else if (run_vector(&vectors[i], why, sizeof(why)) == 0)
+      r->pass++;
+    else
+    {
+      if (verbose)
+        printf("FAIL %s\n", why);
+
+      if (!r->fail++)
+        memcpy(r->failure, why, sizeof(why));
+    }
+  }
+
+  printf("# %lu vectors from %d files; ns per instruction over passing vectors\n",
+         (unsigned long)count, files);
+  printf("%-6s %8s %8s %8s %10s\n", "opcode", "pass", "fail", "skip", "ns");
+
+  for (uf32 op = 0; op < 0x200; op++)
+  {
+    struct opcode_result *r = &results[op];
+    size_t n = 0;
+
+    if (!r->pass && !r->fail && !r->skip)
+      continue;
+
+    if (target_ms > 0.0)
+    {
+      for (size_t i = 0; i < count; i++)
+      {
+        char why[sizeof(r->failure)];
+
+        if (vectors[i].opcode == op && !vectors[i].skip &&
+            run_vector(&vectors[i], why, sizeof(why)) == 0)
+          passed[n++] = &vectors[i];
+      }
+
+      r->ns = time_vectors(passed, n, target_ms * 1e6);
+    }
+
+    if (op < 0x100)
+      printf("%02X     ", (unsigned)op);
+    else
+      printf("CB %02X  ", (unsigned)(op & 0xFF));
+
+    printf("%8lu %8lu %8lu %10.2f\n", (unsigned long)r->pass,
+           (unsigned long)r->fail, (unsigned long)r->skip, r->ns);
+
+    if (r->fail && !verbose)
+      printf("       first failure: %s\n", r->failure);
+
+    pass += r->pass;
+    fail += r->fail;
+    skip += r->skip;
+  }
+
+  printf("total: %lu passed, %lu failed, %lu skipped\n", (unsigned long)pass,
+         (unsigned long)fail, (unsigned long)skip);
+
+  if (fail)
+    ret = EXIT_FAILURE;
+
+out:
+  free(vectors);
+  free(passed);
+  return ret;
+}
@@ -0,0 +1,506 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "glitzboy.h"
+#include "files.h"
+
+/*
+ * Microbenchmarks of the core's hot functions, each driven on its own
+ * from a state reached by running one of the benchmark ROMs. Every
+ * repetition starts from that same state, so repetitions do identical
+ * work; the spread between them is measurement noise.
+ *
+ * The number of operations per repetition is doubled until a repetition
+ * takes the target time, then WARMUP_REPS repetitions are thrown away
+ * before the measured ones.
+ */
+
+#define WARMUP_REPS 3
+#define ADDRESSES 4096
+
+struct misc_data
+{
+  u8 *rom;
+  size_t rom_size;
+  u8 *cartridgeram;
+};
+
+struct machine
+{
+  Gameboy gb;
+  struct misc_data data;
+  u8 *state;
+  size_t state_size;
+};
+
+struct bench
+{
+  const char *name;
+  const char *unit;
+  const char *rom;
+  uf32 frames;
+  void (*setup)(Gameboy *gb);
+  u64 (*run)(Gameboy *gb, u64 n);
+};
+
+static u16 addresses[ADDRESSES];
+static u8 values[ADDRESSES];
+static f32 samples[AUDIO_CHUNK];
+static volatile u64 sink;
+
+u8 read_rom(Gameboy *gb, const uf32 address)
+{
+  const struct misc_data *const p = gb->direct.misc_data;
+  return address < p->rom_size ? p->rom[address] : 0xFF;
+}
+
+u8 read_ram(Gameboy *gb, const uf32 address)
+{
+  const struct misc_data *const p = gb->direct.misc_data;
+  return p->cartridgeram[address];
+}
+
+void write_ram(Gameboy *gb, const uf32 address, const u8 value)
+{
+  const struct misc_data *const p = gb->direct.misc_data;
+  p->cartridgeram[address] = value;
+}
+
+void Error(Gameboy *gb, const enum Error gb_err, const u16 value)
+{
+  (void)gb;
+  (void)gb_err;
+  (void)value;
+}
+
+void sink_draw_line(Gameboy *gb, const u8 pixels[160], const uint_least8_t line)
+{
+  u64 x = 0;
+
+  (void)gb;
+
+  memcpy(&x, pixels + (line & 0x7F), sizeof(x));
+  sink += x;
+}
+
+static u32 xorshift(void)
+{
+  static u32 x = 2463534242u;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+static u64 now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Address tables; lo and hi are inclusive. */
+static void random_addresses(const u16 lo, const u16 hi)
+{
+  for (uf32 i = 0; i < ADDRESSES; i++)
+    addresses[i] = lo + xorshift() % (hi - lo + 1);
+}
+
+static void pick_addresses(const u16 *from, const uf32 count)
+{
+  for (uf32 i = 0; i < ADDRESSES; i++)
+    addresses[i] = from[xorshift() % count];
+}
+
+static void setup_rom_reads(Gameboy *gb)
+{
+  (void)gb;
+  random_addresses(0x0000, 0x7FFF);
+}
+
+static void setup_ram_reads(Gameboy *gb)
+{
+  (void)gb;
+
+  for (uf32 i = 0; i < ADDRESSES; i++)
+    addresses[i] = xorshift() & 3 ? 0xC000 + xorshift() % 0x2000
+                                  : 0xFF80 + xorshift() % 0x7F;
+}
+
+/* Registers games poll or rewrite every frame. */
+static const u16 io_regs[] = {
+    0xFF00, 0xFF04, 0xFF05, 0xFF06, 0xFF07, 0xFF0F, 0xFF11, 0xFF12,
+    0xFF16, 0xFF17, 0xFF24, 0xFF25, 0xFF26, 0xFF40, 0xFF41, 0xFF42,
+    0xFF43, 0xFF44, 0xFF45, 0xFF47, 0xFF48, 0xFF49, 0xFF4A, 0xFF4B,
+    0xFFFF};
+
+static void setup_io(Gameboy *gb)
+{
+  pick_addresses(io_regs, sizeof(io_regs) / sizeof(io_regs[0]));
+
+  /* Write back what is there, so that the traffic does not change what
+   * the machine is doing (DIV is reset either way). */
+  for (uf32 i = 0; i < ADDRESSES; i++)
+    values[i] = read_byte(gb, addresses[i]);
+}
+
+static void setup_mbc_writes(Gameboy *gb)
+{
+  for (uf32 i = 0; i < ADDRESSES; i++)
+  {
+    if (xorshift() & 1)
+    {
+      addresses[i] = 0x2000 + xorshift() % 0x2000;
+      values[i] = 1 + xorshift() % (gb->num_rom_banks - 1);
+    }
+    else
+    {
+      addresses[i] = 0x4000 + xorshift() % 0x2000;
+      values[i] = xorshift() % 4;
+    }
+  }
+}
+
+static void setup_channels(Gameboy *gb)
+{
+  static const u16 regs[][2] = {
+      {0xFF26, 0x80}, {0xFF24, 0x77}, {0xFF25, 0xFF},
+      {0xFF10, 0x16}, {0xFF11, 0x80}, {0xFF12, 0xF3}, {0xFF13, 0x00}, {0xFF14, 0x86},
+      {0xFF16, 0x40}, {0xFF17, 0xF1}, {0xFF18, 0x55}, {0xFF19, 0x87},
+      {0xFF1A, 0x80}, {0xFF1C, 0x20}, {0xFF1D, 0x00}, {0xFF1E, 0x87},
+      {0xFF21, 0xF2}, {0xFF22, 0x52}, {0xFF23, 0x80}};
+
+  audio_set_synth(&gb->apu, 1);
+
+  for (uf32 i = 0; i < sizeof(regs) / sizeof(regs[0]); i++)
+    write_byte(gb, regs[i][0], regs[i][1]);
+}
+
+static u64 run_read_byte(Gameboy *gb, const u64 n)
+{
+  u64 x = 0;
+
+  for (u64 i = 0; i < n; i++)
+    x += read_byte(gb, addresses[i % ADDRESSES]);
+
+  return x;
+}
+
+static u64 run_write_byte_ram(Gameboy *gb, const u64 n)
+{
+  for (u64 i = 0; i < n; i++)
+    write_byte(gb, addresses[i % ADDRESSES], i);
+
+  return gb->wram[0];
+}
+
+static u64 run_write_byte(Gameboy *gb, const u64 n)
+{
+  for (u64 i = 0; i < n; i++)
+    write_byte(gb, addresses[i % ADDRESSES], values[i % ADDRESSES]);
+
+  return gb->selected_rom_bank;
+}
+
+static u64 run_cpu_step(Gameboy *gb, const u64 n)
+{
+  for (u64 i = 0; i < n; i++)
+    cpu_step(gb);
+
+  return gb->cpu_reg.PC;
+}
+
+static u64 run_execute_instr(Gameboy *gb, const u64 n)
+{
+  u64 cycles = 0;
+
+  for (u64 i = 0; i < n; i++)
+    cycles += execute_instr(gb);
+
+  return cycles;
+}
+
+static u64 run_draw_line(Gameboy *gb, const u64 n)
+{
+  const u8 ly = gb->hw_reg.LY;
+
+  for (u64 i = 0; i < n; i++)
+  {
+    gb->hw_reg.LY = i % LCD_HEIGHT;
+    draw_line(gb);
+  }
+
+  gb->hw_reg.LY = ly;
+  return 0;
+}
+
+#define RUN_CHANNEL(name, call)                               \
+  static u64 name(Gameboy *gb, const u64 n)                   \
+  {                                                           \
+    Apu *const apu = &gb->apu;                                \
+                                                              \
+    for (u64 i = 0; i < n; i += AUDIO_CHUNK)                  \
+    {                                                         \
+      const uf16 len = MIN(n - i, (u64)AUDIO_CHUNK);          \
+                                                              \
+      call;                                                   \
+    }                                                         \
+                                                              \
+    return samples[0] != 0.0f;                                \
+  }
+
+RUN_CHANNEL(run_update_square, update_square(apu, samples, len, 0))
+RUN_CHANNEL(run_update_wave, update_wave(apu, samples, len))
+RUN_CHANNEL(run_update_noise, update_noise(apu, samples, len))
+
+static const struct bench benches[] = {
+    {"read_byte/rom", "read", "bankswitch", 60, setup_rom_reads, run_read_byte},
+    {"read_byte/ram", "read", "alu", 10, setup_ram_reads, run_read_byte},
+    {"read_byte/io", "read", "sprites", 60, setup_io, run_read_byte},
+    {"write_byte/ram", "write", "alu", 10, setup_ram_reads, run_write_byte_ram},
+    {"write_byte/io", "write", "sprites", 60, setup_io, run_write_byte},
+    {"write_byte/mbc", "write", "bankswitch", 60, setup_mbc_writes, run_write_byte},
+    {"execute_instr", "instr", "alu", 10, NULL, run_execute_instr},
+    {"cpu_step/alu", "step", "alu", 10, NULL, run_cpu_step},
+    {"cpu_step/memcpy", "step", "memcpy", 60, NULL, run_cpu_step},
+    {"cpu_step/sprites", "step", "sprites", 60, NULL, run_cpu_step},
+    {"cpu_step/halt", "step", "halt", 60, NULL, run_cpu_step},
+    {"draw_line/sprites", "line", "sprites", 60, NULL, run_draw_line},
+    {"draw_line/window", "line", "window", 60, NULL, run_draw_line},
+    {"update_square", "sample", "alu", 1, setup_channels, run_update_square},
+    {"update_wave", "sample", "alu", 1, setup_channels, run_update_wave},
+    {"update_noise", "sample", "alu", 1, setup_channels, run_update_noise},
+};
+
+#define BENCH_COUNT (sizeof(benches) / sizeof(benches[0]))
+
+static struct machine machine;
+
+static void free_machine(struct machine *m)
+{
+  free(m->data.rom);
+  free(m->data.cartridgeram);
+  free(m->state);
+  memset(m, 0, sizeof(*m));
+}
+
+/* Loads the ROM and runs it for the bench's frames, then its setup. */
+static int setup_machine(struct machine *m, const char *dir,
+                         const struct bench *b)
+{
+  char path[1024];
+  enum InitError err;
+
+  snprintf(path, sizeof(path), "%s/%s.gb", dir, b->rom);
+
+  if ((m->data.rom = load_rom_into_ram(path, &m->data.rom_size)) == NULL)
+  {
+    printf("%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  if ((err = gb_init(&m->gb, &read_rom, &read_ram, &write_ram, &Error,
+                     &m->data)) != INIT_NO_ERROR)
+  {
+    printf("%s: init error %d\n", path, err);
+    return -1;
+  }
+
+  if (m->data.rom_size >= (size_t)m->gb.num_rom_banks * ROM_BANK_SIZE)
+    m->gb.direct.rom = m->data.rom;
+
+  if (get_save_size(&m->gb))
+  {
+    if ((m->data.cartridgeram = calloc(1, get_save_size(&m->gb))) == NULL)
+    {
+      printf("%d: %s\n", __LINE__, strerror(errno));
+      return -1;
+    }
+
+    m->gb.direct.cart_ram = m->data.cartridgeram;
+  }
+
+  init_gpu(&m->gb, &sink_draw_line);
+  audio_set_synth(&m->gb.apu, 0);
+
+  for (uf32 f = 0; f < b->frames; f++)
+    run_frame(&m->gb);
+
+  if (b->setup != NULL)
+    b->setup(&m->gb);
+
+  m->state_size = gb_state_size(&m->gb);
+
+  if ((m->state = malloc(m->state_size)) == NULL)
+  {
+    printf("%d: %s\n", __LINE__, strerror(errno));
+    return -1;
+  }
+
+  gb_state_save(&m->gb, m->state, m->state_size);
+  return 0;
+}
+
+static double rep(struct machine *m, const struct bench *b, const u64 n)
+{
+  u64 start;
+
+  gb_state_load(&m->gb, m->state, m->state_size);
+  start = now_ns();
+  sink += b->run(&m->gb, n);
+  return (double)(now_ns() - start);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  const double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void measure(struct machine *m, const struct bench *b, const uf32 reps,
+                    const double target_ns)
+{
+  double ns[256];
+  double mean = 0.0, var = 0.0;
+  u64 n = 256;
+
+  while (rep(m, b, n) < target_ns && n < ((u64)1 << 40))
+    n *= 2;
+
+  for (uf32 i = 0; i < WARMUP_REPS; i++)
+    rep(m, b, n);
+
+  for (uf32 i = 0; i < reps; i++)
+  {
+    ns[i] = rep(m, b, n) / n;
+    mean += ns[i];
+  }
+
+  mean /= reps;
+
+  for (uf32 i = 0; i < reps; i++)
+    var += (ns[i] - mean) * (ns[i] - mean);
+
+  var /= reps > 1 ? reps - 1 : 1;
+  qsort(ns, reps, sizeof(ns[0]), compare_double);
+
+  printf("%-20s %-7s %10.3f %10.3f %10.3f %10.4f %6.2f%% %12llu\n", b->name,
+         b->unit, ns[reps / 2], mean, ns[0], sqrt(var),
+         mean > 0.0 ? 100.0 * sqrt(var) / mean : 0.0, (unsigned long long)n);
+}
+
+static int pin(const int cpu)
+{
+#ifdef __linux__
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+
+  if (sched_setaffinity(0, sizeof(set), &set) != 0)
+  {
+    printf("CPU %d: %s\n", cpu, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+#else
+  (void)cpu;
+  puts("Pinning is only supported on Linux.");
+  return -1;
+#endif
+}
+
+static void usage(const char *name)
+{
+  printf("Usage: %s [OPTIONS] ROM_DIR [NAME...]\n", name);
+  puts("  -c N   Pin to CPU N (default: the CPU it starts on; -1 for none).");
+  puts("  -r N   Measured repetitions per benchmark (default 15, max 256).");
+  puts("  -t MS  Target time per repetition in ms (default 20).");
+  puts("Only benchmarks whose names start with one of the NAMEs are run.");
+}
+
+int main(int argc, char **argv)
+{
+  const char *dir = NULL;
+  char **names = NULL;
+  int name_count = 0;
+  int cpu = -2;
+  uf32 reps = 15;
+  double target_ms = 20.0;
+  int ret = EXIT_SUCCESS;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+      cpu = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+      reps = strtoul(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+      target_ms = atof(argv[++i]);
+    else if (argv[i][0] == '-')
+    {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    else
+    {
+      dir = argv[i];
+      names = argv + i + 1;
+      name_count = argc - i - 1;
+      break;
+    }
+  }
+
+  if (dir == NULL || reps == 0 || reps > 256 || target_ms <= 0.0)
+  {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+#ifdef __linux__
+  if (cpu == -2)
+    cpu = sched_getcpu();
+#endif
+
+  if (cpu >= 0 && pin(cpu) != 0)
+    return EXIT_FAILURE;
+
+  printf("# cpu %d, %u repetitions, %.0f ms each, ns per op\n", cpu,
+         (unsigned)reps, target_ms);
+  printf("%-20s %-7s %10s %10s %10s %10s %7s %12s\n", "benchmark", "op",
+         "median", "mean", "min", "stddev", "cv", "ops/rep");
+
+  for (uf32 i = 0; i < BENCH_COUNT; i++)
+  {
+    const struct bench *b = &benches[i];
+    int run = name_count == 0;
+
+    for (int j = 0; j < name_count; j++)
+      run |= strncmp(b->name, names[j], strlen(names[j])) == 0;
+
+    if (!run)
+      continue;
+
+    if (setup_machine(&machine, dir, b) == 0)
+      measure(&machine, b, reps, target_ms * 1e6);
+    else
+      ret = EXIT_FAILURE;
+
+    free_machine(&machine);
+  }
+
+  return ret;
+}
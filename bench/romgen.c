@@ -0,0 +1,697 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+
+/*
+ * Generates the benchmark ROMs. Each ROM is written out by a small
+ * assembler below: emit() appends opcode bytes, labels are ROM offsets and
+ * relative jumps are resolved as they are emitted (backwards) or patched
+ * with land() (forwards). Only the opcodes the ROMs use are named.
+ */
+
+enum
+{
+  NOP = 0x00,
+  LD_BC_NN = 0x01,
+  INC_B = 0x04,
+  DEC_B = 0x05,
+  LD_B_N = 0x06,
+  RLCA = 0x07,
+  ADD_HL_BC = 0x09,
+  DEC_BC = 0x0B,
+  INC_C = 0x0C,
+  DEC_C = 0x0D,
+  LD_C_N = 0x0E,
+  LD_DE_NN = 0x11,
+  LD_DE_A = 0x12,
+  INC_DE = 0x13,
+  DEC_D = 0x15,
+  LD_D_N = 0x16,
+  JR = 0x18,
+  LD_A_DE = 0x1A,
+  INC_E = 0x1C,
+  LD_E_N = 0x1E,
+  JR_NZ = 0x20,
+  LD_HL_NN = 0x21,
+  LD_HLI_A = 0x22,
+  LD_H_N = 0x26,
+  DAA = 0x27,
+  LD_A_HLI = 0x2A,
+  LD_L_N = 0x2E,
+  LD_SP_NN = 0x31,
+  INC_A = 0x3C,
+  DEC_A = 0x3D,
+  LD_A_N = 0x3E,
+  LD_C_A = 0x4F,
+  LD_L_A = 0x6F,
+  HALT = 0x76,
+  LD_HL_A = 0x77,
+  LD_A_B = 0x78,
+  LD_A_C = 0x79,
+  LD_A_H = 0x7C,
+  LD_A_L = 0x7D,
+  LD_A_HL = 0x7E,
+  ADD_A_B = 0x80,
+  ADD_A_C = 0x81,
+  ADC_A_C = 0x89,
+  SUB_D = 0x92,
+  SBC_A_E = 0x9B,
+  AND_H = 0xA4,
+  XOR_H = 0xAC,
+  XOR_L = 0xAD,
+  XOR_A = 0xAF,
+  OR_C = 0xB1,
+  CP_B = 0xB8,
+  POP_BC = 0xC1,
+  JP = 0xC3,
+  PUSH_BC = 0xC5,
+  ADD_A_N = 0xC6,
+  RET = 0xC9,
+  CB = 0xCB,
+  CALL = 0xCD,
+  RETI = 0xD9,
+  LDH_N_A = 0xE0,
+  POP_HL = 0xE1,
+  LDH_C_A = 0xE2,
+  PUSH_HL = 0xE5,
+  AND_N = 0xE6,
+  LD_NN_A = 0xEA,
+  XOR_N = 0xEE,
+  LDH_A_N = 0xF0,
+  POP_AF = 0xF1,
+  DI = 0xF3,
+  PUSH_AF = 0xF5,
+  OR_N = 0xF6,
+  EI = 0xFB,
+  CP_N = 0xFE,
+
+  /* After CB. */
+  RL_C = 0x11,
+  SWAP_A = 0x37,
+  SRL_B = 0x38
+};
+
+/* I/O registers, as offsets from 0xFF00 for LDH. */
+enum
+{
+  P1 = 0x00,
+  DIV = 0x04,
+  TIMA = 0x05,
+  TMA = 0x06,
+  TAC = 0x07,
+  IF = 0x0F,
+  NR10 = 0x10,
+  NR11 = 0x11,
+  NR12 = 0x12,
+  NR13 = 0x13,
+  NR14 = 0x14,
+  NR21 = 0x16,
+  NR22 = 0x17,
+  NR23 = 0x18,
+  NR24 = 0x19,
+  NR30 = 0x1A,
+  NR32 = 0x1C,
+  NR33 = 0x1D,
+  NR34 = 0x1E,
+  NR42 = 0x21,
+  NR43 = 0x22,
+  NR44 = 0x23,
+  NR50 = 0x24,
+  NR51 = 0x25,
+  NR52 = 0x26,
+  WAVE = 0x30,
+  LCDC = 0x40,
+  STAT = 0x41,
+  SCY = 0x42,
+  SCX = 0x43,
+  LY = 0x44,
+  LYC = 0x45,
+  DMA = 0x46,
+  WY = 0x4A,
+  WX = 0x4B,
+  HRAM = 0x80,
+  IE = 0xFF
+};
+
+#define INT_VBLANK 0x01
+#define INT_STAT 0x02
+#define INT_TIMER 0x04
+#define INT_JOYPAD 0x10
+
+#define SHADOW_OAM 0xC100
+
+struct rom
+{
+  u8 *data;
+  size_t size;
+  size_t pc;
+};
+
+#define EMIT(r, ...) \
+  emit(r, (const u8[]){__VA_ARGS__}, sizeof((const u8[]){__VA_ARGS__}))
+
+void emit(struct rom *r, const u8 *bytes, const size_t len)
+{
+  memcpy(r->data + r->pc, bytes, len);
+  r->pc += len;
+}
+
+/* JP/CALL and friends with a 16-bit operand. */
+void op16(struct rom *r, const u8 op, const u16 nn)
+{
+  EMIT(r, op, nn & 0xFF, nn >> 8);
+}
+
+/* Relative jump back to a label. */
+void jr_to(struct rom *r, const u8 op, const size_t target)
+{
+  const long offset = (long)target - (long)(r->pc + 2);
+
+  if (offset < -128 || offset > 127)
+  {
+    fprintf(stderr, "jr out of range at %#zx\n", r->pc);
+    exit(EXIT_FAILURE);
+  }
+
+  EMIT(r, op, (u8)offset);
+}
+
+/* Forward relative jump; returns the location to land(). */
+size_t jr_fwd(struct rom *r, const u8 op)
+{
+  EMIT(r, op, 0);
+  return r->pc - 1;
+}
+
+void land(struct rom *r, const size_t at)
+{
+  r->data[at] = (u8)(r->pc - (at + 1));
+}
+
+/* JP at an interrupt vector. */
+void vector(struct rom *r, const u16 address, const u16 handler)
+{
+  r->data[address + 0] = JP;
+  r->data[address + 1] = handler & 0xFF;
+  r->data[address + 2] = handler >> 8;
+}
+
+struct rom *rom_new(const char *title, const u8 type, const u8 rom_size,
+                    const u8 ram_size)
+{
+  struct rom *r = malloc(sizeof(*r));
+
+  if (r == NULL || (r->data = calloc(1, 0x8000 << rom_size)) == NULL)
+  {
+    fprintf(stderr, "%s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  r->size = 0x8000 << rom_size;
+  memset(r->data, 0xFF, 0x100);
+  strncpy((char *)r->data + 0x134, title, 15);
+  r->data[0x147] = type;
+  r->data[0x148] = rom_size;
+  r->data[0x149] = ram_size;
+
+  r->pc = 0x100;
+  EMIT(r, NOP);
+  op16(r, JP, 0x150);
+  r->pc = 0x150;
+  op16(r, LD_SP_NN, 0xFFFE);
+
+  return r;
+}
+
+void rom_write(struct rom *r, const char *dir, const char *name)
+{
+  char file_name[1024];
+  u8 x = 0;
+  u16 sum = 0;
+  FILE *f;
+
+  for (u16 i = 0x134; i <= 0x14C; i++)
+    x = x - r->data[i] - 1;
+
+  r->data[0x14D] = x;
+
+  for (size_t i = 0; i < r->size; i++)
+  {
+    if (i != 0x14E && i != 0x14F)
+      sum += r->data[i];
+  }
+
+  r->data[0x14E] = sum >> 8;
+  r->data[0x14F] = sum & 0xFF;
+
+  snprintf(file_name, sizeof(file_name), "%s/%s.gb", dir, name);
+
+  if ((f = fopen(file_name, "wb")) == NULL ||
+      fwrite(r->data, 1, r->size, f) != r->size)
+  {
+    fprintf(stderr, "%s: %s\n", file_name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  fclose(f);
+  free(r->data);
+  free(r);
+}
+
+/* Waits for VBlank and turns the LCD off. */
+void lcd_off(struct rom *r)
+{
+  const size_t wait = r->pc;
+
+  EMIT(r, LDH_A_N, LY, CP_N, 144);
+  jr_to(r, JR_NZ, wait);
+  EMIT(r, XOR_A, LDH_N_A, LCDC);
+}
+
+/* memcpy(DE, HL, BC), clobbering A. */
+size_t memcpy_routine(struct rom *r)
+{
+  const size_t start = r->pc, loop = r->pc;
+
+  EMIT(r, LD_A_HLI, LD_DE_A, INC_DE, DEC_BC, LD_A_B, OR_C);
+  jr_to(r, JR_NZ, loop);
+  EMIT(r, RET);
+  return start;
+}
+
+void call_memcpy(struct rom *r, const size_t routine, const u16 dst,
+                 const u16 src, const u16 len)
+{
+  op16(r, LD_DE_NN, dst);
+  op16(r, LD_HL_NN, src);
+  op16(r, LD_BC_NN, len);
+  op16(r, CALL, routine);
+}
+
+/* Emits a copy of code to HRAM, from where CALL 0xFF80 runs it. */
+void hram_setup(struct rom *r, const u8 *code, const u8 len)
+{
+  const size_t table = 0x3F00;
+  size_t loop;
+
+  memcpy(r->data + table, code, len);
+
+  op16(r, LD_HL_NN, table);
+  EMIT(r, LD_C_N, HRAM);
+  loop = r->pc;
+  EMIT(r, LD_A_HLI, LDH_C_A, INC_C, LD_A_C, CP_N, HRAM + len);
+  jr_to(r, JR_NZ, loop);
+}
+
+/*
+ * Copies the OAM DMA routine to HRAM; CALL HRAM then copies the shadow OAM.
+ * It waits out the transfer in HRAM as the hardware requires.
+ */
+void dma_setup(struct rom *r)
+{
+  static const u8 dma[] = {LD_A_N, SHADOW_OAM >> 8, LDH_N_A, DMA,
+                           LD_A_N, 40, DEC_A, JR_NZ, 0xFD, RET};
+
+  hram_setup(r, dma, sizeof(dma));
+}
+
+/* Fills the tile data at 0x8000 and both tile maps with patterns. */
+void vram_fill(struct rom *r)
+{
+  size_t loop;
+
+  op16(r, LD_HL_NN, 0x8000);
+  loop = r->pc;
+  EMIT(r, LD_A_L, XOR_N, 0x5A, XOR_H, LD_HLI_A, LD_A_H, CP_N, 0x90);
+  jr_to(r, JR_NZ, loop);
+
+  loop = r->pc;
+  EMIT(r, LD_A_L, LD_HLI_A, LD_A_H, CP_N, 0xA0);
+  jr_to(r, JR_NZ, loop);
+}
+
+void gen_alu(const char *dir)
+{
+  struct rom *r = rom_new("BENCH ALU", 0x00, 0, 0);
+  size_t loop;
+
+  EMIT(r, LD_B_N, 1, LD_C_N, 2, LD_D_N, 3, LD_E_N, 4, LD_H_N, 5, LD_L_N, 6);
+  loop = r->pc;
+
+  for (int i = 0; i < 8; i++)
+  {
+    EMIT(r, ADD_A_B, ADC_A_C, SUB_D, SBC_A_E, AND_H, XOR_L, OR_C, CP_B);
+    EMIT(r, INC_B, DEC_C, RLCA, DAA, CB, SWAP_A, CB, RL_C, CB, SRL_B);
+    EMIT(r, ADD_HL_BC, INC_E, DEC_D);
+  }
+
+  op16(r, JP, loop);
+  rom_write(r, dir, "alu");
+}
+
+void gen_memcpy(const char *dir)
+{
+  struct rom *r = rom_new("BENCH MEMCPY", 0x00, 0, 0);
+  size_t routine, loop, skip;
+
+  skip = jr_fwd(r, JR);
+  routine = memcpy_routine(r);
+  land(r, skip);
+
+  for (size_t i = 0x4000; i < 0x8000; i++)
+    r->data[i] = (u8)(i * 7 + (i >> 8));
+
+  loop = r->pc;
+  call_memcpy(r, routine, 0xC000, 0x4000, 0x1000);
+  call_memcpy(r, routine, 0xD000, 0xC000, 0x1000);
+  call_memcpy(r, routine, 0x8800, 0x5000, 0x0800);
+  call_memcpy(r, routine, 0xFF80, 0xC800, 0x0070);
+  op16(r, JP, loop);
+
+  rom_write(r, dir, "memcpy");
+}
+
+/* MBC1 with 8 ROM banks and 4 RAM banks; copies from each bank to RAM. */
+void gen_bankswitch(const char *dir)
+{
+  struct rom *r = rom_new("BENCH BANKS", 0x03, 2, 0x03);
+  size_t loop, bank, copy;
+
+  for (size_t i = 0x4000; i < r->size; i++)
+    r->data[i] = (u8)((i >> 14) * 31 + i);
+
+  EMIT(r, LD_A_N, 0x0A);
+  op16(r, LD_NN_A, 0x0000);
+  EMIT(r, LD_A_N, 0x01);
+  op16(r, LD_NN_A, 0x6000);
+
+  loop = r->pc;
+  EMIT(r, LD_B_N, 1);
+  bank = r->pc;
+  EMIT(r, LD_A_B);
+  op16(r, LD_NN_A, 0x2000);
+  EMIT(r, AND_N, 0x03);
+  op16(r, LD_NN_A, 0x4000);
+  op16(r, LD_HL_NN, 0x4000);
+  op16(r, LD_DE_NN, 0xA000);
+  EMIT(r, LD_C_N, 0x40);
+  copy = r->pc;
+  EMIT(r, LD_A_HLI, LD_DE_A, INC_DE, DEC_C);
+  jr_to(r, JR_NZ, copy);
+  EMIT(r, INC_B, LD_A_B, CP_N, 8);
+  jr_to(r, JR_NZ, bank);
+  op16(r, JP, loop);
+
+  rom_write(r, dir, "bankswitch");
+}
+
+/* Idles in HALT between VBlank and a 4 kHz timer interrupt. */
+void gen_halt(const char *dir)
+{
+  struct rom *r = rom_new("BENCH HALT", 0x00, 0, 0);
+  const u8 handler[] = {PUSH_AF, LDH_A_N, HRAM, INC_A, LDH_N_A, HRAM, POP_AF, RETI};
+  size_t loop;
+
+  memcpy(r->data + 0x40, handler, sizeof(handler));
+  memcpy(r->data + 0x50, handler, sizeof(handler));
+  r->data[0x50 + 2] = r->data[0x50 + 5] = HRAM + 1;
+
+  EMIT(r, LD_A_N, 0xC0, LDH_N_A, TMA, LD_A_N, 0x05, LDH_N_A, TAC);
+  EMIT(r, LD_A_N, INT_VBLANK | INT_TIMER, LDH_N_A, IE, EI);
+  loop = r->pc;
+  EMIT(r, HALT, NOP);
+  jr_to(r, JR, loop);
+
+  rom_write(r, dir, "halt");
+}
+
+/*
+ * Scrolls the background every frame with 40 8x16 sprites laid out as four
+ * rows of ten. An LYC interrupt after every 64 lines moves them down, so
+ * every line has ten sprites on it.
+ */
+void gen_sprites(const char *dir)
+{
+  struct rom *r = rom_new("BENCH SPRITES", 0x00, 0, 0);
+  const size_t table = 0x3E00;
+  size_t routine, skip, lyc, vblank, move, loop;
+
+  for (int i = 0; i < 40; i++)
+  {
+    r->data[table + 4 * i + 0] = 16 + (i / 10) * 16;
+    r->data[table + 4 * i + 1] = 8 + (i % 10) * 16;
+    r->data[table + 4 * i + 2] = 2 * i;
+    r->data[table + 4 * i + 3] = (i & 1) << 5;
+  }
+
+  skip = jr_fwd(r, JR);
+  routine = memcpy_routine(r);
+
+  /* A: amount to add to every sprite's Y. */
+  move = r->pc;
+  op16(r, LD_HL_NN, SHADOW_OAM);
+  EMIT(r, LD_C_A, LD_B_N, 40);
+  loop = r->pc;
+  EMIT(r, LD_A_HL, ADD_A_C, LD_HL_A, LD_A_L, ADD_A_N, 4, LD_L_A, DEC_B);
+  jr_to(r, JR_NZ, loop);
+  op16(r, CALL, 0xFF80);
+  EMIT(r, RET);
+
+  lyc = r->pc;
+  EMIT(r, PUSH_AF, PUSH_BC, PUSH_HL, LD_A_N, 64);
+  op16(r, CALL, move);
+  EMIT(r, LDH_A_N, LYC, ADD_A_N, 64, LDH_N_A, LYC);
+  EMIT(r, POP_HL, POP_BC, POP_AF, RETI);
+
+  vblank = r->pc;
+  EMIT(r, PUSH_AF, PUSH_BC, PUSH_HL, LD_A_N, 128);
+  op16(r, CALL, move);
+  EMIT(r, LD_A_N, 63, LDH_N_A, LYC);
+  EMIT(r, LDH_A_N, SCX, INC_A, LDH_N_A, SCX);
+  EMIT(r, LDH_A_N, SCY, INC_A, LDH_N_A, SCY);
+  EMIT(r, POP_HL, POP_BC, POP_AF, RETI);
+
+  land(r, skip);
+  vector(r, 0x40, vblank);
+  vector(r, 0x48, lyc);
+
+  EMIT(r, DI);
+  lcd_off(r);
+  vram_fill(r);
+  dma_setup(r);
+  call_memcpy(r, routine, SHADOW_OAM, table, 160);
+  op16(r, CALL, 0xFF80);
+
+  EMIT(r, LD_A_N, 63, LDH_N_A, LYC, LD_A_N, 0x40, LDH_N_A, STAT);
+  EMIT(r, LD_A_N, INT_VBLANK | INT_STAT, LDH_N_A, IE);
+  EMIT(r, XOR_A, LDH_N_A, IF);
+  EMIT(r, LD_A_N, 0x97, LDH_N_A, LCDC, EI);
+  loop = r->pc;
+  EMIT(r, HALT, NOP);
+  jr_to(r, JR, loop);
+
+  rom_write(r, dir, "sprites");
+}
+
+/*
+ * Window over the right half of the screen, toggled every 32 lines from
+ * the HBlank interrupt, which also sets SCX from LY for a wave.
+ */
+void gen_window(const char *dir)
+{
+  struct rom *r = rom_new("BENCH WINDOW", 0x00, 0, 0);
+  size_t skip, hblank, vblank, loop, same;
+
+  skip = jr_fwd(r, JR);
+
+  hblank = r->pc;
+  EMIT(r, PUSH_AF, LDH_A_N, LY, LDH_N_A, SCX, AND_N, 0x1F);
+  same = jr_fwd(r, JR_NZ);
+  EMIT(r, LDH_A_N, LCDC, XOR_N, 0x20, LDH_N_A, LCDC);
+  land(r, same);
+  EMIT(r, POP_AF, RETI);
+
+  vblank = r->pc;
+  EMIT(r, PUSH_AF, LDH_A_N, WY, INC_A, AND_N, 0x3F, LDH_N_A, WY);
+  EMIT(r, LDH_A_N, LCDC, OR_N, 0x20, LDH_N_A, LCDC);
+  EMIT(r, POP_AF, RETI);
+
+  land(r, skip);
+  vector(r, 0x40, vblank);
+  vector(r, 0x48, hblank);
+
+  EMIT(r, DI);
+  lcd_off(r);
+  vram_fill(r);
+
+  EMIT(r, XOR_A, LDH_N_A, WY, LD_A_N, 7 + 80, LDH_N_A, WX);
+  EMIT(r, LD_A_N, 0x08, LDH_N_A, STAT);
+  EMIT(r, LD_A_N, INT_VBLANK | INT_STAT, LDH_N_A, IE);
+  EMIT(r, XOR_A, LDH_N_A, IF);
+  EMIT(r, LD_A_N, 0xF1, LDH_N_A, LCDC, EI);
+  loop = r->pc;
+  EMIT(r, HALT, NOP);
+  jr_to(r, JR, loop);
+
+  rom_write(r, dir, "window");
+}
+
+/* Retriggers all four channels with new settings as fast as it can. */
+void gen_sound(const char *dir)
+{
+  struct rom *r = rom_new("BENCH SOUND", 0x00, 0, 0);
+  size_t loop, inner, wave;
+
+  EMIT(r, LD_A_N, 0x80, LDH_N_A, NR52, LD_A_N, 0x77, LDH_N_A, NR50);
+  EMIT(r, LD_A_N, 0xFF, LDH_N_A, NR51);
+
+  loop = r->pc;
+  EMIT(r, LD_B_N, 0);
+  inner = r->pc;
+  EMIT(r, LD_A_N, 0x15, LDH_N_A, NR10, LD_A_N, 0x80, LDH_N_A, NR11);
+  EMIT(r, LD_A_N, 0xF3, LDH_N_A, NR12, LD_A_B, LDH_N_A, NR13);
+  EMIT(r, LD_A_N, 0x87, LDH_N_A, NR14);
+  EMIT(r, LD_A_N, 0x40, LDH_N_A, NR21, LD_A_N, 0xF1, LDH_N_A, NR22);
+  EMIT(r, LD_A_B, XOR_N, 0x55, LDH_N_A, NR23, LD_A_N, 0x86, LDH_N_A, NR24);
+  EMIT(r, LD_A_N, 0x80, LDH_N_A, NR30, LD_A_N, 0x20, LDH_N_A, NR32);
+  EMIT(r, LD_A_B, LDH_N_A, NR33, LD_A_N, 0x87, LDH_N_A, NR34);
+  EMIT(r, LD_A_N, 0xF2, LDH_N_A, NR42, LD_A_B, AND_N, 0x77, LDH_N_A, NR43);
+  EMIT(r, LD_A_N, 0x80, LDH_N_A, NR44);
+  EMIT(r, INC_B);
+  jr_to(r, JR_NZ, inner);
+
+  EMIT(r, XOR_A, LDH_N_A, NR30, LD_C_N, WAVE);
+  wave = r->pc;
+  EMIT(r, LD_A_C, XOR_N, 0xA5, LDH_C_A, INC_C, LD_A_C, CP_N, WAVE + 16);
+  jr_to(r, JR_NZ, wave);
+  op16(r, JP, loop);
+
+  rom_write(r, dir, "sound");
+}
+
+/*
+ * OAM DMA from WRAM, with sprites on, while the routine in HRAM reads and
+ * writes WRAM (the busy bus) and VRAM (the free one) during the transfer.
+ * What it saw is left at 0xFFF0-0xFFF2 and changes every frame, as the
+ * shadow OAM is incremented between transfers.
+ */
+void gen_dma(const char *dir)
+{
+  static const u8 dma[] = {LD_A_N, SHADOW_OAM >> 8, LDH_N_A, DMA,
+                           LD_A_HL, LDH_N_A, 0xF0, LD_A_DE, LDH_N_A, 0xF1,
+                           LD_HL_A, INC_A, LD_DE_A,
+                           LD_A_N, 40, DEC_A, JR_NZ, 0xFD,
+                           LD_A_HL, LDH_N_A, 0xF2, RET};
+  struct rom *r = rom_new("BENCH DMA", 0x00, 0, 0);
+  const size_t table = 0x3E00;
+  size_t routine, skip, loop, inc;
+
+  for (int i = 0; i < 160; i++)
+    r->data[table + i] = (u8)(i * 37 + 16);
+
+  skip = jr_fwd(r, JR);
+  routine = memcpy_routine(r);
+  land(r, skip);
+
+  EMIT(r, DI);
+  lcd_off(r);
+  vram_fill(r);
+  hram_setup(r, dma, sizeof(dma));
+  call_memcpy(r, routine, SHADOW_OAM, table, 160);
+  EMIT(r, LD_A_N, 0x5A);
+  op16(r, LD_NN_A, 0xC000);
+  EMIT(r, LD_A_N, 0x93, LDH_N_A, LCDC);
+
+  loop = r->pc;
+  op16(r, LD_HL_NN, 0xC000);
+  op16(r, LD_DE_NN, 0x8000);
+  op16(r, CALL, 0xFF80);
+  op16(r, LD_HL_NN, SHADOW_OAM);
+  EMIT(r, LD_B_N, 160);
+  inc = r->pc;
+  EMIT(r, LD_A_HL, INC_A, LD_HLI_A, DEC_B);
+  jr_to(r, JR_NZ, inc);
+  op16(r, JP, loop);
+
+  rom_write(r, dir, "dma");
+}
+
+/*
+ * TIMA at 16 cycles per tick reloading from TMA every 256 cycles, with a
+ * timer interrupt counting overflows at 0xFF80. The main loop reads DIV
+ * and TIMA into WRAM, then resets DIV and switches TAC between 16 and 1024
+ * cycles per tick.
+ */
+void gen_timer(const char *dir)
+{
+  struct rom *r = rom_new("BENCH TIMER", 0x00, 0, 0);
+  const u8 handler[] = {PUSH_AF, LDH_A_N, HRAM, INC_A, LDH_N_A, HRAM, POP_AF, RETI};
+  size_t loop, inner;
+
+  memcpy(r->data + 0x50, handler, sizeof(handler));
+
+  EMIT(r, LD_A_N, 0xF0, LDH_N_A, TMA, LD_A_N, 0x05, LDH_N_A, TAC);
+  EMIT(r, LD_A_N, INT_TIMER, LDH_N_A, IE, EI);
+
+  loop = r->pc;
+  op16(r, LD_HL_NN, 0xC000);
+  EMIT(r, LD_B_N, 0);
+  inner = r->pc;
+  EMIT(r, LDH_A_N, DIV, LD_HLI_A, LDH_A_N, TIMA, LD_HLI_A, DEC_B);
+  jr_to(r, JR_NZ, inner);
+  EMIT(r, LDH_N_A, DIV, LDH_A_N, TAC, XOR_N, 0x01, LDH_N_A, TAC);
+  op16(r, JP, loop);
+
+  rom_write(r, dir, "timer");
+}
+
+/*
+ * Selects the buttons and halts with only the joypad interrupt enabled.
+ * Each wake-up is counted at 0xFF80 and P1 is stored to WRAM from 0xC000.
+ * Presses of a, b, select or start from an input script (-i) wake it;
+ * the directions are deselected, so up, down, left and right do not.
+ */
+void gen_joypad(const char *dir)
+{
+  struct rom *r = rom_new("BENCH JOYPAD", 0x00, 0, 0);
+  const u8 handler[] = {PUSH_AF, LDH_A_N, HRAM, INC_A, LDH_N_A, HRAM, POP_AF, RETI};
+  size_t loop;
+
+  memcpy(r->data + 0x60, handler, sizeof(handler));
+
+  EMIT(r, LD_A_N, 0x10, LDH_N_A, P1);
+  EMIT(r, LD_A_N, INT_JOYPAD, LDH_N_A, IE, EI);
+  op16(r, LD_HL_NN, 0xC000);
+
+  loop = r->pc;
+  EMIT(r, HALT, NOP, LDH_A_N, P1, LD_HLI_A);
+  jr_to(r, JR, loop);
+
+  rom_write(r, dir, "joypad");
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 2)
+  {
+    printf("Usage: %s DIR\n", argv[0]);
+    puts("Writes the benchmark ROMs to DIR.");
+    return EXIT_FAILURE;
+  }
+
+  gen_alu(argv[1]);
+  gen_memcpy(argv[1]);
+  gen_bankswitch(argv[1]);
+  gen_halt(argv[1]);
+  gen_sprites(argv[1]);
+  gen_window(argv[1]);
+  gen_sound(argv[1]);
+  gen_dma(argv[1]);
+  gen_timer(argv[1]);
+  gen_joypad(argv[1]);
+
+  return EXIT_SUCCESS;
+}
@@ -4,26 +4,38 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stddef.h>
 
 #include "defs.h"
+#include "stats.h"
 
 #define AUDIO_SAMPLE_RATE 48000.0
 
 #define DMG_CLOCK_FREQ 4194304.0
 #define SCREEN_REFRESH_CYCLES 70224.0
+#define VERTICAL_SYNC (DMG_CLOCK_FREQ / SCREEN_REFRESH_CYCLES)
 
 #define AUDIO_SAMPLES ((u32)(AUDIO_SAMPLE_RATE / VERTICAL_SYNC))
 
 #define AUDIO_NSAMPLES ((u32)(AUDIO_SAMPLE_RATE / VERTICAL_SYNC) * 2)
 
+/* Frames rendered per pass through the planar channel buffers. */
+#define AUDIO_CHUNK 1024
+
+/* Polyphase decimator used when generating at a divisor of the DMG clock. */
+#define RS_PHASE_BITS 6
+#define RS_PHASES (1 << RS_PHASE_BITS)
+#define RS_TAPS 32
+
 #define AUDIO_MEM_SIZE (0xFF3F - 0xFF10 + 1)
 #define AUDIO_ADDR_COMPENSATION 0xFF10
 
+#define APU_LENGTH_CYCLES 16384
+#define APU_SEQUENCER_HZ 512.0f
+
 #define MAX(a, b) ({ a > b ? a : b; })
 #define MIN(a, b) ({ a <= b ? a : b; })
 
-static u8 apumemory[AUDIO_MEM_SIZE];
-
 typedef struct LengthCounter
 {
 	u32 load : 6;
@@ -50,7 +62,7 @@ typedef struct FrequencySweep
 	f32 inc;
 } FrequencySweep;
 
-static struct Channel
+typedef struct Channel
 {
 	u32 enabled : 1;
 	u32 powered : 1;
@@ -80,27 +92,60 @@ static struct Channel
 
 	u8 vol_code;
 
+	/* High-pass filter state, advanced only while the channel plays. */
 	f32 capacitor;
-} chans[4];
+} Channel;
 
-static f32 left, right;
+typedef f32 f32x4 __attribute__((vector_size(16)));
 
-static f32 hipass(struct Channel *c, f32 sample)
+typedef struct Resampler
 {
-	f32 out = sample - c->capacitor;
-	c->capacitor = sample - out * 0.996f;
-	return out;
+	f32 kernel[RS_PHASES + 1][RS_TAPS];
+	f32 hist[2][RS_TAPS + AUDIO_CHUNK];
+	uf32 fill;
+	uint64_t pos;
+	uint64_t step;
+} Resampler;
+
+typedef struct Apu
+{
+	u8 memory[AUDIO_MEM_SIZE];
+	struct Channel chans[4];
+	f32 left, right;
+
+	/* When cleared, registers are only stored and nothing is synthesised. */
+	u32 synth : 1;
+	/* Length counters behind NR52's status bits, clocked at 256 Hz from
+	 * cpu_step in both modes. */
+	u16 length[4];
+
+	/* Generation rate. AUDIO_SAMPLE_RATE, or DMG_CLOCK_FREQ / native_div
+	 * decimated to AUDIO_SAMPLE_RATE by rs. */
+	f32 rate;
+	f32 hp_charge;
+	u8 native_div;
+	Resampler rs;
+
+#ifdef GB_STATS
+	struct apu_stats stats;
+#endif
+} Apu;
+
+/* NR52's channel status bits. These follow emulated time in both modes;
+ * the synthesiser only switches its own channels off. */
+static void set_status(Apu *apu, const uf8 i, const bool on)
+{
+	u8 *status = apu->memory + (0xFF26 - AUDIO_ADDR_COMPENSATION);
+
+	*status = on ? *status | (1 << i) : *status & ~(1 << i);
 }
 
-static void enable_channel(const uf8 i, const bool enable)
+static f32 hipass(struct Channel *c, const f32 sample, const f32 charge)
 {
-	chans[i].enabled = enable;
-
-	u8 value = (apumemory[0xFF26 - AUDIO_ADDR_COMPENSATION] & 0x80) |
-			   (chans[3].enabled << 3) | (chans[2].enabled << 2) |
-			   (chans[1].enabled << 1) | (chans[0].enabled << 0);
+	const f32 out = sample - c->capacitor;
 
-	apumemory[0xFF26 - AUDIO_ADDR_COMPENSATION] = value;
+	c->capacitor = sample - out * charge;
+	return out;
 }
 
 static void update_env(struct Channel *c)
@@ -129,7 +174,7 @@ static void update_len(struct Channel *c)
 		c->len.counter += c->len.inc;
 		if (c->len.counter > 1.0f)
 		{
-			enable_channel(c - chans, 0);
+			c->enabled = 0;
 			c->len.counter = 0.0f;
 		}
 	}
@@ -153,7 +198,7 @@ static bool update_freq(struct Channel *c, f32 *pos)
 	}
 }
 
-static void update_sweep(struct Channel *c)
+static void update_sweep(struct Channel *c, const f32 rate)
 {
 	c->sweep.counter += c->sweep.inc;
 
@@ -172,7 +217,7 @@ static void update_sweep(struct Channel *c)
 			}
 			else
 			{
-				c->freq_inc = (4194304 / ((2048 - c->freq) << 5)) / AUDIO_SAMPLE_RATE;
+				c->freq_inc = (4194304 / ((2048 - c->freq) << 5)) / rate;
 				c->freq_inc *= 8.0f;
 			}
 		}
@@ -184,16 +229,20 @@ static void update_sweep(struct Channel *c)
 	}
 }
 
-static void update_square(f32 *restrict samples, const bool ch2)
+static void update_square(Apu *apu, f32 *restrict samples, const uf16 n,
+						  const bool ch2)
 {
-	struct Channel *c = chans + ch2;
+	struct Channel *c = apu->chans + ch2;
+
+	memset(samples, 0, n * sizeof(f32));
+
 	if (!c->powered)
 		return;
 
-	c->freq_inc = (4194304.0f / ((2048 - c->freq) << 5)) / AUDIO_SAMPLE_RATE;
+	c->freq_inc = (4194304.0f / ((2048 - c->freq) << 5)) / apu->rate;
 	c->freq_inc *= 8.0f;
 
-	for (uf16 i = 0; i < AUDIO_NSAMPLES; i += 2)
+	for (uf16 i = 0; i < n; i++)
 	{
 		update_len(c);
 
@@ -201,7 +250,7 @@ static void update_square(f32 *restrict samples, const bool ch2)
 		{
 			update_env(c);
 			if (!ch2)
-				update_sweep(c);
+				update_sweep(c, apu->rate);
 
 			f32 pos = 0.0f;
 			f32 prev_pos = 0.0f;
@@ -217,23 +266,15 @@ static void update_square(f32 *restrict samples, const bool ch2)
 			}
 			sample += ((pos - prev_pos) / c->freq_inc) *
 					  (f32)c->value;
-			sample = hipass(c, sample * (c->volume / 15.0f));
-
-			if (!c->muted)
-			{
-				samples[i + 0] +=
-					sample * 0.25f * c->on_left * left;
-				samples[i + 1] +=
-					sample * 0.25f * c->on_right * right;
-			}
+			samples[i] = hipass(c, sample * (c->volume / 15.0f), apu->hp_charge);
 		}
 	}
 }
 
-static u8 wave_sample(const u32 pos, const u32 volume)
+static u8 wave_sample(const Apu *apu, const u32 pos, const u32 volume)
 {
 	u8 sample =
-		apumemory[(0xFF30 + pos / 2) - AUDIO_ADDR_COMPENSATION];
+		apu->memory[(0xFF30 + pos / 2) - AUDIO_ADDR_COMPENSATION];
 	if (pos & 1)
 	{
 		sample &= 0xF;
@@ -245,18 +286,21 @@ static u8 wave_sample(const u32 pos, const u32 volume)
 	return volume ? (sample >> (volume - 1)) : 0;
 }
 
-static void update_wave(f32 *restrict samples)
+static void update_wave(Apu *apu, f32 *restrict samples, const uf16 n)
 {
-	struct Channel *c = chans + 2;
+	struct Channel *c = apu->chans + 2;
+
+	memset(samples, 0, n * sizeof(f32));
+
 	if (!c->powered)
 		return;
 
 	uf16 freq = 4194304.0f / ((2048 - c->freq) << 5);
-	c->freq_inc = freq / AUDIO_SAMPLE_RATE;
+	c->freq_inc = freq / apu->rate;
 
 	c->freq_inc *= 16.0f;
 
-	for (uf16 i = 0; i < AUDIO_NSAMPLES; i += 2)
+	for (uf16 i = 0; i < n; i++)
 	{
 		update_len(c);
 
@@ -266,14 +310,14 @@ static void update_wave(f32 *restrict samples)
 			f32 prev_pos = 0.0f;
 			f32 sample = 0.0f;
 
-			c->vol_code = wave_sample(c->value, c->volume);
+			c->vol_code = wave_sample(apu, c->value, c->volume);
 
 			while (update_freq(c, &pos))
 			{
 				c->value = (c->value + 1) & 31;
 				sample += ((pos - prev_pos) / c->freq_inc) *
 						  (f32)c->vol_code;
-				c->vol_code = wave_sample(c->value, c->volume);
+				c->vol_code = wave_sample(apu, c->value, c->volume);
 				prev_pos = pos;
 			}
 			sample += ((pos - prev_pos) / c->freq_inc) *
@@ -283,35 +327,30 @@ static void update_wave(f32 *restrict samples)
 			{
 				f32 diff = (f32[]){7.5f, 3.75f,
 								   1.5f}[c->volume - 1];
-				sample = hipass(c, (sample - diff) / 7.5f);
-
-				if (!c->muted)
-				{
-					samples[i + 0] += sample * 0.25f *
-									  c->on_left * left;
-					samples[i + 1] += sample * 0.25f *
-									  c->on_right * right;
-				}
+				samples[i] = hipass(c, (sample - diff) / 7.5f, apu->hp_charge);
 			}
 		}
 	}
 }
 
-static void update_noise(f32 *restrict samples)
+static void update_noise(Apu *apu, f32 *restrict samples, const uf16 n)
 {
-	struct Channel *c = chans + 3;
+	struct Channel *c = apu->chans + 3;
+
+	memset(samples, 0, n * sizeof(f32));
+
 	if (!c->powered)
 		return;
 
 	uf16 freq = 4194304 / ((uf8[]){
 							   8, 16, 32, 48, 64, 80, 96, 112}[c->divisor_code]
 						   << c->freq);
-	c->freq_inc = freq / AUDIO_SAMPLE_RATE;
+	c->freq_inc = freq / apu->rate;
 
 	if (c->freq >= 14)
 		c->enabled = 0;
 
-	for (uf16 i = 0; i < AUDIO_NSAMPLES; i += 2)
+	for (uf16 i = 0; i < n; i++)
 	{
 		update_len(c);
 
@@ -347,62 +386,292 @@ static void update_noise(f32 *restrict samples)
 				prev_pos = pos;
 			}
 			sample += ((pos - prev_pos) / c->freq_inc) * c->value;
-			sample = hipass(c, sample * (c->volume / 15.0f));
+			samples[i] = hipass(c, sample * (c->volume / 15.0f), apu->hp_charge);
+		}
+	}
+}
+
+/*
+ * Final stage: pan and scale the four planar channel buffers, which are
+ * already high-pass filtered per channel, and store every stride'th float
+ * from out_left and out_right.
+ */
+static void mix_channels(Apu *apu, f32 planes[static 4][AUDIO_CHUNK],
+						 f32 *out_left, f32 *out_right, const uf8 stride,
+						 const uf16 n)
+{
+	f32x4 gain_left, gain_right;
+	uf16 i = 0;
+
+	for (uf8 c = 0; c < 4; ++c)
+	{
+		const struct Channel *ch = apu->chans + c;
+		const f32 g = ch->muted ? 0.0f : 0.25f;
+
+		gain_left[c] = g * ch->on_left * apu->left;
+		gain_right[c] = g * ch->on_right * apu->right;
+	}
+
+	for (; i + 4 <= n; i += 4)
+	{
+		f32x4 p0, p1, p2, p3, mix_left, mix_right;
+
+		memcpy(&p0, planes[0] + i, sizeof(p0));
+		memcpy(&p1, planes[1] + i, sizeof(p1));
+		memcpy(&p2, planes[2] + i, sizeof(p2));
+		memcpy(&p3, planes[3] + i, sizeof(p3));
+
+		mix_left = p0 * gain_left[0] + p1 * gain_left[1] +
+				   p2 * gain_left[2] + p3 * gain_left[3];
+		mix_right = p0 * gain_right[0] + p1 * gain_right[1] +
+					p2 * gain_right[2] + p3 * gain_right[3];
+
+		for (uf8 k = 0; k < 4; ++k)
+		{
+			out_left[stride * (i + k)] = mix_left[k];
+			out_right[stride * (i + k)] = mix_right[k];
+		}
+	}
+
+	for (; i < n; ++i)
+	{
+		f32 mix_left = 0.0f, mix_right = 0.0f;
+
+		for (uf8 c = 0; c < 4; ++c)
+		{
+			mix_left += planes[c][i] * gain_left[c];
+			mix_right += planes[c][i] * gain_right[c];
+		}
+
+		out_left[stride * i] = mix_left;
+		out_right[stride * i] = mix_right;
+	}
+}
+
+static void render_chunk(Apu *apu, f32 *out_left, f32 *out_right,
+						 const uf8 stride, const uf16 n)
+{
+	f32 planes[4][AUDIO_CHUNK];
+
+	update_square(apu, planes[0], n, 0);
+	update_square(apu, planes[1], n, 1);
+	update_wave(apu, planes[2], n);
+	update_noise(apu, planes[3], n);
+	mix_channels(apu, planes, out_left, out_right, stride, n);
+}
+
+/* Blackman-windowed sinc, one row per fractional phase, unity DC gain. */
+static void resampler_init(Resampler *rs, const f32 in_rate, const f32 out_rate)
+{
+	const double pi = 3.14159265358979323846;
+	const double cutoff = 0.45 * out_rate / in_rate;
+
+	for (uf16 p = 0; p <= RS_PHASES; ++p)
+	{
+		double sum = 0.0;
+
+		for (uf8 k = 0; k < RS_TAPS; ++k)
+		{
+			const double t = k - (RS_TAPS / 2 - 1) - (double)p / RS_PHASES;
+			const double x = t / (RS_TAPS / 2);
+			const double w = fabs(x) >= 1.0 ? 0.0
+											: 0.42 + 0.5 * cos(pi * x) +
+												  0.08 * cos(2.0 * pi * x);
+			const double sinc = t == 0.0 ? 1.0 : sin(2.0 * pi * cutoff * t) / (2.0 * pi * cutoff * t);
+
+			rs->kernel[p][k] = (f32)(sinc * w);
+			sum += sinc * w;
+		}
+
+		for (uf8 k = 0; k < RS_TAPS; ++k)
+			rs->kernel[p][k] /= (f32)sum;
+	}
+
+	memset(rs->hist, 0, sizeof(rs->hist));
+	rs->fill = RS_TAPS - 1;
+	rs->pos = 0;
+	rs->step = (uint64_t)((double)in_rate / out_rate * 4294967296.0);
+}
+
+static void resample(Apu *apu, f32 *restrict out, uf32 n)
+{
+	Resampler *rs = &apu->rs;
 
-			if (!c->muted)
+	while (n)
+	{
+		while (n && (rs->pos >> 32) + RS_TAPS <= rs->fill)
+		{
+			const uf32 i = rs->pos >> 32;
+			const uint32_t frac = (uint32_t)rs->pos;
+			const uf16 p = frac >> (32 - RS_PHASE_BITS);
+			const f32 w = (f32)(frac & ((1u << (32 - RS_PHASE_BITS)) - 1)) /
+						  (f32)(1u << (32 - RS_PHASE_BITS));
+			f32x4 acc_left = {0}, acc_right = {0};
+
+			for (uf8 k = 0; k < RS_TAPS; k += 4)
 			{
-				samples[i + 0] +=
-					sample * 0.25f * c->on_left * left;
-				samples[i + 1] +=
-					sample * 0.25f * c->on_right * right;
+				f32x4 h0, h1, x_left, x_right;
+
+				memcpy(&h0, rs->kernel[p] + k, sizeof(h0));
+				memcpy(&h1, rs->kernel[p + 1] + k, sizeof(h1));
+				memcpy(&x_left, rs->hist[0] + i + k, sizeof(x_left));
+				memcpy(&x_right, rs->hist[1] + i + k, sizeof(x_right));
+
+				h0 += (h1 - h0) * w;
+				acc_left += h0 * x_left;
+				acc_right += h0 * x_right;
 			}
+
+			out[0] = acc_left[0] + acc_left[1] + acc_left[2] + acc_left[3];
+			out[1] = acc_right[0] + acc_right[1] + acc_right[2] + acc_right[3];
+			out += 2;
+			n--;
+			rs->pos += rs->step;
+		}
+
+		if (!n)
+			break;
+
+		{
+			const uf32 used = rs->pos >> 32;
+			uint64_t needed;
+
+			rs->fill -= used;
+			memmove(rs->hist[0], rs->hist[0] + used, rs->fill * sizeof(f32));
+			memmove(rs->hist[1], rs->hist[1] + used, rs->fill * sizeof(f32));
+			rs->pos -= (uint64_t)used << 32;
+
+			/* Generate only what the remaining outputs need. */
+			needed = ((rs->pos + (n - 1) * rs->step) >> 32) + RS_TAPS - rs->fill;
+			needed = MIN(needed, (uint64_t)AUDIO_CHUNK);
+
+			render_chunk(apu, rs->hist[0] + rs->fill, rs->hist[1] + rs->fill,
+						 1, needed);
+			rs->fill += needed;
 		}
 	}
 }
 
-void audio_callback(void *misc_data, u8 *restrict stream, int len)
+static void audio_skip_channels(Apu *apu, f32 frames)
 {
-	f32 *samples = (f32 *)stream;
+	/* Advance a frame-sequencer tick at a time, so that no length,
+	 * envelope or sweep counter steps more than once per update call. */
+	const f32 tick = apu->rate / APU_SEQUENCER_HZ;
+
+	while (frames > 0.0f)
+	{
+		const f32 step = MIN(frames, tick);
+
+		for (uf8 i = 0; i < 4; ++i)
+		{
+			struct Channel *c = apu->chans + i;
+
+			if (!c->powered || !c->enabled)
+				continue;
+
+			if (c->len.enabled)
+			{
+				c->len.counter += c->len.inc * (step - 1.0f);
+				update_len(c);
+
+				if (!c->enabled)
+					continue;
+			}
+
+			if (i != 2)
+			{
+				c->venv.counter += c->venv.inc * (step - 1.0f);
+				update_env(c);
+			}
+
+			if (i == 0)
+			{
+				c->sweep.counter += c->sweep.inc * (step - 1.0f);
+				update_sweep(c, apu->rate);
+			}
+		}
+
+		frames -= step;
+	}
+}
+
+/*
+ * Advance lengths, envelopes and the sweep by n frames at
+ * AUDIO_SAMPLE_RATE without synthesising anything. Used for audio that is
+ * dropped while fast-forwarding.
+ */
+void audio_skip(Apu *apu, const uf32 n)
+{
+	const f32 frames = n * (apu->rate / AUDIO_SAMPLE_RATE);
+
+	if (!apu->synth || n == 0)
+		return;
+
+	STATS_TIME(apu->stats.host, audio_skip_channels(apu, frames));
+}
+
+/* Render n interleaved stereo frames at AUDIO_SAMPLE_RATE. */
+void audio_render(Apu *apu, f32 *restrict out, uf32 n)
+{
+	if (!apu->synth)
+	{
+		memset(out, 0, n * 2 * sizeof(f32));
+		return;
+	}
+
+	STATS_ADD(apu->stats, samples, n);
 
-	(void)misc_data;
+	if (apu->native_div)
+	{
+		STATS_TIME(apu->stats.host, resample(apu, out, n));
+		return;
+	}
 
-	memset(stream, 0, len);
+	while (n)
+	{
+		const uf16 chunk = n < AUDIO_CHUNK ? n : AUDIO_CHUNK;
+
+		STATS_TIME(apu->stats.host, render_chunk(apu, out, out + 1, 2, chunk));
+
+		out += 2 * chunk;
+		n -= chunk;
+	}
+}
 
-	update_square(samples, 0);
-	update_square(samples, 1);
-	update_wave(samples);
-	update_noise(samples);
+void audio_callback(void *misc_data, u8 *restrict stream, int len)
+{
+	audio_render(misc_data, (f32 *)stream, len / (2 * sizeof(f32)));
 }
 
-static void trigger_channel(uf8 i)
+static void trigger_channel(Apu *apu, uf8 i)
 {
-	struct Channel *c = chans + i;
+	struct Channel *c = apu->chans + i;
 
-	enable_channel(i, 1);
+	c->enabled = 1;
 	c->volume = c->volume_init;
 
 	{
 		u8 value =
-			apumemory[(0xFF12 + (i * 5)) - AUDIO_ADDR_COMPENSATION];
+			apu->memory[(0xFF12 + (i * 5)) - AUDIO_ADDR_COMPENSATION];
 
 		c->venv.step = value & 0x07;
 		c->venv.up = value & 0x08 ? 1 : 0;
 		c->venv.inc = c->venv.step ? (64.0f / (f32)c->venv.step) /
-										 AUDIO_SAMPLE_RATE
-								   : 8.0f / AUDIO_SAMPLE_RATE;
+										 apu->rate
+								   : 8.0f / apu->rate;
 		c->venv.counter = 0.0f;
 	}
 
 	if (i == 0)
 	{
-		u8 value = apumemory[0xFF10 - AUDIO_ADDR_COMPENSATION];
+		u8 value = apu->memory[0xFF10 - AUDIO_ADDR_COMPENSATION];
 
 		c->sweep.freq = c->freq;
 		c->sweep.rate = (value >> 4) & 0x07;
 		c->sweep.up = !(value & 0x08);
 		c->sweep.shift = (value & 0x07);
 		c->sweep.inc = c->sweep.rate ? (128.0f / (f32)(c->sweep.rate)) /
-										   AUDIO_SAMPLE_RATE
+										   apu->rate
 									 : 0;
 		c->sweep.counter = nexttowardf(1.0f, 1.1f);
 	}
@@ -421,11 +690,11 @@ static void trigger_channel(uf8 i)
 	}
 
 	c->len.inc =
-		(256.0f / (f32)(len_max - c->len.load)) / AUDIO_SAMPLE_RATE;
+		(256.0f / (f32)(len_max - c->len.load)) / apu->rate;
 	c->len.counter = 0.0f;
 }
 
-u8 audio_read(const u16 address)
+u8 audio_read(const Apu *apu, const u16 address)
 {
 	static u8 ortab[] = {0x80, 0x3f, 0x00, 0xff, 0xbf, 0xff,
 						 0x3f, 0x00, 0xff, 0xbf, 0x7f, 0xff,
@@ -433,15 +702,15 @@ u8 audio_read(const u16 address)
 						 0x00, 0xbf, 0x00, 0x00, 0x70};
 
 	if (address > 0xFF26)
-		return apumemory[address - AUDIO_ADDR_COMPENSATION];
+		return apu->memory[address - AUDIO_ADDR_COMPENSATION];
 
-	return apumemory[address - AUDIO_ADDR_COMPENSATION] | ortab[address - 0xFF10];
+	return apu->memory[address - AUDIO_ADDR_COMPENSATION] | ortab[address - 0xFF10];
 }
 
-void audio_write(const u16 address, const u8 value)
+static void synth_write(Apu *apu, const u16 address, const u8 value)
 {
+	struct Channel *chans = apu->chans;
 	uf8 i = (address - 0xFF10) / 5;
-	apumemory[address - AUDIO_ADDR_COMPENSATION] = value;
 
 	switch (address)
 	{
@@ -486,12 +755,16 @@ void audio_write(const u16 address, const u8 value)
 	{
 		const u8 duty_lookup[] = {0x10, 0x30, 0x3C, 0xCF};
 		chans[i].len.load = value & 0x3f;
+		chans[i].len.inc = (256.0f / (f32)(64 - chans[i].len.load)) / apu->rate;
+		chans[i].len.counter = 0.0f;
 		chans[i].duty = duty_lookup[value >> 6];
 		break;
 	}
 
 	case 0xFF1B:
 		chans[i].len.load = value;
+		chans[i].len.inc = (256.0f / (f32)(256 - chans[i].len.load)) / apu->rate;
+		chans[i].len.counter = 0.0f;
 		break;
 
 	case 0xFF13:
@@ -503,7 +776,7 @@ void audio_write(const u16 address, const u8 value)
 
 	case 0xFF1A:
 		chans[i].powered = (value & 0x80) != 0;
-		enable_channel(i, value & 0x80);
+		chans[i].enabled = chans[i].powered;
 		break;
 
 	case 0xFF14:
@@ -516,7 +789,7 @@ void audio_write(const u16 address, const u8 value)
 	case 0xFF23:
 		chans[i].len.enabled = value & 0x40 ? 1 : 0;
 		if (value & 0x80)
-			trigger_channel(i);
+			trigger_channel(apu, i);
 
 		break;
 
@@ -527,8 +800,8 @@ void audio_write(const u16 address, const u8 value)
 		break;
 
 	case 0xFF24:
-		left = ((value >> 4) & 0x07) / 7.0f;
-		right = (value & 0x07) / 7.0f;
+		apu->left = ((value >> 4) & 0x07) / 7.0f;
+		apu->right = (value & 0x07) / 7.0f;
 		break;
 
 	case 0xFF25:
@@ -541,10 +814,128 @@ void audio_write(const u16 address, const u8 value)
 	}
 }
 
-void audio_init(void)
+/* Register handling for NR52's status bits, done in both modes. */
+static void length_write(Apu *apu, const u16 address, const u8 value)
+{
+	uf8 i = (address - 0xFF10) / 5;
+
+	switch (address)
+	{
+	case 0xFF12:
+	case 0xFF17:
+	case 0xFF21:
+		if ((value >> 3) == 0)
+			set_status(apu, i, 0);
+		break;
+
+	case 0xFF1A:
+		if ((value & 0x80) == 0)
+			set_status(apu, i, 0);
+		break;
+
+	/* Writing the length reloads the counter straight away. */
+	case 0xFF11:
+	case 0xFF16:
+	case 0xFF20:
+		apu->chans[i].len.load = value & 0x3f;
+		apu->length[i] = 64 - apu->chans[i].len.load;
+		break;
+
+	case 0xFF1B:
+		apu->chans[i].len.load = value;
+		apu->length[i] = 256 - apu->chans[i].len.load;
+		break;
+
+	case 0xFF14:
+	case 0xFF19:
+	case 0xFF1E:
+	case 0xFF23:
+	{
+		const u8 dac = (i == 2)
+						   ? apu->memory[0xFF1A - AUDIO_ADDR_COMPENSATION] & 0x80
+						   : apu->memory[(0xFF12 + (i * 5)) - AUDIO_ADDR_COMPENSATION] >> 3;
+
+		apu->chans[i].len.enabled = value & 0x40 ? 1 : 0;
+
+		if ((value & 0x80) && dac)
+		{
+			set_status(apu, i, 1);
+			apu->length[i] = (i == 2 ? 256 : 64) - apu->chans[i].len.load;
+		}
+
+		break;
+	}
+	}
+}
+
+void audio_write(Apu *apu, const u16 address, const u8 value)
+{
+	if (address == 0xFF26)
+	{
+		/* Channel status bits are read-only. */
+		apu->memory[address - AUDIO_ADDR_COMPENSATION] =
+			(value & 0x80) | (apu->memory[address - AUDIO_ADDR_COMPENSATION] & 0x0F);
+
+		if ((value & 0x80) == 0)
+		{
+			for (uf8 i = 0; i < 4; ++i)
+			{
+				apu->chans[i].enabled = 0;
+				set_status(apu, i, 0);
+			}
+		}
+
+		return;
+	}
+
+	apu->memory[address - AUDIO_ADDR_COMPENSATION] = value;
+	length_write(apu, address, value);
+
+	if (apu->synth)
+		synth_write(apu, address, value);
+}
+
+/* Called at 256 Hz from cpu_step to expire the length counters behind
+ * NR52, independently of when (or whether) the audio is synthesised. */
+void audio_length_tick(Apu *apu)
+{
+	const u8 status = apu->memory[0xFF26 - AUDIO_ADDR_COMPENSATION];
+
+	for (uf8 i = 0; i < 4; ++i)
+	{
+		if (!(status & (1 << i)) || !apu->chans[i].len.enabled)
+			continue;
+
+		if (apu->length[i] <= 1)
+		{
+			apu->length[i] = 0;
+			set_status(apu, i, 0);
+		}
+		else
+			apu->length[i]--;
+	}
+}
+
+static void set_rate(Apu *apu)
 {
-	memset(chans, 0, sizeof(chans));
-	chans[0].value = chans[1].value = -1;
+	apu->rate = apu->native_div ? DMG_CLOCK_FREQ / apu->native_div
+								: AUDIO_SAMPLE_RATE;
+	apu->hp_charge = powf(0.996f, AUDIO_SAMPLE_RATE / apu->rate);
+
+	if (apu->native_div)
+		resampler_init(&apu->rs, apu->rate, AUDIO_SAMPLE_RATE);
+}
+
+void audio_init(Apu *apu)
+{
+	const u32 synth = apu->synth;
+	const u8 native_div = apu->native_div;
+
+	memset(apu, 0, offsetof(Apu, rs));
+	apu->synth = synth;
+	apu->native_div = native_div;
+	set_rate(apu);
+	apu->chans[0].value = apu->chans[1].value = -1;
 
 	{
 		const u8 regs_init[] = {0x80, 0xBF, 0xF3, 0xFF, 0x3F,
@@ -554,7 +945,7 @@ void audio_init(void)
 								0x77, 0xF3, 0xF1};
 
 		for (uf8 i = 0; i < sizeof(regs_init); ++i)
-			audio_write(0xFF10 + i, regs_init[i]);
+			audio_write(apu, 0xFF10 + i, regs_init[i]);
 	}
 
 	{
@@ -564,6 +955,85 @@ void audio_init(void)
 								0xac, 0xdd, 0xda, 0x48};
 
 		for (uf8 i = 0; i < sizeof(wave_init); ++i)
-			audio_write(0xFF30 + i, wave_init[i]);
+			audio_write(apu, 0xFF30 + i, wave_init[i]);
+	}
+}
+
+/*
+ * Switch synthesis on or off at run time. Turning it back on rebuilds the
+ * channel state from the register file and restarts the channels that are
+ * still running, so envelopes and sweeps begin again from their registers.
+ */
+void audio_set_synth(Apu *apu, const bool synth)
+{
+	if (synth == apu->synth)
+		return;
+
+	if (!synth)
+	{
+		apu->synth = 0;
+		return;
 	}
+
+	apu->synth = 1;
+
+	{
+		const u8 status = apu->memory[0xFF26 - AUDIO_ADDR_COMPENSATION];
+
+		for (uf8 i = 0; i < 4; ++i)
+			apu->chans[i].enabled = 0;
+
+		for (u16 address = 0xFF10; address <= 0xFF25; ++address)
+		{
+			u8 value = apu->memory[address - AUDIO_ADDR_COMPENSATION];
+
+			/* Don't trigger from the stored NRx4 values. */
+			if (address == 0xFF14 || address == 0xFF19 ||
+				address == 0xFF1E || address == 0xFF23)
+				value &= 0x7F;
+
+			synth_write(apu, address, value);
+		}
+
+		for (uf8 i = 0; i < 4; ++i)
+		{
+			if (status & (1 << i))
+				trigger_channel(apu, i);
+			else
+				apu->chans[i].enabled = 0;
+		}
+	}
+}
+
+/*
+ * The length, envelope and sweep increments are per generated frame. Convert
+ * those of a channel state generated at from_rate to this APU's rate.
+ */
+void audio_rescale(Apu *apu, const f32 from_rate)
+{
+	for (uf8 i = 0; i < 4; ++i)
+	{
+		struct Channel *c = apu->chans + i;
+
+		c->len.inc *= from_rate / apu->rate;
+		c->venv.inc *= from_rate / apu->rate;
+		c->sweep.inc *= from_rate / apu->rate;
+	}
+}
+
+/*
+ * Generate at DMG_CLOCK_FREQ / divisor (e.g. 32 for 131072 Hz) and decimate
+ * to AUDIO_SAMPLE_RATE, or pass 0 to generate at AUDIO_SAMPLE_RATE
+ * directly. Running channels keep their timing across the switch.
+ */
+void audio_set_native(Apu *apu, const u8 divisor)
+{
+	const f32 old_rate = apu->rate;
+
+	if (divisor && DMG_CLOCK_FREQ / divisor < AUDIO_SAMPLE_RATE)
+		return;
+
+	apu->native_div = divisor;
+	set_rate(apu);
+	audio_rescale(apu, old_rate);
 }
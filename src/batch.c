@@ -0,0 +1,698 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "glitzboy.h"
+#include "files.h"
+#include "movie.h"
+
+/*
+ * Batch runner: runs a list of ROM/input/frame-count jobs on a pool of
+ * worker threads, one Gameboy per worker. ROMs are mapped read-only once
+ * and shared by every job that uses them. Each worker owns a deque of jobs;
+ * it takes work from the bottom of its own deque and steals from the top of
+ * the others once it runs dry. Results are streamed to stdout as one JSON
+ * object per line, in completion order.
+ */
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+struct rom
+{
+  char *path;
+  const u8 *data;
+  size_t size;
+  int error;
+};
+
+struct job
+{
+  uf32 id;
+  uf32 rom;
+  char *input;
+  u64 frames;
+};
+
+struct worker
+{
+  pthread_t thread;
+  pthread_mutex_t lock;
+  struct job **jobs;
+  uf32 top;
+  uf32 bottom;
+  uf32 index;
+
+  Gameboy *gb;
+  const struct rom *rom;
+  u8 *cartridgeram;
+  u8 fb[LCD_HEIGHT][LCD_WIDTH];
+  u16 bad_opcode;
+  u32 invalid_opcode : 1;
+};
+
+static struct rom *roms;
+static uf32 rom_count;
+static struct worker *workers;
+static uf32 worker_count;
+static u32 all_hashes;
+static u32 dump_ram;
+
+u8 read_rom(Gameboy *gb, const uf32 address)
+{
+  const struct worker *const w = gb->direct.misc_data;
+  return address < w->rom->size ? w->rom->data[address] : 0xFF;
+}
+
+u8 read_ram(Gameboy *gb, const uf32 address)
+{
+  const struct worker *const w = gb->direct.misc_data;
+  return w->cartridgeram[address];
+}
+
+void write_ram(Gameboy *gb, const uf32 address, const u8 value)
+{
+  const struct worker *const w = gb->direct.misc_data;
+  w->cartridgeram[address] = value;
+}
+
+void Error(Gameboy *gb, const enum Error gb_err, const u16 value)
+{
+  struct worker *const w = gb->direct.misc_data;
+
+  if (gb_err == INVALID_OPCODE && !w->invalid_opcode)
+  {
+    w->invalid_opcode = 1;
+    w->bad_opcode = value;
+  }
+}
+
+void fb_draw_line(Gameboy *gb, const u8 pixels[160], const uint_least8_t line)
+{
+  struct worker *const w = gb->direct.misc_data;
+  memcpy(w->fb[line], pixels, LCD_WIDTH);
+}
+
+u64 fnv1a(u64 hash, const u8 *data, const size_t len)
+{
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ data[i]) * FNV_PRIME;
+
+  return hash;
+}
+
+u64 now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Growable output line, flushed to stdout in one piece. */
+struct buf
+{
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+void buf_printf(struct buf *b, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+void buf_printf(struct buf *b, const char *fmt, ...)
+{
+  for (;;)
+  {
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+    va_end(ap);
+
+    if (n < 0)
+      return;
+
+    if (b->len + n < b->cap)
+    {
+      b->len += n;
+      return;
+    }
+
+    {
+      const size_t cap = (b->cap + n + 1) * 2;
+      char *grown = realloc(b->data, cap);
+
+      if (grown == NULL)
+        return;
+
+      b->data = grown;
+      b->cap = cap;
+    }
+  }
+}
+
+void buf_string(struct buf *b, const char *s)
+{
+  buf_printf(b, "\"");
+
+  for (; *s; s++)
+  {
+    if (*s == '"' || *s == '\\')
+      buf_printf(b, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20)
+      buf_printf(b, "\\u%04x", *s);
+    else
+      buf_printf(b, "%c", *s);
+  }
+
+  buf_printf(b, "\"");
+}
+
+void buf_hex(struct buf *b, const u8 *data, const size_t len)
+{
+  static const char digits[] = "0123456789abcdef";
+
+  buf_printf(b, "\"");
+
+  for (size_t i = 0; i < len; i++)
+    buf_printf(b, "%c%c", digits[data[i] >> 4], digits[data[i] & 0xF]);
+
+  buf_printf(b, "\"");
+}
+
+void run_job(struct worker *w, const struct job *job, struct buf *out)
+{
+  Gameboy *const gb = w->gb;
+  const struct rom *const rom = &roms[job->rom];
+  struct input_event *events = NULL;
+  uf32 event_count = 0;
+  uf32 next_event = 0;
+  Movie movie = {0};
+  u64 *hashes = NULL;
+  u64 chain = FNV_OFFSET;
+  u64 frame_hash = FNV_OFFSET;
+  u64 frames = 0;
+  u64 cycles = 0;
+  u64 start = now_ns();
+  u64 ns;
+  const char *error = NULL;
+
+  buf_printf(out, "{\"job\":%lu,\"rom\":", (unsigned long)job->id);
+  buf_string(out, rom->path);
+  buf_printf(out, ",\"input\":");
+
+  if (job->input != NULL)
+    buf_string(out, job->input);
+  else
+    buf_printf(out, "null");
+
+  if (rom->error)
+  {
+    error = strerror(rom->error);
+    goto out;
+  }
+
+  /* The input is either a movie or an input script. */
+  if (job->input != NULL)
+  {
+    if (!movie_read(&movie, job->input))
+    {
+      error = strerror(errno);
+      goto out;
+    }
+
+    if (movie.size < sizeof(MOVIE_MAGIC) - 1 ||
+        memcmp(movie.data, MOVIE_MAGIC, sizeof(MOVIE_MAGIC) - 1) != 0)
+    {
+      movie_free(&movie);
+
+      if ((events = load_input_script(job->input, &event_count)) == NULL)
+      {
+        error = strerror(errno);
+        goto out;
+      }
+    }
+  }
+
+  if (all_hashes && (hashes = malloc(job->frames * sizeof(*hashes))) == NULL)
+  {
+    error = strerror(errno);
+    goto out;
+  }
+
+  w->rom = rom;
+  w->invalid_opcode = 0;
+  memset(w->fb, 0, sizeof(w->fb));
+
+  /* gb_init leaves memory alone, so clear what the last job left behind
+     to start from the same state as a fresh glitzboy-headless. */
+  memset(gb, 0, sizeof(*gb));
+
+  switch (gb_init(gb, &read_rom, &read_ram, &write_ram, &Error, w))
+  {
+  case INIT_NO_ERROR:
+    break;
+
+  case INIT_CARTRIDGE_UNSUPPORTED:
+    error = "unsupported cartridge";
+    goto out;
+
+  case INIT_INVALID_HASH:
+    error = "invalid header checksum";
+    goto out;
+
+  default:
+    error = "unknown init error";
+    goto out;
+  }
+
+  memset(w->cartridgeram, 0xFF, get_save_size(gb));
+  gb->direct.cart_ram = w->cartridgeram;
+
+  /* read_rom pads short dumps with 0xFF; a full one can be read directly. */
+  if (rom->size >= (size_t)gb->num_rom_banks * ROM_BANK_SIZE)
+    gb->direct.rom = rom->data;
+  init_gpu(gb, &fb_draw_line);
+  audio_set_synth(&gb->apu, 0);
+
+  if (movie.data != NULL && movie_play(&movie, gb) != MOVIE_NO_ERROR)
+  {
+    error = "invalid movie";
+    goto out;
+  }
+
+  start = now_ns();
+
+  for (; frames < job->frames; frames++)
+  {
+    while (next_event < event_count && events[next_event].frame <= frames)
+    {
+      const struct input_event *e = &events[next_event++];
+
+      if (e->power)
+        movie_power_on(gb);
+      else if (e->reset)
+        gb_reset(gb);
+
+      gb->direct.joypad = e->joypad;
+    }
+
+    if (movie.data != NULL && !movie_play_frame(&movie, gb))
+      break;
+
+    run_frame(gb);
+
+    frame_hash = fnv1a(FNV_OFFSET, &w->fb[0][0], sizeof(w->fb));
+    chain = fnv1a(chain, (const u8 *)&frame_hash, sizeof(frame_hash));
+
+    if (hashes != NULL)
+      hashes[frames] = frame_hash;
+  }
+
+  cycles = gb->timer.cycles;
+
+  if (w->invalid_opcode)
+    error = "invalid opcode";
+
+out:
+  ns = now_ns() - start;
+
+  buf_printf(out, ",\"frames\":%llu,\"cycles\":%llu,\"ns\":%llu,\"fps\":%.1f",
+             (unsigned long long)frames, (unsigned long long)cycles,
+             (unsigned long long)ns, ns ? frames * 1e9 / ns : 0.0);
+
+  if (frames)
+  {
+    buf_printf(out, ",\"frame_hash\":\"%016llx\",\"chain_hash\":\"%016llx\"",
+               (unsigned long long)frame_hash, (unsigned long long)chain);
+    buf_printf(out, ",\"wram_hash\":\"%016llx\",\"hram_hash\":\"%016llx\"",
+               (unsigned long long)fnv1a(FNV_OFFSET, gb->wram, WRAM_SIZE),
+               (unsigned long long)fnv1a(FNV_OFFSET, gb->hram, HRAM_SIZE));
+
+    if (get_save_size(gb))
+      buf_printf(out, ",\"sav_hash\":\"%016llx\"",
+                 (unsigned long long)fnv1a(FNV_OFFSET, w->cartridgeram,
+                                           get_save_size(gb)));
+  }
+
+  if (movie.data != NULL)
+    buf_printf(out, ",\"movie\":\"%s\"",
+               !movie.ended ? "stopped" : movie.desync ? "desync" : "in sync");
+
+  if (hashes != NULL && frames)
+  {
+    buf_printf(out, ",\"hashes\":[");
+
+    for (u64 i = 0; i < frames; i++)
+      buf_printf(out, "%s\"%016llx\"", i ? "," : "",
+                 (unsigned long long)hashes[i]);
+
+    buf_printf(out, "]");
+  }
+
+  if (dump_ram && frames)
+  {
+    buf_printf(out, ",\"wram\":");
+    buf_hex(out, gb->wram, WRAM_SIZE);
+    buf_printf(out, ",\"hram\":");
+    buf_hex(out, gb->hram, HRAM_SIZE);
+  }
+
+  if (error != NULL)
+  {
+    buf_printf(out, ",\"error\":");
+    buf_string(out, error);
+
+    if (w->invalid_opcode)
+      buf_printf(out, ",\"opcode\":%u", w->bad_opcode);
+  }
+
+  buf_printf(out, "}\n");
+
+  free(hashes);
+  free(events);
+  movie_free(&movie);
+}
+
+struct job *take_job(struct worker *self)
+{
+  struct job *job = NULL;
+
+  pthread_mutex_lock(&self->lock);
+
+  if (self->bottom != self->top)
+    job = self->jobs[--self->bottom];
+
+  pthread_mutex_unlock(&self->lock);
+
+  for (uf32 i = 1; job == NULL && i < worker_count; i++)
+  {
+    struct worker *victim = &workers[(self->index + i) % worker_count];
+
+    pthread_mutex_lock(&victim->lock);
+
+    if (victim->bottom != victim->top)
+      job = victim->jobs[victim->top++];
+
+    pthread_mutex_unlock(&victim->lock);
+  }
+
+  return job;
+}
+
+void *worker_main(void *arg)
+{
+  struct worker *w = arg;
+  struct buf out = {NULL, 0, 0};
+  struct job *job;
+
+  while ((job = take_job(w)) != NULL)
+  {
+    out.len = 0;
+    run_job(w, job, &out);
+
+    if (out.len)
+    {
+      flockfile(stdout);
+      fwrite(out.data, 1, out.len, stdout);
+      fflush(stdout);
+      funlockfile(stdout);
+    }
+  }
+
+  free(out.data);
+  return NULL;
+}
+
+/* Returns the index of the ROM in roms, mapping it on first use. */
+long map_rom(const char *path)
+{
+  struct rom *rom;
+  struct stat st;
+  int fd;
+
+  for (uf32 i = 0; i < rom_count; i++)
+  {
+    if (strcmp(roms[i].path, path) == 0)
+      return i;
+  }
+
+  if ((rom = realloc(roms, (rom_count + 1) * sizeof(*rom))) == NULL)
+    return -1;
+
+  roms = rom;
+  rom = &rom[rom_count++];
+  rom->path = strdup(path);
+  rom->data = NULL;
+  rom->size = 0;
+  rom->error = 0;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+  {
+    rom->error = errno;
+    return rom_count - 1;
+  }
+
+  if (fstat(fd, &st) < 0)
+    rom->error = errno;
+  else if (st.st_size == 0)
+    rom->error = EINVAL;
+  else if ((rom->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+           MAP_FAILED)
+  {
+    rom->error = errno;
+    rom->data = NULL;
+  }
+  else
+    rom->size = st.st_size;
+
+  close(fd);
+  return rom_count - 1;
+}
+
+/*
+ * Job list: one "ROM INPUT FRAMES" triple per line, where INPUT is a movie,
+ * an input script as read by load_input_script() or '-' for none. '#'
+ * starts a comment.
+ */
+struct job *load_jobs(const char *file_name, uf32 *count)
+{
+  FILE *f = fopen(file_name, "r");
+  struct job *jobs;
+  uf32 cap = 64;
+  char line[4096];
+
+  *count = 0;
+
+  if (f == NULL)
+    return NULL;
+
+  /* Allocated up front so that a file with no jobs is not an error here. */
+  if ((jobs = malloc(cap * sizeof(*jobs))) == NULL)
+  {
+    fclose(f);
+    return NULL;
+  }
+
+  while (fgets(line, sizeof(line), f) != NULL)
+  {
+    char rom[2048], input[2048];
+    unsigned long long frames;
+    long index;
+
+    if (line[0] == '#' ||
+        sscanf(line, "%2047s %2047s %llu", rom, input, &frames) != 3)
+      continue;
+
+    if (*count == cap)
+    {
+      struct job *grown;
+
+      cap *= 2;
+
+      if ((grown = realloc(jobs, cap * sizeof(*jobs))) == NULL)
+        goto fail;
+
+      jobs = grown;
+    }
+
+    if ((index = map_rom(rom)) < 0)
+      goto fail;
+
+    jobs[*count].id = *count;
+    jobs[*count].rom = index;
+    jobs[*count].frames = frames;
+    jobs[*count].input = NULL;
+
+    if (strcmp(input, "-") && (jobs[*count].input = strdup(input)) == NULL)
+      goto fail;
+
+    (*count)++;
+  }
+
+  if (ferror(f))
+    goto fail;
+
+  fclose(f);
+  return jobs;
+
+fail:
+  fclose(f);
+
+  for (uf32 i = 0; i < *count; i++)
+    free(jobs[i].input);
+
+  free(jobs);
+  *count = 0;
+  return NULL;
+}
+
+void usage(const char *name)
+{
+  printf("Usage: %s [OPTIONS] JOBS\n", name);
+  puts("  -j N       Use N worker threads (default: online CPUs).");
+  puts("  --hashes   Include the hash of every frame in the results.");
+  puts("  --ram      Include WRAM and HRAM hex dumps in the results.");
+  puts("Each line of JOBS is \"ROM INPUT FRAMES\"; INPUT is an input script");
+  puts("or a movie, or - for none.");
+}
+
+int main(int argc, char **argv)
+{
+  const char *jobs_file_name = NULL;
+  struct job *jobs;
+  uf32 job_count;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  u64 total_frames = 0;
+  u64 start;
+  double elapsed;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+      threads = strtol(argv[++i], NULL, 0);
+    else if (strcmp(argv[i], "--hashes") == 0)
+      all_hashes = 1;
+    else if (strcmp(argv[i], "--ram") == 0)
+      dump_ram = 1;
+    else if (argv[i][0] != '-' && jobs_file_name == NULL)
+      jobs_file_name = argv[i];
+    else
+    {
+      jobs_file_name = NULL;
+      break;
+    }
+  }
+
+  if (jobs_file_name == NULL || threads < 1)
+  {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if ((jobs = load_jobs(jobs_file_name, &job_count)) == NULL)
+  {
+    fprintf(stderr, "%s: %s\n", jobs_file_name, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  if (job_count == 0)
+  {
+    fprintf(stderr, "%s: no jobs\n", jobs_file_name);
+    return EXIT_FAILURE;
+  }
+
+  worker_count = MIN((uf32)threads, job_count);
+
+  if ((workers = calloc(worker_count, sizeof(*workers))) == NULL)
+  {
+    fprintf(stderr, "%d: %s\n", __LINE__, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  /* Deal the jobs out round-robin; stealing evens out the rest. */
+  for (uf32 i = 0; i < worker_count; i++)
+  {
+    struct worker *w = &workers[i];
+
+    w->index = i;
+    w->jobs = malloc((job_count / worker_count + 1) * sizeof(*w->jobs));
+    w->gb = malloc(sizeof(*w->gb));
+    w->cartridgeram = malloc(0x20000);
+
+    if (w->jobs == NULL || w->gb == NULL || w->cartridgeram == NULL)
+    {
+      fprintf(stderr, "%d: %s\n", __LINE__, strerror(errno));
+      return EXIT_FAILURE;
+    }
+
+    pthread_mutex_init(&w->lock, NULL);
+  }
+
+  for (uf32 i = 0; i < job_count; i++)
+  {
+    struct worker *w = &workers[i % worker_count];
+
+    /* Owners pop from the bottom, so push in reverse to run in order. */
+    w->jobs[w->bottom++] = &jobs[job_count - 1 - i];
+    total_frames += jobs[i].frames;
+  }
+
+  start = now_ns();
+
+  for (uf32 i = 0; i < worker_count; i++)
+  {
+    if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]))
+    {
+      fprintf(stderr, "pthread_create failed\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  for (uf32 i = 0; i < worker_count; i++)
+    pthread_join(workers[i].thread, NULL);
+
+  elapsed = (now_ns() - start) / 1e9;
+
+  fprintf(stderr, "jobs: %lu\nthreads: %lu\nframes: %llu\nseconds: %.3f\nfps: %.1f\n",
+          (unsigned long)job_count, (unsigned long)worker_count,
+          (unsigned long long)total_frames, elapsed,
+          elapsed > 0 ? total_frames / elapsed : 0.0);
+
+  for (uf32 i = 0; i < worker_count; i++)
+  {
+    pthread_mutex_destroy(&workers[i].lock);
+    free(workers[i].jobs);
+    free(workers[i].gb);
+    free(workers[i].cartridgeram);
+  }
+
+  for (uf32 i = 0; i < job_count; i++)
+    free(jobs[i].input);
+
+  for (uf32 i = 0; i < rom_count; i++)
+  {
+    if (roms[i].data != NULL)
+      munmap((void *)roms[i].data, roms[i].size);
+
+    free(roms[i].path);
+  }
+
+  free(workers);
+  free(jobs);
+  free(roms);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "defs.h"
+#include "gb.h"
+#include "cpu.h"
+#include "apu.h"
+#include "state.h"
+#include "perf.h"
+
+/*
+ * Uncapped benchmark. The ROM is run for a number of frames as fast as
+ * possible three times from the same state: with drawing and audio, with
+ * audio only and with neither. The last pass is the CPU (and timer, LCD
+ * mode and DMA) time; the differences give the PPU and APU time.
+ *
+ * The split is an estimate. Timing noise can make a pass with less work
+ * take longer, most visibly when drawing or sound is cheap, so the parts
+ * are clamped to be non-negative and to add up to the total. If that was
+ * needed, or the passes did not execute the same number of instructions,
+ * split_exact is cleared.
+ *
+ * Times are process CPU time from clock(). Host hardware counters, where
+ * perf events are available, are read around each pass and split the
+ * same way.
+ */
+
+enum BenchmarkPhase
+{
+	BENCHMARK_CPU,
+	BENCHMARK_PPU,
+	BENCHMARK_APU,
+
+	BENCHMARK_PHASES
+};
+
+struct benchmark
+{
+	u64 frames;
+	u64 cycles;
+	u64 instructions;
+
+	double seconds;
+	double cpu_seconds;
+	double ppu_seconds;
+	double apu_seconds;
+	bool split_exact;
+
+	/* Counters open during the run (perf.h), 0 without perf events. */
+	u8 perf_mask;
+	struct perf_sample perf[BENCHMARK_PHASES];
+};
+
+static double benchmark_pass(Gameboy *gb, const u64 frames, const bool draw,
+							 const bool audio, u64 *instructions,
+							 const Perf *perf, struct perf_sample *counters)
+{
+	static f32 samples[2 * AUDIO_CHUNK];
+	void (*const draw_line)(struct Gameboy *, const u8 pixels[static 160],
+							const uf8 line) = gb->display.gpu_draw_line;
+	const u32 synth = gb->apu.synth;
+	double audio_frames = 0.0;
+	u64 count = 0;
+	struct perf_sample perf_start, perf_end;
+	clock_t start;
+
+	if (!draw)
+		gb->display.gpu_draw_line = NULL;
+
+	audio_set_synth(&gb->apu, audio);
+	start = clock();
+	perf_read(perf, &perf_start);
+
+	for (u64 f = 0; f < frames; f++)
+	{
+		const u64 frame_start = gb->timer.cycles;
+
+		gb->frame = 0;
+
+		while (!gb->frame && gb->timer.cycles - frame_start < SCREEN_REFRESH_CYCLES)
+		{
+			count += !gb->halt;
+			cpu_step(gb);
+		}
+
+		if (audio)
+		{
+			uf32 n;
+
+			audio_frames += AUDIO_SAMPLE_RATE / VERTICAL_SYNC;
+			n = (uf32)audio_frames;
+			audio_frames -= n;
+			audio_render(&gb->apu, samples, n);
+		}
+	}
+
+	perf_read(perf, &perf_end);
+	start = clock() - start;
+
+	memset(counters, 0, sizeof(*counters));
+	perf_accumulate(counters, &perf_end, &perf_start);
+	gb->display.gpu_draw_line = draw_line;
+	audio_set_synth(&gb->apu, synth);
+	*instructions = count;
+
+	return (double)start / CLOCKS_PER_SEC;
+}
+
+/* Returns 0 if out of memory. gb is left where the last pass ended. */
+bool benchmark_run(Gameboy *gb, const u64 frames, struct benchmark *b)
+{
+	const size_t state_size = gb_state_size(gb);
+	const u64 start_cycles = gb->timer.cycles;
+	u8 *state = malloc(state_size);
+	u64 instructions, none_instructions, audio_only_instructions;
+	double audio_only, none;
+	Perf perf;
+	struct perf_sample audio_only_counters, all_counters;
+
+	if (state == NULL)
+		return 0;
+
+	gb_state_save(gb, state, state_size);
+	perf_open(&perf);
+
+	none = benchmark_pass(gb, frames, 0, 0, &none_instructions, &perf,
+						  &b->perf[BENCHMARK_CPU]);
+	gb_state_load(gb, state, state_size);
+	audio_only = benchmark_pass(gb, frames, 0, 1, &audio_only_instructions,
+								&perf, &audio_only_counters);
+	gb_state_load(gb, state, state_size);
+	b->seconds = benchmark_pass(gb, frames, 1, 1, &instructions, &perf,
+								&all_counters);
+
+	b->perf_mask = perf.mask;
+	perf_difference(&b->perf[BENCHMARK_PPU], &all_counters, &audio_only_counters);
+	perf_difference(&b->perf[BENCHMARK_APU], &audio_only_counters,
+					&b->perf[BENCHMARK_CPU]);
+	perf_close(&perf);
+
+	b->frames = frames;
+	b->cycles = gb->timer.cycles - start_cycles;
+	b->instructions = instructions;
+	b->cpu_seconds = MIN(none, b->seconds);
+	b->apu_seconds = MIN(MAX(0.0, audio_only - none), b->seconds - b->cpu_seconds);
+	b->ppu_seconds = b->seconds - b->cpu_seconds - b->apu_seconds;
+	b->split_exact = none <= audio_only && audio_only <= b->seconds &&
+					 none_instructions == instructions &&
+					 audio_only_instructions == instructions;
+
+	free(state);
+	return 1;
+}
+
+/* One JSON object on one line. */
+void benchmark_print(FILE *f, const char *rom, const struct benchmark *b)
+{
+	const double s = b->seconds > 0.0 ? b->seconds : 1e-9;
+
+	fputs("{\"rom\":\"", f);
+
+	for (; *rom; rom++)
+	{
+		if (*rom == '"' || *rom == '\\')
+			fputc('\\', f);
+
+		if ((unsigned char)*rom >= 0x20)
+			fputc(*rom, f);
+	}
+
+	fprintf(f, "\",\"frames\":%llu,\"cycles\":%llu,\"instructions\":%llu,"
+			   "\"seconds\":%.6f,\"fps\":%.2f,\"speed\":%.2f,\"mips\":%.3f,"
+			   "\"ns_per_cycle\":%.3f,\"cpu_seconds\":%.6f,"
+			   "\"ppu_seconds\":%.6f,\"apu_seconds\":%.6f,"
+			   "\"split_exact\":%s,\"perf\":",
+			(unsigned long long)b->frames, (unsigned long long)b->cycles,
+			(unsigned long long)b->instructions, b->seconds, b->frames / s,
+			b->frames / s / VERTICAL_SYNC, b->instructions / s / 1e6,
+			b->cycles ? s * 1e9 / b->cycles : 0.0, b->cpu_seconds,
+			b->ppu_seconds, b->apu_seconds, b->split_exact ? "true" : "false");
+
+	if (!b->perf_mask)
+		fputs("null", f);
+	else
+	{
+		static const char *const phases[BENCHMARK_PHASES] = {"cpu", "ppu", "apu"};
+
+		for (uf8 i = 0; i < BENCHMARK_PHASES; i++)
+		{
+			fprintf(f, "%c\"%s\":", i ? ',' : '{', phases[i]);
+			perf_print_json(f, b->perf_mask, &b->perf[i], b->frames);
+		}
+
+		fputc('}', f);
+	}
+
+	fputs("}\n", f);
+}
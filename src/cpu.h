@@ -3,6 +3,8 @@
 #include "defs.h"
 #include "gb.h"
 #include "gpu.h"
+#include "profiler.h"
+#include "timer.h"
 
 u8 execute_instr(Gameboy *gb)
 {
@@ -14,6 +16,7 @@ u8 execute_instr(Gameboy *gb)
 	u8 reg;
 	u8 write = 1;
 
+	STATS_INC(gb->stats, cb_opcodes[instr]);
 	inst_cycles = 8;
 
 	switch (instr & 0xC7)
@@ -199,6 +202,7 @@ u8 execute_instr(Gameboy *gb)
 void cpu_step(Gameboy *gb)
 {
 	u8 opcode, inst_cycles;
+	uf16 pc, sp;
 	static const u8 op_cycles[0x100] =
 		{
 
@@ -259,11 +263,19 @@ void cpu_step(Gameboy *gb)
 				gb->cpu_reg.PC = CONTROL_INTR_ADDR;
 				gb->hw_reg.IF ^= CONTROL_INTR;
 			}
+
+			if (gb->profiler != NULL)
+				profiler_call(gb->profiler, gb);
 		}
 	}
 
+	pc = gb->cpu_reg.PC;
+	sp = gb->cpu_reg.SP;
 	opcode = (gb->halt ? 0x00 : read_byte(gb, gb->cpu_reg.PC++));
 	inst_cycles = op_cycles[opcode];
+	TRACE_STEP(gb, pc, opcode);
+	STATS_ADD(gb->stats, halted_steps, gb->halt);
+	STATS_ADD(gb->stats, opcodes[opcode], !gb->halt);
 
 	switch (opcode)
 	{
@@ -2069,12 +2081,25 @@ void cpu_step(Gameboy *gb)
 		(gb->Error)(gb, INVALID_OPCODE, opcode);
 	}
 
-	gb->timer.div_count += inst_cycles;
+	if (gb->profiler != NULL)
+		profiler_step(gb->profiler, gb, opcode, pc, sp, inst_cycles);
+
+	gb->timer.cycles += inst_cycles;
+
+	if (gb->timer.dma_count)
+		gb->timer.dma_count = gb->timer.dma_count > inst_cycles
+								  ? gb->timer.dma_count - inst_cycles
+								  : 0;
+
+	if (gb->timer.cycles >= gb->timer.tima_event)
+		timer_sync(gb);
 
-	if (gb->timer.div_count >= DIV_CYCLES)
+	gb->timer.apu_count += inst_cycles;
+
+	if (gb->timer.apu_count >= APU_LENGTH_CYCLES)
 	{
-		gb->hw_reg.DIV++;
-		gb->timer.div_count -= DIV_CYCLES;
+		gb->timer.apu_count -= APU_LENGTH_CYCLES;
+		audio_length_tick(&gb->apu);
 	}
 
 	if (gb->hw_reg.SC & SERIAL_SC_TX_START)
@@ -2115,25 +2140,6 @@ void cpu_step(Gameboy *gb)
 		}
 	}
 
-	if (gb->hw_reg.enable)
-	{
-		static const uf16 TAC_CYCLES[4] = {1024, 16, 64, 256};
-
-		gb->timer.tima_count += inst_cycles;
-
-		while (gb->timer.tima_count >= TAC_CYCLES[gb->hw_reg.rate])
-		{
-			gb->timer.tima_count -= TAC_CYCLES[gb->hw_reg.rate];
-
-			if (++gb->hw_reg.TIMA == 0)
-			{
-				gb->hw_reg.IF |= TIMER_INTR;
-
-				gb->hw_reg.TIMA = gb->hw_reg.TMA;
-			}
-		}
-	}
-
 	if ((gb->hw_reg.LCDC & LCDC_ENABLE) == 0)
 		return;
 
@@ -2204,14 +2210,55 @@ void cpu_step(Gameboy *gb)
 	else if (gb->lcd_mode == LCD_SEARCH_OAM && gb->timer.lcd_count >= LCD_MODE_3_CYCLES)
 	{
 		gb->lcd_mode = LCD_TRANSFER;
-		draw_line(gb);
+		STATS_TIME(gb->stats.host[STATS_PPU], draw_line(gb));
 	}
 }
 
 void run_cpu(Gameboy *gb)
 {
+#ifdef GB_STATS
+	stats_frame_begin(&gb->stats, gb->stats.host[STATS_PPU]);
+#endif
+
 	gb->frame = 0;
+	joypad_update(gb);
 
 	while (!gb->frame)
 		cpu_step(gb);
-}
\ No newline at end of file
+
+#ifdef GB_STATS
+	stats_frame_end(&gb->stats);
+#endif
+}
+
+/*
+ * As run_frame(), but the frame also ends after max_cycles. The headless
+ * runner uses it to stop after a cycle count (-c).
+ */
+void run_frame_cycles(Gameboy *gb, const u64 max_cycles)
+{
+	const u64 start = gb->timer.cycles;
+
+#ifdef GB_STATS
+	stats_frame_begin(&gb->stats, gb->stats.host[STATS_PPU]);
+#endif
+
+	gb->frame = 0;
+	joypad_update(gb);
+
+	while (!gb->frame && gb->timer.cycles - start < max_cycles)
+		cpu_step(gb);
+
+#ifdef GB_STATS
+	stats_frame_end(&gb->stats);
+#endif
+}
+
+/*
+ * Run one frame. With the LCD off there is no VBlank, so the frame also ends
+ * after SCREEN_REFRESH_CYCLES.
+ */
+void run_frame(Gameboy *gb)
+{
+	run_frame_cycles(gb, SCREEN_REFRESH_CYCLES);
+}
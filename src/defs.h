@@ -5,6 +5,7 @@
 typedef uint8_t u8;
 typedef uint16_t u16;
 typedef unsigned u32;
+typedef uint64_t u64;
 typedef uint_fast8_t uf8;
 typedef uint_fast16_t uf16;
 typedef uint_fast32_t uf32;
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <string.h>
+
+#include "defs.h"
+#include "apu.h"
+
+/*
+ * Dynamic rate control. The emulator renders audio into a ring buffer at
+ * its own pace and the audio device drains it. push() resamples each block
+ * by up to DRC_MAX_DELTA either way depending on how full the ring is, so
+ * the fill settles around the target instead of drifting into an under- or
+ * overrun. The ring is single producer, single consumer.
+ */
+
+#define DRC_RING_FRAMES 8192
+#define DRC_RING_MASK (DRC_RING_FRAMES - 1)
+#define DRC_MAX_DELTA 0.005f
+#define DRC_CROSSFADE 64
+
+/* What to do with the audio of frames that fast-forward does not show. */
+enum FastForwardAudio
+{
+	FF_AUDIO_DROP,
+	FF_AUDIO_MUTE
+};
+
+typedef struct Drc
+{
+	f32 ring[DRC_RING_FRAMES * 2];
+	uf32 head;
+	uf32 tail;
+
+	uf32 target;
+	f32 ratio;
+	f32 pos;
+	f32 prev[2];
+
+	f32 fade[2 * DRC_CROSSFADE];
+	u32 have_fade;
+	/* Copy of the APU the crossfade tail is rendered from, so that the
+	 * real one never runs ahead of emulated time. */
+	Apu scratch;
+
+	f32 last[2];
+	uf32 underruns;
+	uf32 overruns;
+} Drc;
+
+void drc_init(Drc *drc, const uf32 target)
+{
+	memset(drc, 0, sizeof(*drc));
+	drc->target = target;
+	drc->ratio = 1.0f;
+}
+
+uf32 drc_fill(const Drc *drc)
+{
+	return __atomic_load_n(&drc->head, __ATOMIC_ACQUIRE) -
+		   __atomic_load_n(&drc->tail, __ATOMIC_ACQUIRE);
+}
+
+/* Latency from the ring plus the device buffer, in milliseconds. */
+f32 drc_latency_ms(const Drc *drc, const uf32 device_frames)
+{
+	return (drc_fill(drc) + device_frames) * 1000.0f / AUDIO_SAMPLE_RATE;
+}
+
+/* Producer side: resample n interleaved stereo frames into the ring. */
+void drc_push(Drc *drc, const f32 *restrict in, const uf32 n)
+{
+	const uf32 tail = __atomic_load_n(&drc->tail, __ATOMIC_ACQUIRE);
+	uf32 head = drc->head;
+	f32 step;
+
+	if (n == 0)
+		return;
+
+	{
+		const f32 error = ((f32)drc->target - (f32)(head - tail)) /
+						  (f32)drc->target;
+
+		drc->ratio = 1.0f + DRC_MAX_DELTA * MAX(-1.0f, MIN(1.0f, error));
+	}
+
+	step = 1.0f / drc->ratio;
+
+	for (; drc->pos < (f32)n; drc->pos += step)
+	{
+		const uf32 j = (uf32)drc->pos;
+		const f32 frac = drc->pos - (f32)j;
+		const f32 *a = j ? in + 2 * (j - 1) : drc->prev;
+		const f32 *b = in + 2 * j;
+
+		if (head - tail >= DRC_RING_FRAMES)
+		{
+			drc->overruns++;
+			continue;
+		}
+
+		drc->ring[2 * (head & DRC_RING_MASK) + 0] = a[0] + (b[0] - a[0]) * frac;
+		drc->ring[2 * (head & DRC_RING_MASK) + 1] = a[1] + (b[1] - a[1]) * frac;
+		head++;
+	}
+
+	drc->pos -= (f32)n;
+	drc->prev[0] = in[2 * (n - 1) + 0];
+	drc->prev[1] = in[2 * (n - 1) + 1];
+
+	__atomic_store_n(&drc->head, head, __ATOMIC_RELEASE);
+}
+
+/* Consumer side: an underrun holds the last frame rather than clicking. */
+void drc_pull(Drc *drc, f32 *restrict out, const uf32 n)
+{
+	const uf32 head = __atomic_load_n(&drc->head, __ATOMIC_ACQUIRE);
+	uf32 tail = drc->tail;
+
+	if (head - tail < n)
+		drc->underruns++;
+
+	for (uf32 i = 0; i < n; ++i)
+	{
+		if (tail != head)
+		{
+			drc->last[0] = drc->ring[2 * (tail & DRC_RING_MASK) + 0];
+			drc->last[1] = drc->ring[2 * (tail & DRC_RING_MASK) + 1];
+			tail++;
+		}
+
+		out[2 * i + 0] = drc->last[0];
+		out[2 * i + 1] = drc->last[1];
+	}
+
+	__atomic_store_n(&drc->tail, tail, __ATOMIC_RELEASE);
+}
+
+void drc_callback(void *misc_data, u8 *restrict stream, int len)
+{
+	drc_pull(misc_data, (f32 *)stream, len / (2 * sizeof(f32)));
+}
+
+/*
+ * Render one frame's worth of audio (n frames) and push it. While fast
+ * forwarding only the presented frames are rendered; the others are
+ * advanced with audio_skip(). Each fast block renders DRC_CROSSFADE extra
+ * frames from a copy of the APU, which are crossfaded into the head of the
+ * next block to hide the jump over the dropped audio. buf must hold
+ * n + DRC_CROSSFADE frames.
+ */
+void drc_render(Drc *drc, Apu *apu, f32 *restrict buf, const uf32 n,
+				const bool fast)
+{
+	audio_render(apu, buf, n);
+
+	if (fast)
+	{
+		memcpy(&drc->scratch, apu, sizeof(drc->scratch));
+		audio_render(&drc->scratch, buf + 2 * n, DRC_CROSSFADE);
+	}
+
+	if (drc->have_fade)
+	{
+		for (uf32 i = 0; i < DRC_CROSSFADE && i < n; ++i)
+		{
+			const f32 t = (i + 0.5f) / DRC_CROSSFADE;
+
+			buf[2 * i + 0] = drc->fade[2 * i + 0] * (1.0f - t) + buf[2 * i + 0] * t;
+			buf[2 * i + 1] = drc->fade[2 * i + 1] * (1.0f - t) + buf[2 * i + 1] * t;
+		}
+	}
+
+	if (fast)
+		memcpy(drc->fade, buf + 2 * n, sizeof(drc->fade));
+
+	drc->have_fade = fast;
+	drc_push(drc, buf, n);
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,22 +7,34 @@
 #include <SDL2/SDL.h>
 
 #include "glitzboy.h"
+#include "drc.h"
+#include "files.h"
+#include "rewind.h"
+#include "runahead.h"
+#include "benchmark.h"
+#include "movie.h"
 
 struct misc_data
 {
 
   u8 *rom;
+  size_t rom_size;
 
   u8 *cartridgeram;
 
   u16 _palette[3][4];
   u16 fb[LCD_HEIGHT][LCD_WIDTH];
+
+  SDL_GameController *controller;
+
+  /* What poll_joypad last read from the keyboard and controller. */
+  u8 polled_joypad;
 };
 
 u8 read_rom(Gameboy *gb, const uf32 address)
 {
   const struct misc_data *const p = gb->direct.misc_data;
-  return p->rom[address];
+  return address < p->rom_size ? p->rom[address] : 0xFF;
 }
 
 u8 read_ram(Gameboy *gb, const uf32 address)
@@ -36,77 +49,81 @@ void write_ram(Gameboy *gb, const uf32 address, const u8 value)
   p->cartridgeram[address] = value;
 }
 
-u8 *load_rom_into_ram(const char *file_name)
+/* Keys and controller buttons for each direct.joypad bit, in bit order. */
+static const struct
 {
-  FILE *romfile = fopen(file_name, "rb");
-  size_t size;
-  u8 *rom = NULL;
-
-  if (romfile == NULL)
-    return NULL;
-
-  fseek(romfile, 0, SEEK_END);
-  size = ftell(romfile);
-  rewind(romfile);
-  rom = malloc(size);
-
-  if (fread(rom, sizeof(u8), size, romfile) != size)
+  SDL_Keycode key;
+  SDL_GameControllerButton button;
+} joypad_map[8] = {
+    {SDLK_z, SDL_CONTROLLER_BUTTON_A},
+    {SDLK_x, SDL_CONTROLLER_BUTTON_B},
+    {SDLK_BACKSPACE, SDL_CONTROLLER_BUTTON_BACK},
+    {SDLK_RETURN, SDL_CONTROLLER_BUTTON_START},
+    {SDLK_RIGHT, SDL_CONTROLLER_BUTTON_DPAD_RIGHT},
+    {SDLK_LEFT, SDL_CONTROLLER_BUTTON_DPAD_LEFT},
+    {SDLK_UP, SDL_CONTROLLER_BUTTON_DPAD_UP},
+    {SDLK_DOWN, SDL_CONTROLLER_BUTTON_DPAD_DOWN}};
+
+/* Returns the direct.joypad bit for a key, or 0 if it is not mapped. */
+u8 joypad_key_bit(const SDL_Keycode key)
+{
+  for (uf8 i = 0; i < 8; i++)
   {
-    free(rom);
-    fclose(romfile);
-    return NULL;
+    if (joypad_map[i].key == key)
+      return 1 << i;
   }
 
-  fclose(romfile);
-  return rom;
+  return 0;
 }
 
-void load_cartridge_ram(const char *save_filename, u8 **dest,
-                        const size_t len)
+/* Returns the direct.joypad bit for a controller button, or 0. */
+u8 joypad_button_bit(const Uint8 button)
 {
-  FILE *f;
-
-  if (len == 0)
-  {
-    *dest = NULL;
-    return;
-  }
-
-  if ((*dest = malloc(len)) == NULL)
-  {
-    printf("%d: %s\n", __LINE__, strerror(errno));
-    exit(EXIT_FAILURE);
-  }
-
-  f = fopen(save_filename, "rb");
-
-  if (f == NULL)
+  for (uf8 i = 0; i < 8; i++)
   {
-    memset(*dest, 0xFF, len);
-    return;
+    if (joypad_map[i].button == button)
+      return 1 << i;
   }
 
-  fread(*dest, sizeof(u8), len, f);
-  fclose(f);
+  return 0;
 }
 
-void write_cartridge_ram(const char *save_file_name, u8 **dest,
-                         const size_t len)
+/*
+ * Called by the core when the game reads the joypad, so that a press
+ * counts from that moment rather than from the start of the next frame.
+ * Only the buttons that changed since the last call are updated; the
+ * event loop still owns the rest.
+ */
+void poll_joypad(Gameboy *gb)
 {
-  FILE *f;
+  struct misc_data *const p = gb->direct.misc_data;
+  const Uint8 *keys;
+  u8 joypad = 0xFF, changed;
 
-  if (len == 0 || *dest == NULL)
-    return;
+  SDL_PumpEvents();
+  keys = SDL_GetKeyboardState(NULL);
 
-  if ((f = fopen(save_file_name, "wb")) == NULL)
+  for (uf8 i = 0; i < 8; i++)
   {
-    puts("Unable to open save file.");
-    printf("%d: %s\n", __LINE__, strerror(errno));
-    exit(EXIT_FAILURE);
+    if (keys[SDL_GetScancodeFromKey(joypad_map[i].key)] ||
+        (p->controller != NULL &&
+         SDL_GameControllerGetButton(p->controller, joypad_map[i].button)))
+      joypad &= ~(1 << i);
   }
 
-  fwrite(*dest, sizeof(u8), len, f);
-  fclose(f);
+  changed = joypad ^ p->polled_joypad;
+  gb->direct.joypad = (gb->direct.joypad & ~changed) | (joypad & changed);
+  p->polled_joypad = joypad;
+}
+
+/*
+ * Callback audio renders the Apu that *userdata points to. Same-instance
+ * run-ahead points it at a copy while the real one is run ahead and
+ * loaded back, so the device is only locked for the copies.
+ */
+void audio_callback_apu(void *userdata, u8 *stream, int len)
+{
+  audio_callback(*(Apu **)userdata, stream, len);
 }
 
 void Error(Gameboy *gb, const enum Error gb_err, const u16 value)
@@ -119,6 +136,10 @@ void Error(Gameboy *gb, const enum Error gb_err, const u16 value)
 
     fprintf(stdout, "Invalid opcode %#04x at PC: %#06x, SP: %#06x\n", value,
             gb->cpu_reg.PC - 1, gb->cpu_reg.SP);
+#ifdef GB_TRACE
+    if (gb_trace_save(&gb->trace, gb->timer.cycles, "glitzboy.trace"))
+      fprintf(stdout, "Trace written to glitzboy.trace\n");
+#endif
     break;
 
   case INVALID_WRITE:
@@ -427,29 +448,112 @@ int main(int argc, char **argv)
 
   char *rom_file_name = NULL;
   char *save_file_name = NULL;
+  u32 free_save_file_name = 0;
   int ret = EXIT_SUCCESS;
 
-  switch (argc)
+  u32 audio_sync = 0;
+  u32 native_audio = 0;
+  static Drc drc;
+  uf32 audio_device_frames = 0;
+  double audio_frames = 0.0;
+  uf32 audio_block = 0;
+  enum FastForwardAudio ff_audio = FF_AUDIO_DROP;
+  u32 ff_audio_set = 0;
+  double latency_sum = 0.0;
+  uf32 latency_count = 0;
+  uf32 latency_report = 0;
+
+  static Rewind history;
+  uf32 history_seconds = 0;
+  u32 rewinding = 0;
+  u32 late_input = 1;
+
+  static RunAhead run_ahead;
+  static Gameboy ahead;
+  static struct misc_data ahead_data;
+  uf32 run_ahead_frames = 0;
+  u32 run_ahead_instance = 0;
+  u64 benchmark_frames = 0;
+
+  static Movie movie;
+  const char *record_file_name = NULL;
+  const char *play_file_name = NULL;
+
+  for (int i = 1; i < argc; i++)
   {
-  case 2:
-
-    rom_file_name = argv[1];
-    break;
-
-  case 3:
-
-    rom_file_name = argv[1];
-    save_file_name = argv[2];
-    break;
+    if (strcmp(argv[i], "--audio-sync") == 0)
+      audio_sync = 1;
+    else if (strcmp(argv[i], "--native-audio") == 0)
+      native_audio = 1;
+    else if (strcmp(argv[i], "--ff-audio=drop") == 0)
+      ff_audio = FF_AUDIO_DROP, ff_audio_set = 1;
+    else if (strcmp(argv[i], "--ff-audio=mute") == 0)
+      ff_audio = FF_AUDIO_MUTE, ff_audio_set = 1;
+    else if (strcmp(argv[i], "--rewind") == 0)
+      history_seconds = 120;
+    else if (strncmp(argv[i], "--rewind=", 9) == 0)
+      history_seconds = strtoul(argv[i] + 9, NULL, 0);
+    else if (strncmp(argv[i], "--run-ahead=", 12) == 0)
+      run_ahead_frames = strtoul(argv[i] + 12, NULL, 0);
+    else if (strcmp(argv[i], "--run-ahead-instance") == 0)
+      run_ahead_instance = 1;
+    else if (strncmp(argv[i], "--benchmark=", 12) == 0)
+      benchmark_frames = strtoull(argv[i] + 12, NULL, 0);
+    else if (strncmp(argv[i], "--record=", 9) == 0)
+      record_file_name = argv[i] + 9;
+    else if (strncmp(argv[i], "--play=", 7) == 0)
+      play_file_name = argv[i] + 7;
+    else if (strcmp(argv[i], "--frame-input") == 0)
+      late_input = 0;
+    else if (argv[i][0] != '-' && rom_file_name == NULL)
+      rom_file_name = argv[i];
+    else if (argv[i][0] != '-' && save_file_name == NULL)
+      save_file_name = argv[i];
+    else
+    {
+      rom_file_name = NULL;
+      break;
+    }
+  }
 
-  default:
-    printf("Usage: %s ROM [SAVE]\n", argv[0]);
+  if (rom_file_name == NULL)
+  {
+    printf("Usage: %s [OPTIONS] ROM [SAVE]\n", argv[0]);
     puts("SAVE is set by default if not provided.");
+    puts("--audio-sync    Pace emulation from the audio clock.");
+    puts("--native-audio  Generate sound at 131072 Hz and decimate.");
+    puts("--ff-audio=drop|mute");
+    puts("                Turbo audio with --audio-sync: play one crossfaded");
+    puts("                block per shown frame (default), or mute.");
+    puts("--rewind[=SECONDS]");
+    puts("                Keep SECONDS (default 120) of history; hold b to");
+    puts("                rewind.");
+    puts("--run-ahead=N   Show the frame N frames ahead to hide input lag.");
+    puts("--run-ahead-instance");
+    puts("                Run ahead on a second instance instead of");
+    puts("                restoring the state.");
+    puts("--benchmark=N   Run N frames unpaced without a window and print");
+    puts("                the speed as JSON.");
+    puts("--record=FILE   Record input and resets from the current state to");
+    puts("                the movie FILE.");
+    puts("--play=FILE     Replay the movie FILE, then continue live.");
+    puts("--frame-input   Read input once per frame only, not also when the");
+    puts("                game polls the joypad.");
     ret = EXIT_FAILURE;
     goto out;
   }
 
-  if ((misc_data.rom = load_rom_into_ram(rom_file_name)) == NULL)
+  /* Callback audio is rendered as the device pulls it, so there are no
+     blocks to drop or mute. */
+  if (ff_audio_set && !audio_sync)
+  {
+    puts("--ff-audio needs --audio-sync.");
+    ret = EXIT_FAILURE;
+    goto out;
+  }
+
+  if ((misc_data.rom = load_rom_into_ram(rom_file_name, &misc_data.rom_size)) ==
+      NULL)
   {
     printf("%d: %s\n", __LINE__, strerror(errno));
     ret = EXIT_FAILURE;
@@ -470,6 +574,8 @@ int main(int argc, char **argv)
       goto out;
     }
 
+    free_save_file_name = 1;
+
     strcpy(save_file_name, rom_file_name);
 
     if ((str_replace = strrchr(save_file_name, '.')) == NULL ||
@@ -503,8 +609,41 @@ int main(int argc, char **argv)
     goto out;
   }
 
+  /* read_rom pads short dumps with 0xFF; a full one can be read directly. */
+  if (misc_data.rom_size >= (size_t)gb.num_rom_banks * ROM_BANK_SIZE)
+    gb.direct.rom = misc_data.rom;
+
   load_cartridge_ram(save_file_name, &misc_data.cartridgeram,
                      get_save_size(&gb));
+  gb.direct.cart_ram = misc_data.cartridgeram;
+
+  if (native_audio)
+    audio_set_native(&gb.apu, 32);
+
+  if (history_seconds &&
+      !rewind_init(&history, &gb, 64 << 20, history_seconds * VERTICAL_SYNC))
+  {
+    printf("%d: %s\n", __LINE__, strerror(errno));
+    ret = EXIT_FAILURE;
+    goto out;
+  }
+
+  if (benchmark_frames)
+  {
+    struct benchmark b;
+
+    init_gpu(&gb, &fb_draw_line);
+
+    if (!benchmark_run(&gb, benchmark_frames, &b))
+    {
+      printf("%d: %s\n", __LINE__, strerror(errno));
+      ret = EXIT_FAILURE;
+      goto out;
+    }
+
+    benchmark_print(stdout, rom_file_name, &b);
+    goto out;
+  }
 
   {
     time_t rawtime;
@@ -524,6 +663,33 @@ int main(int argc, char **argv)
 #endif
   }
 
+  if (play_file_name != NULL)
+  {
+    enum MovieError err;
+
+    if (!movie_read(&movie, play_file_name))
+    {
+      printf("%s: %s\n", play_file_name, strerror(errno));
+      ret = EXIT_FAILURE;
+      goto out;
+    }
+
+    if ((err = movie_play(&movie, &gb)) != MOVIE_NO_ERROR)
+    {
+      printf("%s: invalid movie (error %d)\n", play_file_name, err);
+      ret = EXIT_FAILURE;
+      goto out;
+    }
+
+    record_file_name = NULL;
+  }
+  else if (record_file_name != NULL && !movie_record(&movie, &gb, 0))
+  {
+    printf("%d: %s\n", __LINE__, strerror(errno));
+    ret = EXIT_FAILURE;
+    goto out;
+  }
+
   // Standard SDL boilerplate
   if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_GAMECONTROLLER | SDL_INIT_AUDIO) < 0)
   {
@@ -533,6 +699,8 @@ int main(int argc, char **argv)
   }
 
   SDL_AudioDeviceID dev;
+  Apu *audio_apu = &gb.apu;
+  static Apu audio_held;
 
   {
     SDL_AudioSpec want, have;
@@ -540,8 +708,16 @@ int main(int argc, char **argv)
     want.freq = AUDIO_SAMPLE_RATE;
     want.format = AUDIO_F32SYS, want.channels = 2;
     want.samples = AUDIO_SAMPLES;
-    want.callback = audio_callback;
-    want.userdata = NULL;
+    want.callback = audio_callback_apu;
+    want.userdata = &audio_apu;
+
+    if (audio_sync)
+    {
+      /* Two frames of audio buffered ahead of the device. */
+      drc_init(&drc, 2 * AUDIO_SAMPLES);
+      want.callback = drc_callback;
+      want.userdata = &drc;
+    }
 
     printf("Audio driver: %s\n", SDL_GetAudioDeviceName(0, 0));
 
@@ -551,12 +727,39 @@ int main(int argc, char **argv)
       exit(EXIT_FAILURE);
     }
 
-    audio_init();
+    audio_device_frames = have.samples;
     SDL_PauseAudioDevice(dev, 0);
   }
 
   init_gpu(&gb, &fb_draw_line);
 
+  if (run_ahead_frames)
+  {
+    Gameboy *second = NULL;
+
+    if (run_ahead_instance)
+    {
+      ahead_data = misc_data;
+      ahead_data.cartridgeram = malloc(get_save_size(&gb) + 1);
+      second = &ahead;
+
+      if (ahead_data.cartridgeram != NULL)
+      {
+        gb_init(&ahead, &read_rom, &read_ram, &write_ram, &Error, &ahead_data);
+        init_gpu(&ahead, &fb_draw_line);
+        ahead.direct.cart_ram = ahead_data.cartridgeram;
+        ahead.direct.rom = gb.direct.rom;
+      }
+    }
+
+    if ((run_ahead_instance && ahead_data.cartridgeram == NULL) ||
+        !runahead_init(&run_ahead, &gb, run_ahead_frames, second))
+    {
+      printf("%d: %s\n", __LINE__, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+
   SDL_SetHint(SDL_HINT_JOYSTICK_ALLOW_BACKGROUND_EVENTS, "1");
 
   if (SDL_GameControllerAddMappingsFromFile("src/controllerdb.dat") < 0)
@@ -583,6 +786,9 @@ int main(int argc, char **argv)
     }
   }
 
+  misc_data.controller = controller;
+  misc_data.polled_joypad = 0xFF;
+
   {
 
     char title_str[28] = "GlitzBoy: ";
@@ -666,78 +872,18 @@ int main(int argc, char **argv)
 
       case SDL_CONTROLLERBUTTONDOWN:
       case SDL_CONTROLLERBUTTONUP:
-        switch (event.cbutton.button)
-        {
-        case SDL_CONTROLLER_BUTTON_A:
-          gb.direct.raw_bits.a = !event.cbutton.state;
-          break;
-
-        case SDL_CONTROLLER_BUTTON_B:
-          gb.direct.raw_bits.b = !event.cbutton.state;
-          break;
-
-        case SDL_CONTROLLER_BUTTON_BACK:
-          gb.direct.raw_bits.select = !event.cbutton.state;
-          break;
-
-        case SDL_CONTROLLER_BUTTON_START:
-          gb.direct.raw_bits.start = !event.cbutton.state;
-          break;
-
-        case SDL_CONTROLLER_BUTTON_DPAD_UP:
-          gb.direct.raw_bits.up = !event.cbutton.state;
-          break;
-
-        case SDL_CONTROLLER_BUTTON_DPAD_RIGHT:
-          gb.direct.raw_bits.right = !event.cbutton.state;
-          break;
-
-        case SDL_CONTROLLER_BUTTON_DPAD_DOWN:
-          gb.direct.raw_bits.down = !event.cbutton.state;
-          break;
-
-        case SDL_CONTROLLER_BUTTON_DPAD_LEFT:
-          gb.direct.raw_bits.left = !event.cbutton.state;
-          break;
-        }
+        if (event.cbutton.state)
+          gb.direct.joypad &= ~joypad_button_bit(event.cbutton.button);
+        else
+          gb.direct.joypad |= joypad_button_bit(event.cbutton.button);
 
         break;
 
       case SDL_KEYDOWN:
+        gb.direct.joypad &= ~joypad_key_bit(event.key.keysym.sym);
+
         switch (event.key.keysym.sym)
         {
-        case SDLK_RETURN:
-          gb.direct.raw_bits.start = 0;
-          break;
-
-        case SDLK_BACKSPACE:
-          gb.direct.raw_bits.select = 0;
-          break;
-
-        case SDLK_z:
-          gb.direct.raw_bits.a = 0;
-          break;
-
-        case SDLK_x:
-          gb.direct.raw_bits.b = 0;
-          break;
-
-        case SDLK_UP:
-          gb.direct.raw_bits.up = 0;
-          break;
-
-        case SDLK_RIGHT:
-          gb.direct.raw_bits.right = 0;
-          break;
-
-        case SDLK_DOWN:
-          gb.direct.raw_bits.down = 0;
-          break;
-
-        case SDLK_LEFT:
-          gb.direct.raw_bits.left = 0;
-          break;
-
         case SDLK_SPACE:
           fast_mode = 2;
           break;
@@ -759,7 +905,26 @@ int main(int argc, char **argv)
           break;
 
         case SDLK_r:
-          gb_reset(&gb);
+        {
+          const bool power = (event.key.keysym.mod & KMOD_SHIFT) != 0;
+
+          if (play_file_name != NULL)
+            break;
+
+          if (record_file_name != NULL)
+            movie_record_reset(&movie, &gb, power);
+          else if (power)
+            movie_power_on(&gb);
+          else
+            gb_reset(&gb);
+
+          break;
+        }
+
+        case SDLK_b:
+          /* Rewinding would break the movie's timeline. */
+          rewinding = history_seconds != 0 && play_file_name == NULL &&
+                      record_file_name == NULL;
           break;
 
         case SDLK_i:
@@ -787,44 +952,18 @@ int main(int argc, char **argv)
         break;
 
       case SDL_KEYUP:
+        gb.direct.joypad |= joypad_key_bit(event.key.keysym.sym);
+
         switch (event.key.keysym.sym)
         {
-        case SDLK_RETURN:
-          gb.direct.raw_bits.start = 1;
-          break;
-
-        case SDLK_BACKSPACE:
-          gb.direct.raw_bits.select = 1;
-          break;
-
-        case SDLK_z:
-          gb.direct.raw_bits.a = 1;
-          break;
-
-        case SDLK_x:
-          gb.direct.raw_bits.b = 1;
-          break;
-
-        case SDLK_UP:
-          gb.direct.raw_bits.up = 1;
-          break;
-
-        case SDLK_RIGHT:
-          gb.direct.raw_bits.right = 1;
-          break;
-
-        case SDLK_DOWN:
-          gb.direct.raw_bits.down = 1;
-          break;
-
-        case SDLK_LEFT:
-          gb.direct.raw_bits.left = 1;
-          break;
-
         case SDLK_SPACE:
           fast_mode = 1;
           break;
 
+        case SDLK_b:
+          rewinding = 0;
+          break;
+
         case SDLK_f:
           if (fullscreen)
           {
@@ -862,9 +1001,49 @@ int main(int argc, char **argv)
       }
     }
 
-    run_cpu(&gb);
+    /* Input is read mid-frame only in live play: movies hold one joypad
+       per frame, and run-ahead and rewinding replay frames. */
+    gb.joypad_poll = late_input && !rewinding && !run_ahead_frames &&
+                             play_file_name == NULL && record_file_name == NULL
+                         ? &poll_joypad
+                         : NULL;
 
-    rtc_timer += target_speed_ms / fast_mode;
+    /* Load the entry before the newest and run a frame from it, so the
+       screen shows the frame being rewound to. */
+    if (rewinding)
+    {
+      const u8 joypad = gb.direct.joypad;
+
+      rewind_step(&history, &gb);
+      gb.direct.joypad = joypad;
+      run_cpu(&gb);
+    }
+    else
+    {
+      if (play_file_name != NULL && !movie_play_frame(&movie, &gb))
+      {
+        printf("Movie %s after %llu frames.\n",
+               movie.desync ? "desynced" : "ended in sync",
+               (unsigned long long)movie.frames);
+        play_file_name = NULL;
+      }
+
+      if (record_file_name != NULL)
+        movie_record_frame(&movie, gb.direct.joypad);
+
+      if (run_ahead_frames)
+        run_cpu_hidden(&gb);
+      else
+        run_cpu(&gb);
+
+      if (history_seconds)
+        rewind_push(&history, &gb);
+    }
+
+    /* The RTC is frozen while a movie is recorded or played, as in
+       glitzboy-headless, so that replays do not depend on host timing. */
+    if (play_file_name == NULL && record_file_name == NULL)
+      rtc_timer += target_speed_ms / fast_mode;
 
     if (rtc_timer >= 1000)
     {
@@ -872,20 +1051,103 @@ int main(int argc, char **argv)
       tick(&gb);
     }
 
+    if (audio_sync)
+    {
+      audio_frames += AUDIO_SAMPLE_RATE / VERTICAL_SYNC;
+      audio_block = (uf32)audio_frames;
+      audio_frames -= audio_block;
+    }
+
     if (fast_mode_timer > 1)
     {
       fast_mode_timer--;
 
+      if (audio_sync)
+        audio_skip(&gb.apu, audio_block);
+
       continue;
     }
 
     fast_mode_timer = fast_mode;
 
-    SDL_UpdateTexture(texture, NULL, &misc_data.fb, LCD_WIDTH * sizeof(u16));
+    if (audio_sync)
+    {
+      static f32 samples[2 * AUDIO_CHUNK];
+
+      if (fast_mode > 1 && ff_audio == FF_AUDIO_MUTE)
+      {
+        audio_skip(&gb.apu, audio_block);
+        memset(samples, 0, audio_block * 2 * sizeof(f32));
+        drc_push(&drc, samples, audio_block);
+      }
+      else
+        drc_render(&drc, &gb.apu, samples, audio_block, fast_mode > 1);
+    }
+
+    if (run_ahead_frames && !rewinding)
+    {
+      if (run_ahead_instance)
+      {
+        memcpy(ahead_data._palette, misc_data._palette,
+               sizeof(misc_data._palette));
+        ahead.direct.interlace = gb.direct.interlace;
+        ahead.direct.skipframe = gb.direct.skipframe;
+      }
+      else if (!audio_sync)
+      {
+        SDL_LockAudioDevice(dev);
+        audio_held = gb.apu;
+        audio_apu = &audio_held;
+        SDL_UnlockAudioDevice(dev);
+      }
+
+      runahead_show(&run_ahead, &gb);
+
+      /* The load restored the APU as it was before running ahead; the copy
+         is that plus what the callback has played since. */
+      if (!run_ahead_instance && !audio_sync)
+      {
+        SDL_LockAudioDevice(dev);
+        gb.apu = audio_held;
+        audio_apu = &gb.apu;
+        SDL_UnlockAudioDevice(dev);
+      }
+    }
+
+    SDL_UpdateTexture(texture, NULL,
+                      run_ahead_instance && !rewinding ? &ahead_data.fb
+                                                       : &misc_data.fb,
+                      LCD_WIDTH * sizeof(u16));
     SDL_RenderClear(renderer);
     SDL_RenderCopy(renderer, texture, NULL, NULL);
     SDL_RenderPresent(renderer);
 
+    if (audio_sync)
+    {
+      /* The audio clock paces emulation: wait until the device has drained
+         the ring back down to one frame above target. */
+      while (drc_fill(&drc) > drc.target + AUDIO_SAMPLES)
+        SDL_Delay(1);
+
+      latency_sum += drc_latency_ms(&drc, audio_device_frames);
+      latency_count++;
+
+      if (++latency_report == (uf32)VERTICAL_SYNC)
+      {
+        char title_str[48] = "GlitzBoy: ";
+        size_t len;
+
+        rom_title(&gb, title_str + 10);
+        len = strlen(title_str);
+        snprintf(title_str + len, sizeof(title_str) - len, " (%.1f ms)",
+                 drc_latency_ms(&drc, audio_device_frames));
+        SDL_SetWindowTitle(window, title_str);
+        latency_report = 0;
+      }
+
+      continue;
+    }
+
     new_ticks = SDL_GetTicks();
 
     speed_compensation += target_speed_ms - (new_ticks - old_ticks);
@@ -903,7 +1165,8 @@ int main(int argc, char **argv)
       uf32 delay_ticks = SDL_GetTicks();
       uf32 after_delay_ticks;
 
-      rtc_timer += delay;
+      if (play_file_name == NULL && record_file_name == NULL)
+        rtc_timer += delay;
 
       if (rtc_timer >= 1000)
       {
@@ -916,6 +1179,7 @@ int main(int argc, char **argv)
         {
           load_cartridge_ram(save_file_name, &misc_data.cartridgeram,
                              get_save_size(&gb));
+          gb.direct.cart_ram = misc_data.cartridgeram;
           save_timer = 60;
         }
       }
@@ -934,18 +1198,46 @@ int main(int argc, char **argv)
   SDL_GameControllerClose(controller);
   SDL_Quit();
 
+  if (audio_sync && latency_count)
+  {
+    printf("Audio latency: %.1f ms average, %lu underruns, %lu overruns\n",
+           latency_sum / latency_count, (unsigned long)drc.underruns,
+           (unsigned long)drc.overruns);
+  }
+
+  if (history_seconds)
+  {
+    printf("Rewind: %.1f s held in %lu KB, %lu KB per minute\n",
+           rewind_seconds(&history), (unsigned long)(history.used >> 10),
+           (unsigned long)(rewind_bytes_per_minute(&history) >> 10));
+  }
+
+  if (record_file_name != NULL)
+  {
+    if (movie_finish(&movie, &gb) && movie_write(&movie, record_file_name))
+      printf("Movie: %llu frames in %lu bytes\n",
+             (unsigned long long)movie.frames, (unsigned long)movie.size);
+    else
+      printf("%s: %s\n", record_file_name, strerror(errno));
+  }
+
+#ifdef GB_STATS
+  gb_stats_dump(stdout, &gb.stats, &gb.apu.stats);
+#endif
+
   write_cartridge_ram(save_file_name, &misc_data.cartridgeram,
                       get_save_size(&gb));
 
 out:
+  movie_free(&movie);
+  rewind_free(&history);
+  runahead_free(&run_ahead);
+  free(ahead_data.cartridgeram);
   free(misc_data.rom);
   free(misc_data.cartridgeram);
 
-  if (argc == 2)
+  if (free_save_file_name)
     free(save_file_name);
 
-  if (argc == 1)
-    free(rom_file_name);
-
   return ret;
 }
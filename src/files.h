@@ -0,0 +1,173 @@
+#pragma once
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+
+u8 *load_rom_into_ram(const char *file_name, size_t *rom_size)
+{
+	FILE *romfile = fopen(file_name, "rb");
+	long end;
+	size_t size;
+	u8 *rom = NULL;
+
+	if (romfile == NULL)
+		return NULL;
+
+	if (fseek(romfile, 0, SEEK_END) != 0 || (end = ftell(romfile)) < 0)
+	{
+		fclose(romfile);
+		return NULL;
+	}
+
+	size = (size_t)end;
+	rewind(romfile);
+
+	if ((rom = malloc(size ? size : 1)) == NULL ||
+		fread(rom, sizeof(u8), size, romfile) != size)
+	{
+		free(rom);
+		fclose(romfile);
+		return NULL;
+	}
+
+	fclose(romfile);
+	*rom_size = size;
+	return rom;
+}
+
+void load_cartridge_ram(const char *save_filename, u8 **dest,
+						const size_t len)
+{
+	FILE *f;
+
+	if (len == 0)
+	{
+		*dest = NULL;
+		return;
+	}
+
+	if ((*dest = malloc(len)) == NULL)
+	{
+		printf("%d: %s\n", __LINE__, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	f = fopen(save_filename, "rb");
+
+	if (f == NULL)
+	{
+		memset(*dest, 0xFF, len);
+		return;
+	}
+
+	fread(*dest, sizeof(u8), len, f);
+	fclose(f);
+}
+
+void write_cartridge_ram(const char *save_file_name, u8 **dest,
+						 const size_t len)
+{
+	FILE *f;
+
+	if (len == 0 || *dest == NULL)
+		return;
+
+	if ((f = fopen(save_file_name, "wb")) == NULL)
+	{
+		puts("Unable to open save file.");
+		printf("%d: %s\n", __LINE__, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	fwrite(*dest, sizeof(u8), len, f);
+	fclose(f);
+}
+
+struct input_event
+{
+	uf32 frame;
+	u8 joypad;
+
+	/* Reset or power cycle before the frame. */
+	u8 reset : 1;
+	u8 power : 1;
+};
+
+/*
+ * Input script: one "FRAME BUTTONS" pair per line, where BUTTONS is a
+ * '+'-separated list of a, b, select, start, up, down, left, right, or '-'
+ * for none. The buttons stay held until the next line. "reset" or "power"
+ * in the list resets or power cycles before that frame. '#' starts a
+ * comment.
+ */
+struct input_event *load_input_script(const char *file_name, uf32 *count)
+{
+	static const char *const names[8] = {"a", "b", "select", "start",
+										 "right", "left", "up", "down"};
+	FILE *f = fopen(file_name, "r");
+	struct input_event *events = NULL;
+	uf32 cap = 0;
+	char line[256];
+
+	*count = 0;
+
+	if (f == NULL)
+		return NULL;
+
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		unsigned long frame;
+		char buttons[200];
+		u8 joypad = 0xFF;
+		u8 reset = 0, power = 0;
+
+		if (line[0] == '#' || sscanf(line, "%lu %199s", &frame, buttons) != 2)
+			continue;
+
+		for (char *tok = strtok(buttons, "+"); tok != NULL;
+			 tok = strtok(NULL, "+"))
+		{
+			for (u8 i = 0; i < 8; i++)
+			{
+				if (strcmp(tok, names[i]) == 0)
+					joypad &= ~(1 << i);
+			}
+
+			reset |= strcmp(tok, "reset") == 0;
+			power |= strcmp(tok, "power") == 0;
+		}
+
+		if (*count == cap)
+		{
+			struct input_event *grown;
+
+			cap = cap ? cap * 2 : 64;
+
+			if ((grown = realloc(events, cap * sizeof(*events))) == NULL)
+			{
+				free(events);
+				fclose(f);
+				return NULL;
+			}
+
+			events = grown;
+		}
+
+		events[*count].frame = frame;
+		events[*count].joypad = joypad;
+		events[*count].reset = reset;
+		events[*count].power = power;
+		(*count)++;
+	}
+
+	fclose(f);
+
+	if (events == NULL)
+		events = malloc(sizeof(*events));
+
+	return events;
+}
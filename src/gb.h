@@ -1,6 +1,8 @@
 #pragma once
 
 #include "defs.h"
+#include "apu.h"
+#include "trace.h"
 
 struct Gameboy;
 
@@ -34,10 +36,12 @@ struct Gameboy;
 #define CRAM_BANK_SIZE 0x2000
 #define VRAM_BANK_SIZE 0x2000
 
-#define DIV_CYCLES 256
+#define DMA_CYCLES 640
 
 #define SERIAL_CYCLES 4096
 
+#define JOYPAD_POLL_CYCLES 4096
+
 #define DMG_CLOCK_FREQ 4194304.0
 #define SCREEN_REFRESH_CYCLES 70224.0
 #define VERTICAL_SYNC (DMG_CLOCK_FREQ / SCREEN_REFRESH_CYCLES)
@@ -105,9 +109,20 @@ struct Gameboy;
 typedef struct Timer
 {
 	uf16 lcd_count;
-	uf16 div_count;
-	uf16 tima_count;
 	uf16 serial_count;
+	uf16 apu_count;
+	/* Left of the OAM DMA in progress, or 0. */
+	uf16 dma_count;
+
+	/* T-cycles since reset. */
+	u64 cycles;
+
+	/* When the 16-bit divider behind DIV was last zero. */
+	u64 div_base;
+	/* When TIMA was last brought up to date, and when it next overflows
+	 * (UINT64_MAX if it is stopped). */
+	u64 tima_sync;
+	u64 tima_event;
 } Timer;
 
 typedef struct Registers
@@ -167,9 +182,12 @@ typedef struct Registers
 	u16 PC;
 } Registers;
 
+/* trace.h copies AF to SP as one block. */
+typedef char registers_layout_check[offsetof(Registers, SP) == 4 * sizeof(u16) ? 1 : -1];
+
 typedef struct hw_registers
 {
-	u8 TIMA, TMA, DIV;
+	u8 TIMA, TMA;
 	union
 	{
 		struct
@@ -255,6 +273,18 @@ typedef struct Gameboy
 
 	void (*Error)(struct Gameboy *, const enum Error, const u16 value);
 
+	/* Cartridge RAM and MBC register access for the cartridge's
+	 * MBC, set by gb_init() from mbc_handlers (mmu.h). */
+	u8 (*mbc_read_ram)(struct Gameboy *, const uint_fast16_t address);
+	void (*mbc_write_ram)(struct Gameboy *, const uint_fast16_t address,
+						  const u8 value);
+	void (*mbc_write)(struct Gameboy *, const uint_fast16_t address,
+					  const u8 value);
+
+	/* Optional: called when the game reads 0xFF00, at most once every
+	 * JOYPAD_POLL_CYCLES, to bring direct.joypad up to date. */
+	void (*joypad_poll)(struct Gameboy *);
+
 	u8 (*serial_transmit)(struct Gameboy *, const u8 tx);
 	enum SerialStatus (*serial_recv)(struct Gameboy *, u8 *rx);
 
@@ -272,10 +302,16 @@ typedef struct Gameboy
 	u16 num_rom_banks;
 	u8 num_ram_banks;
 
-	u8 selected_rom_bank;
+	u16 selected_rom_bank;
 	u8 cart_ram_bank;
 	u8 enable_cart_ram;
 	u8 cart_mode_select;
+
+	/* ROM offset of the bank mapped at 0x4000, updated on bank switches. */
+	u32 rom_bank_base;
+
+	/* Joypad input lines (low nibble of 0xFF00) as last seen. */
+	u8 joypad_lines;
 	union
 	{
 		struct
@@ -299,6 +335,8 @@ typedef struct Gameboy
 	u8 hram[HRAM_SIZE];
 	u8 oam[OAM_SIZE];
 
+	Apu apu;
+
 	struct
 	{
 		u32 interlace : 1;
@@ -320,6 +358,31 @@ typedef struct Gameboy
 			u8 joypad;
 		};
 
+		/* Optional host copy of the cartridge RAM. When set, save states
+		 * copy it directly instead of going through read_ram/write_ram. */
+		u8 *cart_ram;
+
+		/* Optional host copy of the ROM, num_rom_banks banks long. When
+		 * set, ROM reads index it directly instead of calling read_rom. */
+		const u8 *rom;
+
 		void *misc_data;
 	} direct;
+
+	/* Guest profiler (profiler.h), or NULL. */
+	struct Profiler *profiler;
+
+	/* Rolling hash of every write_byte() (lockstep.h), or NULL. */
+	u64 *write_hash;
+
+	/* timer.cycles at the last joypad_poll call. */
+	u64 joypad_polled;
+
+#ifdef GB_STATS
+	struct gb_stats stats;
+#endif
+
+#ifdef GB_TRACE
+	struct gb_trace trace;
+#endif
 } Gameboy;
@@ -7,6 +7,7 @@
 #include "gpu.h"
 #include "timer.h"
 #include "apu.h"
+#include "state.h"
 
 void gb_reset(Gameboy *gb)
 {
@@ -15,6 +16,7 @@ void gb_reset(Gameboy *gb)
 	gb->lcd_mode = LCD_HBLANK;
 
 	gb->selected_rom_bank = 1;
+	gb->rom_bank_base = ROM_BANK_SIZE;
 	gb->cart_ram_bank = 0;
 	gb->enable_cart_ram = 0;
 	gb->cart_mode_select = 0;
@@ -27,14 +29,17 @@ void gb_reset(Gameboy *gb)
 	gb->cpu_reg.PC = 0x0100;
 
 	gb->timer.lcd_count = 0;
-	gb->timer.div_count = 0;
-	gb->timer.tima_count = 0;
 	gb->timer.serial_count = 0;
+	gb->timer.apu_count = 0;
+	gb->timer.dma_count = 0;
+	gb->timer.cycles = 0;
+	gb->timer.div_base = gb->timer.cycles - 0xAC00;
+	gb->timer.tima_sync = 0;
 
 	gb->hw_reg.TIMA = 0x00;
 	gb->hw_reg.TMA = 0x00;
 	gb->hw_reg.TAC = 0xF8;
-	gb->hw_reg.DIV = 0xAC;
+	timer_schedule(gb);
 
 	gb->hw_reg.IF = 0xE1;
 
@@ -56,6 +61,9 @@ void gb_reset(Gameboy *gb)
 
 	gb->direct.joypad = 0xFF;
 	gb->hw_reg.P1 = 0xCF;
+	gb->joypad_lines = joypad_read_lines(gb);
+
+	audio_init(&gb->apu);
 }
 
 enum InitError gb_init(struct Gameboy *gb,
@@ -92,8 +100,22 @@ enum InitError gb_init(struct Gameboy *gb,
 	gb->Error = Error;
 	gb->direct.misc_data = misc_data;
 
+	gb->joypad_poll = NULL;
+	gb->joypad_polled = 0;
 	gb->serial_transmit = NULL;
 	gb->serial_recv = NULL;
+	gb->direct.cart_ram = NULL;
+	gb->direct.rom = NULL;
+	gb->profiler = NULL;
+	gb->write_hash = NULL;
+
+#ifdef GB_STATS
+	gb_stats_reset(&gb->stats, &gb->apu.stats);
+#endif
+
+#ifdef GB_TRACE
+	gb->trace.count = 0;
+#endif
 
 	{
 		u8 x = 0;
@@ -113,12 +135,21 @@ enum InitError gb_init(struct Gameboy *gb,
 			return INIT_CARTRIDGE_UNSUPPORTED;
 	}
 
-	gb->num_ram_banks = ram_banks[gb->read_rom(gb, mbc_location)];
+	if (gb->read_rom(gb, bank_count_location) >= sizeof(rom_banks) / sizeof(rom_banks[0]) ||
+		rom_banks[gb->read_rom(gb, bank_count_location)] == 0 ||
+		gb->read_rom(gb, ram_size_location) >= sizeof(num_ram_banks))
+		return INIT_CARTRIDGE_UNSUPPORTED;
+
+	gb->cartridge_ram = ram_banks[gb->read_rom(gb, mbc_location)];
 	gb->num_rom_banks = rom_banks[gb->read_rom(gb, bank_count_location)];
 	gb->num_ram_banks = num_ram_banks[gb->read_rom(gb, ram_size_location)];
+	mbc_select(gb);
 
 	gb->display.gpu_draw_line = NULL;
 
+	gb->apu.synth = 1;
+	gb->apu.native_div = 0;
+
 	gb_reset(gb);
 
 	return INIT_NO_ERROR;
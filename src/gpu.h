@@ -1,24 +1,40 @@
 #pragma once
 
+#include <stdbool.h>
+
 #include "gb.h"
 
+/* Whether the window covers part of the current line. */
+static inline bool window_active(const Gameboy *gb)
+{
+	return gb->hw_reg.LCDC & LCDC_WINDOW_ENABLE &&
+		   gb->hw_reg.LY >= gb->display.WY && gb->hw_reg.WX <= 166;
+}
+
 void draw_line(Gameboy *gb)
 {
 	u8 framebuffer[160] = {0};
 
-	if (gb->display.gpu_draw_line == NULL)
-		return;
+	if (gb->display.gpu_draw_line == NULL ||
+		(gb->direct.skipframe && !gb->display.frame_skip_count))
+	{
+		/* The window's line counter advances as if the line were drawn, so
+		 * skipped lines leave the same state behind. */
+		if (window_active(gb))
+			gb->display.window_clear++;
 
-	if (gb->direct.skipframe && !gb->display.frame_skip_count)
+		STATS_INC(gb->stats, lines_skipped);
 		return;
+	}
 
 	if (gb->direct.interlace)
 	{
 		if ((gb->display.interlace_count == 0 && (gb->hw_reg.LY & 1) == 0) || (gb->display.interlace_count == 1 && (gb->hw_reg.LY & 1) == 1))
 		{
-			if (gb->hw_reg.LCDC & LCDC_WINDOW_ENABLE && gb->hw_reg.LY >= gb->display.WY && gb->hw_reg.WX <= 166)
+			if (window_active(gb))
 				gb->display.window_clear++;
 
+			STATS_INC(gb->stats, lines_skipped);
 			return;
 		}
 	}
@@ -80,7 +96,7 @@ void draw_line(Gameboy *gb)
 		}
 	}
 
-	if (gb->hw_reg.LCDC & LCDC_WINDOW_ENABLE && gb->hw_reg.LY >= gb->display.WY && gb->hw_reg.WX <= 166)
+	if (window_active(gb))
 	{
 
 		u16 win_line = (gb->hw_reg.LCDC & LCDC_WINDOW_MAP) ? VRAM_BMAP_2 : VRAM_BMAP_1;
@@ -165,6 +181,8 @@ void draw_line(Gameboy *gb)
 			if (OX == 0 || OX >= 168)
 				continue;
 
+			STATS_INC(gb->stats, sprites_drawn);
+
 			u8 py = gb->hw_reg.LY - OY + 16;
 
 			if (OF & OBJ_FLIP_Y)
@@ -223,6 +241,7 @@ void draw_line(Gameboy *gb)
 		}
 	}
 
+	STATS_INC(gb->stats, lines_drawn);
 	gb->display.gpu_draw_line(gb, framebuffer, gb->hw_reg.LY);
 }
 
@@ -0,0 +1,829 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "glitzboy.h"
+#include "files.h"
+#include "benchmark.h"
+#include "rewind.h"
+#include "runahead.h"
+#include "movie.h"
+#include "profiler.h"
+#include "perf.h"
+#include "lockstep.h"
+
+/*
+ * Headless runner: no window, no audio device and no pacing. Loads a ROM,
+ * runs it for a number of frames or cycles with an optional input script
+ * and writes the final state to files.
+ */
+
+/* Where the trace ring goes on an invalid opcode (GB_TRACE builds). */
+static const char *trace_file_name = "glitzboy.trace";
+
+struct misc_data
+{
+  u8 *rom;
+  size_t rom_size;
+  u8 *cartridgeram;
+
+  u8 fb[LCD_HEIGHT][LCD_WIDTH];
+};
+
+u8 read_rom(Gameboy *gb, const uf32 address)
+{
+  const struct misc_data *const p = gb->direct.misc_data;
+  return address < p->rom_size ? p->rom[address] : 0xFF;
+}
+
+u8 read_ram(Gameboy *gb, const uf32 address)
+{
+  const struct misc_data *const p = gb->direct.misc_data;
+  return p->cartridgeram[address];
+}
+
+void write_ram(Gameboy *gb, const uf32 address, const u8 value)
+{
+  const struct misc_data *const p = gb->direct.misc_data;
+  p->cartridgeram[address] = value;
+}
+
+void Error(Gameboy *gb, const enum Error gb_err, const u16 value)
+{
+  switch (gb_err)
+  {
+  case INVALID_OPCODE:
+    fprintf(stderr, "Invalid opcode %#04x at PC: %#06x, SP: %#06x\n", value,
+            gb->cpu_reg.PC - 1, gb->cpu_reg.SP);
+#ifdef GB_TRACE
+    if (gb_trace_save(&gb->trace, gb->timer.cycles, trace_file_name))
+      fprintf(stderr, "Trace written to %s\n", trace_file_name);
+#endif
+    break;
+
+  case INVALID_WRITE:
+  case INVALID_READ:
+    return;
+
+  default:
+    fprintf(stderr, "Unknown error\n");
+    break;
+  }
+}
+
+void fb_draw_line(Gameboy *gb, const u8 pixels[160], const uint_least8_t line)
+{
+  struct misc_data *misc_data = gb->direct.misc_data;
+  memcpy(misc_data->fb[line], pixels, LCD_WIDTH);
+}
+
+int write_file(const char *prefix, const char *extension, const void *data,
+               const size_t len)
+{
+  char file_name[1024];
+  FILE *f;
+  int ok;
+
+  snprintf(file_name, sizeof(file_name), "%s.%s", prefix, extension);
+
+  if ((f = fopen(file_name, "wb")) == NULL)
+  {
+    printf("%s: %s\n", file_name, strerror(errno));
+    return -1;
+  }
+
+  ok = fwrite(data, 1, len, f) == len;
+
+  if (fclose(f) != 0 || !ok)
+  {
+    printf("%s: %s\n", file_name, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+int write_ppm(const char *prefix, const u8 fb[LCD_HEIGHT][LCD_WIDTH])
+{
+  static const u8 shades[4] = {0xFF, 0xAA, 0x55, 0x00};
+  u8 ppm[15 + LCD_HEIGHT * LCD_WIDTH * 3];
+  int len = sprintf((char *)ppm, "P6\n%d %d\n255\n", LCD_WIDTH, LCD_HEIGHT);
+
+  for (u32 y = 0; y < LCD_HEIGHT; y++)
+  {
+    for (u32 x = 0; x < LCD_WIDTH; x++)
+    {
+      const u8 shade = shades[fb[y][x] & LCD_COLOUR];
+
+      ppm[len++] = shade;
+      ppm[len++] = shade;
+      ppm[len++] = shade;
+    }
+  }
+
+  return write_file(prefix, "ppm", ppm, len);
+}
+
+void put_le(u8 *p, const uf32 value, const u8 bytes)
+{
+  for (u8 i = 0; i < bytes; i++)
+    p[i] = (value >> (8 * i)) & 0xFF;
+}
+
+/* 32-bit float stereo WAV; the sizes are patched when the file is closed. */
+FILE *open_wav(const char *prefix)
+{
+  char file_name[1024];
+  u8 header[44] = "RIFF\0\0\0\0WAVEfmt ";
+  FILE *f;
+
+  snprintf(file_name, sizeof(file_name), "%s.wav", prefix);
+
+  if ((f = fopen(file_name, "wb")) == NULL)
+  {
+    printf("%s: %s\n", file_name, strerror(errno));
+    return NULL;
+  }
+
+  put_le(header + 16, 16, 4);
+  put_le(header + 20, 3, 2);
+  put_le(header + 22, 2, 2);
+  put_le(header + 24, (uf32)AUDIO_SAMPLE_RATE, 4);
+  put_le(header + 28, (uf32)AUDIO_SAMPLE_RATE * 2 * sizeof(f32), 4);
+  put_le(header + 32, 2 * sizeof(f32), 2);
+  put_le(header + 34, 32, 2);
+  memcpy(header + 36, "data", 4);
+  fwrite(header, 1, sizeof(header), f);
+  return f;
+}
+
+void close_wav(FILE *f, const uf32 frames)
+{
+  u8 size[4];
+
+  put_le(size, frames * 2 * sizeof(f32) + 36, 4);
+  fseek(f, 4, SEEK_SET);
+  fwrite(size, 1, 4, f);
+
+  put_le(size, frames * 2 * sizeof(f32), 4);
+  fseek(f, 40, SEEK_SET);
+  fwrite(size, 1, 4, f);
+  fclose(f);
+}
+
+void usage(const char *name)
+{
+  printf("Usage: %s [OPTIONS] ROM\n", name);
+  puts("  -f N       Run N frames (default 600).");
+  puts("  -c N       Run N cycles instead of a frame count.");
+  puts("  -i FILE    Input script: lines of \"FRAME a+b+select+start+...\".");
+  puts("  -o PREFIX  Write PREFIX.ppm, .wram, .vram, .hram, .oam and .sav.");
+  puts("  -a         Render audio to PREFIX.wav (off by default).");
+  puts("  -n         Generate audio at 131072 Hz and decimate.");
+  puts("  -r         Record rewind history and report its size.");
+  puts("  -A N       Show the frame N frames ahead (run-ahead).");
+  puts("  -2         Run ahead on a second instance.");
+  puts("  -b         Benchmark: print speed and the CPU/PPU/APU split as");
+  puts("             JSON instead of running normally.");
+  puts("  -s         Print the profiling counters (GB_STATS builds).");
+  puts("  -R FILE    Record a movie from power-on to FILE.");
+  puts("  -P FILE    Replay a movie to its end (or -f frames) and check");
+  puts("             that it is in sync. Replaces -i.");
+  puts("  -p N       Profile the guest, sampling every N cycles, and print");
+  puts("             the hottest bank:address pairs.");
+  puts("  -y FILE    Name profiled addresses from an RGBDS .sym file.");
+  puts("  -F FILE    Write the profiled call stacks to FILE in collapsed");
+  puts("             (flame graph) format.");
+  puts("  -t FILE    Write the execution trace ring to FILE at the end");
+  puts("             (GB_TRACE builds). It is also written on an invalid");
+  puts("             opcode, by default to glitzboy.trace.");
+  puts("  -V ENGINE  Run ENGINE in lockstep with cpu_step for the -f frames");
+  puts("             and report the first divergence. \"all\" runs each");
+  puts("             engine in turn and \"list\" lists them.");
+  puts("  -e         Read host hardware counters (Linux perf events) around");
+  puts("             emulation and audio synthesis and print them per frame.");
+}
+
+int main(int argc, char **argv)
+{
+  static Gameboy gb;
+  static struct misc_data misc_data;
+  static f32 samples[2 * AUDIO_CHUNK];
+  const char *rom_file_name = NULL;
+  const char *input_file_name = NULL;
+  const char *out_prefix = NULL;
+  u64 max_frames = 600;
+  u64 max_cycles = 0;
+  u32 audio = 0;
+  u32 native_audio = 0;
+  static Rewind history;
+  u32 record_history = 0;
+  static RunAhead run_ahead;
+  static Gameboy ahead;
+  static struct misc_data ahead_data;
+  struct misc_data *shown = &misc_data;
+  uf32 run_ahead_frames = 0;
+  u32 run_ahead_instance = 0;
+  u64 shown_hash = 0;
+  u64 input_frame = 0;
+  u32 input_pending = 0;
+  u64 lag_sum = 0;
+  uf32 lag_count = 0;
+  u32 benchmark = 0;
+  static Movie movie;
+  const char *record_file_name = NULL;
+  const char *play_file_name = NULL;
+  u32 frames_set = 0;
+  u32 stats = 0;
+  static Profiler profiler;
+  u32 profile_period = 0;
+  const char *symbol_file_name = NULL;
+  const char *stacks_file_name = NULL;
+  static Perf perf;
+  u32 perf_counters = 0;
+  u32 trace = 0;
+  const char *validate_name = NULL;
+  struct perf_sample perf_start, perf_end;
+  struct perf_sample perf_emulation = {{0}, 0, 0}, perf_audio = {{0}, 0, 0};
+  struct input_event *events = NULL;
+  uf32 event_count = 0;
+  uf32 next_event = 0;
+  FILE *wav = NULL;
+  uf32 wav_frames = 0;
+  double audio_frames = 0.0;
+  u64 frames = 0;
+  u64 cycles = 0;
+  u64 frame_start;
+  clock_t start;
+  double elapsed;
+  enum InitError gb_ret;
+  int ret = EXIT_SUCCESS;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+    {
+      max_frames = strtoull(argv[++i], NULL, 0);
+      frames_set = 1;
+    }
+    else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+    {
+      max_cycles = strtoull(argv[++i], NULL, 0);
+      max_frames = 0;
+    }
+    else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+      input_file_name = argv[++i];
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+      out_prefix = argv[++i];
+    else if (strcmp(argv[i], "-a") == 0)
+      audio = 1;
+    else if (strcmp(argv[i], "-n") == 0)
+      native_audio = 1;
+    else if (strcmp(argv[i], "-r") == 0)
+      record_history = 1;
+    else if (strcmp(argv[i], "-A") == 0 && i + 1 < argc)
+      run_ahead_frames = strtoul(argv[++i], NULL, 0);
+    else if (strcmp(argv[i], "-2") == 0)
+      run_ahead_instance = 1;
+    else if (strcmp(argv[i], "-b") == 0)
+      benchmark = 1;
+    else if (strcmp(argv[i], "-s") == 0)
+      stats = 1;
+    else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc)
+      record_file_name = argv[++i];
+    else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc)
+      play_file_name = argv[++i];
+    else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+      profile_period = strtoul(argv[++i], NULL, 0);
+    else if (strcmp(argv[i], "-y") == 0 && i + 1 < argc)
+      symbol_file_name = argv[++i];
+    else if (strcmp(argv[i], "-F") == 0 && i + 1 < argc)
+      stacks_file_name = argv[++i];
+    else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+    {
+      trace_file_name = argv[++i];
+      trace = 1;
+    }
+    else if (strcmp(argv[i], "-V") == 0 && i + 1 < argc)
+      validate_name = argv[++i];
+    else if (strcmp(argv[i], "-e") == 0)
+      perf_counters = 1;
+    else if (argv[i][0] != '-' && rom_file_name == NULL)
+      rom_file_name = argv[i];
+    else
+    {
+      rom_file_name = NULL;
+      break;
+    }
+  }
+
+  /* Movies hold whole frames. */
+  if ((record_file_name != NULL || play_file_name != NULL) && max_cycles)
+    rom_file_name = NULL;
+
+  if (rom_file_name == NULL || (audio && out_prefix == NULL && !benchmark))
+  {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if ((misc_data.rom = load_rom_into_ram(rom_file_name, &misc_data.rom_size)) ==
+      NULL)
+  {
+    printf("%s: %s\n", rom_file_name, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  if (play_file_name != NULL)
+  {
+    if (!movie_read(&movie, play_file_name))
+    {
+      printf("%s: %s\n", play_file_name, strerror(errno));
+      ret = EXIT_FAILURE;
+      goto out;
+    }
+
+    input_file_name = NULL;
+
+    if (!frames_set)
+      max_frames = 0;
+  }
+
+  if (input_file_name != NULL &&
+      (events = load_input_script(input_file_name, &event_count)) == NULL)
+  {
+    printf("%s: %s\n", input_file_name, strerror(errno));
+    ret = EXIT_FAILURE;
+    goto out;
+  }
+
+  gb_ret = gb_init(&gb, &read_rom, &read_ram, &write_ram, &Error, &misc_data);
+
+  switch (gb_ret)
+  {
+  case INIT_NO_ERROR:
+    break;
+
+  case INIT_CARTRIDGE_UNSUPPORTED:
+    puts("Unsupported cartridge.");
+    ret = EXIT_FAILURE;
+    goto out;
+
+  case INIT_INVALID_HASH:
+    puts("Invalid ROM: Checksum failure.");
+    ret = EXIT_FAILURE;
+    goto out;
+
+  default:
+    printf("Unknown error: %d\n", gb_ret);
+    ret = EXIT_FAILURE;
+    goto out;
+  }
+
+  /* read_rom pads short dumps with 0xFF; a full one can be read directly. */
+  if (misc_data.rom_size >= (size_t)gb.num_rom_banks * ROM_BANK_SIZE)
+    gb.direct.rom = misc_data.rom;
+
+  /* No save file is loaded so that runs are reproducible. */
+  if (get_save_size(&gb))
+  {
+    if ((misc_data.cartridgeram = malloc(get_save_size(&gb))) == NULL)
+    {
+      printf("%d: %s\n", __LINE__, strerror(errno));
+      ret = EXIT_FAILURE;
+      goto out;
+    }
+
+    memset(misc_data.cartridgeram, 0xFF, get_save_size(&gb));
+    gb.direct.cart_ram = misc_data.cartridgeram;
+  }
+
+  init_gpu(&gb, &fb_draw_line);
+
+  if (validate_name != NULL)
+  {
+    const size_t state_size = gb_state_size(&gb);
+    const u64 lockstep_frames =
+        max_frames ? max_frames : max_cycles / SCREEN_REFRESH_CYCLES;
+    u8 *state = malloc(state_size);
+    u32 found = 0;
+
+    ahead_data.rom = misc_data.rom;
+    ahead_data.rom_size = misc_data.rom_size;
+
+    if (state == NULL ||
+        (ahead_data.cartridgeram = malloc(get_save_size(&gb) + 1)) == NULL)
+    {
+      printf("%d: %s\n", __LINE__, strerror(errno));
+      free(state);
+      ret = EXIT_FAILURE;
+      goto out;
+    }
+
+    gb_state_save(&gb, state, state_size);
+
+    for (size_t e = 1; e < LOCKSTEP_ENGINES; e++)
+    {
+      const struct lockstep_engine *engine = &lockstep_engines[e];
+      Lockstep l;
+
+      if (strcmp(validate_name, "list") == 0)
+      {
+        printf("%-8s %s\n", engine->name, engine->description);
+        found = 1;
+        continue;
+      }
+
+      if (strcmp(validate_name, "all") != 0 &&
+          strcmp(validate_name, engine->name) != 0)
+        continue;
+
+      found = 1;
+      gb_state_load(&gb, state, state_size);
+      gb_init(&ahead, &read_rom, &read_ram, &write_ram, &Error, &ahead_data);
+      init_gpu(&ahead, &fb_draw_line);
+      ahead.direct.cart_ram = ahead_data.cartridgeram;
+      ahead.direct.rom = gb.direct.rom;
+      gb_state_load(&ahead, state, state_size);
+
+      lockstep_init(&l, &gb, &ahead, engine);
+
+      while (l.frames < lockstep_frames && lockstep_frame(&l))
+        ;
+
+      lockstep_report(&l, stdout);
+      lockstep_free(&l);
+
+      if (l.diverged)
+        ret = EXIT_FAILURE;
+    }
+
+    free(state);
+
+    if (!found)
+    {
+      printf("%s: unknown engine; -V list lists them\n", validate_name);
+      ret = EXIT_FAILURE;
+    }
+
+    goto out;
+  }
+
+  if (benchmark)
+  {
+    struct benchmark b;
+
+    if (native_audio)
+      audio_set_native(&gb.apu, 32);
+
+    if (!benchmark_run(&gb, max_frames ? max_frames
+                                       : max_cycles / SCREEN_REFRESH_CYCLES,
+                       &b))
+    {
+      printf("%d: %s\n", __LINE__, strerror(errno));
+      ret = EXIT_FAILURE;
+      goto out;
+    }
+
+    benchmark_print(stdout, rom_file_name, &b);
+    goto out;
+  }
+
+  if (!audio)
+    audio_set_synth(&gb.apu, 0);
+  else
+  {
+    if (native_audio)
+      audio_set_native(&gb.apu, 32);
+
+    if ((wav = open_wav(out_prefix)) == NULL)
+    {
+      ret = EXIT_FAILURE;
+      goto out;
+    }
+  }
+
+  if (play_file_name != NULL)
+  {
+    const enum MovieError err = movie_play(&movie, &gb);
+
+    if (err != MOVIE_NO_ERROR)
+    {
+      printf("%s: invalid movie (error %d)\n", play_file_name, err);
+      ret = EXIT_FAILURE;
+      goto out;
+    }
+  }
+  else if (record_file_name != NULL && !movie_record(&movie, &gb, 1))
+  {
+    printf("%d: %s\n", __LINE__, strerror(errno));
+    ret = EXIT_FAILURE;
+    goto out;
+  }
+
+  if (record_history &&
+      !rewind_init(&history, &gb, (size_t)1 << 30,
+                   max_frames ? max_frames
+                              : max_cycles / SCREEN_REFRESH_CYCLES + 1))
+  {
+    printf("%d: %s\n", __LINE__, strerror(errno));
+    ret = EXIT_FAILURE;
+    goto out;
+  }
+
+  if (run_ahead_frames)
+  {
+    Gameboy *second = NULL;
+
+    if (run_ahead_instance)
+    {
+      ahead_data.rom = misc_data.rom;
+      ahead_data.rom_size = misc_data.rom_size;
+      second = &ahead;
+      shown = &ahead_data;
+
+      if ((ahead_data.cartridgeram = malloc(get_save_size(&gb) + 1)) != NULL)
+      {
+        gb_init(&ahead, &read_rom, &read_ram, &write_ram, &Error, &ahead_data);
+        init_gpu(&ahead, &fb_draw_line);
+        ahead.direct.cart_ram = ahead_data.cartridgeram;
+        ahead.direct.rom = gb.direct.rom;
+      }
+    }
+
+    if ((run_ahead_instance && ahead_data.cartridgeram == NULL) ||
+        !runahead_init(&run_ahead, &gb, run_ahead_frames, second))
+    {
+      printf("%d: %s\n", __LINE__, strerror(errno));
+      ret = EXIT_FAILURE;
+      goto out;
+    }
+  }
+
+  if (profile_period || stacks_file_name != NULL)
+  {
+    if (!profiler_init(&profiler, profile_period ? profile_period : 1000))
+    {
+      printf("%d: %s\n", __LINE__, strerror(errno));
+      ret = EXIT_FAILURE;
+      goto out;
+    }
+
+    if (symbol_file_name != NULL &&
+        !profiler_load_symbols(&profiler, symbol_file_name))
+    {
+      printf("%s: %s\n", symbol_file_name, strerror(errno));
+      ret = EXIT_FAILURE;
+      goto out;
+    }
+
+    gb.profiler = &profiler;
+  }
+
+  if (perf_counters && !perf_open(&perf))
+  {
+    printf("perf: unavailable (%s)\n", perf_strerror(&perf));
+    perf_counters = 0;
+  }
+
+  start = clock();
+
+  while ((max_frames == 0 || frames < max_frames) &&
+         (max_cycles == 0 || cycles < max_cycles))
+  {
+    while (next_event < event_count && events[next_event].frame <= frames)
+    {
+      const struct input_event *e = &events[next_event++];
+
+      if (e->reset || e->power)
+      {
+        if (record_file_name != NULL)
+          movie_record_reset(&movie, &gb, e->power);
+        else if (e->power)
+          movie_power_on(&gb);
+        else
+          gb_reset(&gb);
+      }
+
+      gb.direct.joypad = e->joypad;
+
+      if (!input_pending)
+      {
+        input_pending = 1;
+        input_frame = frames;
+      }
+    }
+
+    if (play_file_name != NULL && !movie_play_frame(&movie, &gb))
+      break;
+
+    if (record_file_name != NULL && !movie_record_frame(&movie, gb.direct.joypad))
+    {
+      printf("%d: %s\n", __LINE__, strerror(errno));
+      ret = EXIT_FAILURE;
+      goto out;
+    }
+
+    if (run_ahead_frames)
+      gb.display.gpu_draw_line = NULL;
+
+    if (perf_counters)
+      perf_read(&perf, &perf_start);
+
+    /* Resets, power-ons and state loads all move timer.cycles, so the
+     * frame is measured from here and the total is kept separately. */
+    frame_start = gb.timer.cycles;
+
+    run_frame_cycles(&gb, max_cycles == 0 ||
+                                  max_cycles - cycles > SCREEN_REFRESH_CYCLES
+                              ? SCREEN_REFRESH_CYCLES
+                              : max_cycles - cycles);
+
+    cycles += gb.timer.cycles - frame_start;
+
+    if (perf_counters)
+    {
+      perf_read(&perf, &perf_end);
+      perf_accumulate(&perf_emulation, &perf_end, &perf_start);
+    }
+
+    if (run_ahead_frames)
+      gb.display.gpu_draw_line = &fb_draw_line;
+
+    if (!gb.frame && gb.timer.cycles - frame_start < SCREEN_REFRESH_CYCLES)
+      break;
+
+    frames++;
+
+    if (record_history)
+      rewind_push(&history, &gb);
+
+    if (wav != NULL)
+    {
+      uf32 n;
+
+      audio_frames += AUDIO_SAMPLE_RATE / VERTICAL_SYNC;
+      n = (uf32)audio_frames;
+      audio_frames -= n;
+
+      if (perf_counters)
+        perf_read(&perf, &perf_start);
+
+      audio_render(&gb.apu, samples, n);
+
+      if (perf_counters)
+      {
+        perf_read(&perf, &perf_end);
+        perf_accumulate(&perf_audio, &perf_end, &perf_start);
+      }
+
+      fwrite(samples, 2 * sizeof(f32), n, wav);
+      wav_frames += n;
+    }
+
+    if (run_ahead_frames)
+      runahead_show(&run_ahead, &gb);
+
+    /* Input lag: frames from an input change to the next change on screen. */
+    if (events != NULL)
+    {
+      u64 hash = 0xcbf29ce484222325ULL;
+
+      for (u32 i = 0; i < sizeof(shown->fb); i++)
+        hash = (hash ^ (&shown->fb[0][0])[i]) * 0x100000001b3ULL;
+
+      if (input_pending && hash != shown_hash)
+      {
+        lag_sum += frames - 1 - input_frame;
+        lag_count++;
+        input_pending = 0;
+      }
+
+      shown_hash = hash;
+    }
+  }
+
+  elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+  printf("frames: %llu\ncycles: %llu\nseconds: %.3f\n",
+         (unsigned long long)frames, (unsigned long long)cycles,
+         elapsed);
+
+  if (lag_count)
+    printf("input lag: %.2f frames\n", (double)lag_sum / lag_count);
+
+  if (stats)
+  {
+#ifdef GB_STATS
+    gb_stats_dump(stdout, &gb.stats, &gb.apu.stats);
+#else
+    puts("stats: build with STATS=yes");
+#endif
+  }
+
+  if (trace)
+  {
+#ifdef GB_TRACE
+    if (!gb_trace_save(&gb.trace, gb.timer.cycles, trace_file_name))
+    {
+      printf("%s: %s\n", trace_file_name, strerror(errno));
+      ret = EXIT_FAILURE;
+    }
+#else
+    puts("trace: build with TRACE=yes");
+#endif
+  }
+
+  if (perf_counters)
+  {
+    printf("perf per frame over %llu frames:\n", (unsigned long long)frames);
+    perf_print(stdout, "cpu+ppu", perf.mask, &perf_emulation, frames);
+
+    if (wav != NULL)
+      perf_print(stdout, "apu", perf.mask, &perf_audio, frames);
+  }
+
+  if (gb.profiler != NULL)
+  {
+    FILE *f;
+
+    profiler_print_hotspots(&profiler, stdout, 20);
+
+    if (stacks_file_name != NULL)
+    {
+      if ((f = fopen(stacks_file_name, "w")) == NULL)
+      {
+        printf("%s: %s\n", stacks_file_name, strerror(errno));
+        ret = EXIT_FAILURE;
+      }
+      else
+      {
+        profiler_write_collapsed(&profiler, f);
+        fclose(f);
+      }
+    }
+  }
+
+  if (play_file_name != NULL)
+  {
+    if (!movie.ended)
+      printf("movie: stopped at frame %llu\n", (unsigned long long)frames);
+    else if (movie.desync)
+    {
+      printf("movie: desync at frame %llu\n", (unsigned long long)frames);
+      ret = EXIT_FAILURE;
+    }
+    else
+      printf("movie: in sync\n");
+  }
+
+  if (record_file_name != NULL)
+  {
+    if (!movie_finish(&movie, &gb) || !movie_write(&movie, record_file_name))
+    {
+      printf("%s: %s\n", record_file_name, strerror(errno));
+      ret = EXIT_FAILURE;
+    }
+    else
+      printf("movie: %llu frames in %lu bytes\n",
+             (unsigned long long)movie.frames, (unsigned long)movie.size);
+  }
+
+  if (record_history)
+  {
+    printf("rewind: %lu KB, %lu KB per minute\n",
+           (unsigned long)(history.used >> 10),
+           (unsigned long)(rewind_bytes_per_minute(&history) >> 10));
+  }
+
+  if (out_prefix != NULL)
+  {
+    if (write_ppm(out_prefix, (const u8(*)[LCD_WIDTH])shown->fb) ||
+        write_file(out_prefix, "wram", gb.wram, WRAM_SIZE) ||
+        write_file(out_prefix, "vram", gb.vram, VRAM_SIZE) ||
+        write_file(out_prefix, "hram", gb.hram, HRAM_SIZE) ||
+        write_file(out_prefix, "oam", gb.oam, OAM_SIZE) ||
+        (misc_data.cartridgeram != NULL &&
+         write_file(out_prefix, "sav", misc_data.cartridgeram,
+                    get_save_size(&gb))))
+      ret = EXIT_FAILURE;
+  }
+
+  if (wav != NULL)
+    close_wav(wav, wav_frames);
+
+out:
+  rewind_free(&history);
+  runahead_free(&run_ahead);
+  free(ahead_data.cartridgeram);
+  free(events);
+  movie_free(&movie);
+  profiler_free(&profiler);
+  perf_close(&perf);
+  free(misc_data.rom);
+  free(misc_data.cartridgeram);
+
+  return ret;
+}
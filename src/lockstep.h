@@ -0,0 +1,251 @@
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+
+#include "glitzboy.h"
+#include "movie.h"
+
+/*
+ * Differential validation. Two Gameboys start from the same state and are
+ * stepped in lockstep, one with cpu_step and one with the engine under
+ * test. After every step their registers, IF/IE, HALT/IME, LY, LCD mode,
+ * cycle count and a rolling hash of all writes through write_byte() are
+ * compared. At the end of each frame the machines are compared as a whole
+ * (movie_hash), which catches writes that bypass write_byte().
+ *
+ * A new CPU path is checked by adding it to lockstep_engines. The
+ * reference is always the first entry.
+ */
+
+#define LOCKSTEP_HISTORY 16
+
+struct lockstep_engine
+{
+	const char *name;
+	const char *description;
+	/* Called once on the test machine before the first step, or NULL. */
+	void (*setup)(Gameboy *);
+	void (*step)(Gameboy *);
+};
+
+static void lockstep_setup_nodraw(Gameboy *gb)
+{
+	gb->display.gpu_draw_line = NULL;
+	audio_set_synth(&gb->apu, 0);
+}
+
+static const struct lockstep_engine lockstep_engines[] = {
+	{"step", "cpu_step, drawing and synthesising audio", NULL, cpu_step},
+	{"nodraw", "cpu_step without drawing or audio (benchmark, run-ahead)",
+	 lockstep_setup_nodraw, cpu_step}};
+
+#define LOCKSTEP_ENGINES (sizeof(lockstep_engines) / sizeof(lockstep_engines[0]))
+
+struct lockstep_snapshot
+{
+	u16 af, bc, de, hl, sp, pc;
+	u8 if_, ie;
+	u8 halt, ime;
+	u8 ly, lcd_mode;
+	u64 cycles;
+	u64 writes;
+};
+
+typedef struct Lockstep
+{
+	Gameboy *ref;
+	Gameboy *test;
+	const struct lockstep_engine *engine;
+
+	u64 ref_writes;
+	u64 test_writes;
+
+	u64 steps;
+	u64 frames;
+
+	/* PCs of the last steps, for context. */
+	u16 history[LOCKSTEP_HISTORY];
+
+	/* Set on the first divergence, with both sides at that point. */
+	bool diverged;
+	bool at_frame;
+	struct lockstep_snapshot ref_at;
+	struct lockstep_snapshot test_at;
+} Lockstep;
+
+/* Engine by name, or NULL. */
+const struct lockstep_engine *lockstep_engine(const char *name)
+{
+	for (size_t i = 0; i < LOCKSTEP_ENGINES; i++)
+	{
+		if (strcmp(lockstep_engines[i].name, name) == 0)
+			return &lockstep_engines[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * ref and test must hold the same ROM and state. Hooks their writes and
+ * prepares test for engine.
+ */
+void lockstep_init(Lockstep *l, Gameboy *ref, Gameboy *test,
+				   const struct lockstep_engine *engine)
+{
+	memset(l, 0, sizeof(*l));
+	l->ref = ref;
+	l->test = test;
+	l->engine = engine;
+	l->ref_writes = l->test_writes = 0xcbf29ce484222325ULL;
+	ref->write_hash = &l->ref_writes;
+	test->write_hash = &l->test_writes;
+
+	if (engine->setup != NULL)
+		engine->setup(test);
+}
+
+void lockstep_free(Lockstep *l)
+{
+	l->ref->write_hash = NULL;
+	l->test->write_hash = NULL;
+}
+
+static void lockstep_snapshot(const Gameboy *gb, const u64 writes,
+							  struct lockstep_snapshot *s)
+{
+	s->af = gb->cpu_reg.AF;
+	s->bc = gb->cpu_reg.BC;
+	s->de = gb->cpu_reg.DE;
+	s->hl = gb->cpu_reg.HL;
+	s->sp = gb->cpu_reg.SP;
+	s->pc = gb->cpu_reg.PC;
+	s->if_ = gb->hw_reg.IF;
+	s->ie = gb->hw_reg.IE;
+	s->halt = gb->halt;
+	s->ime = gb->ime;
+	s->ly = gb->hw_reg.LY;
+	s->lcd_mode = gb->lcd_mode;
+	s->cycles = gb->timer.cycles;
+	s->writes = writes;
+}
+
+static bool lockstep_same(const struct lockstep_snapshot *a,
+						  const struct lockstep_snapshot *b)
+{
+	return a->af == b->af && a->bc == b->bc && a->de == b->de &&
+		   a->hl == b->hl && a->sp == b->sp && a->pc == b->pc &&
+		   a->if_ == b->if_ && a->ie == b->ie && a->halt == b->halt &&
+		   a->ime == b->ime && a->ly == b->ly && a->lcd_mode == b->lcd_mode &&
+		   a->cycles == b->cycles && a->writes == b->writes;
+}
+
+/* One step on both machines. Returns 0 on divergence. */
+bool lockstep_step(Lockstep *l)
+{
+	struct lockstep_snapshot a, b;
+
+	l->history[l->steps % LOCKSTEP_HISTORY] = l->ref->cpu_reg.PC;
+	l->steps++;
+
+	cpu_step(l->ref);
+	l->engine->step(l->test);
+
+	lockstep_snapshot(l->ref, l->ref_writes, &a);
+	lockstep_snapshot(l->test, l->test_writes, &b);
+
+	if (lockstep_same(&a, &b))
+		return 1;
+
+	l->diverged = 1;
+	l->ref_at = a;
+	l->test_at = b;
+	return 0;
+}
+
+/*
+ * Runs both machines to the end of a frame, as run_frame() does but
+ * without the callbacks. Returns 0 on divergence.
+ */
+bool lockstep_frame(Lockstep *l)
+{
+	const u64 frame_start = l->ref->timer.cycles;
+
+	l->ref->frame = 0;
+	l->test->frame = 0;
+	joypad_update(l->ref);
+	joypad_update(l->test);
+
+	while (!l->ref->frame && l->ref->timer.cycles - frame_start < SCREEN_REFRESH_CYCLES)
+	{
+		if (!lockstep_step(l))
+			return 0;
+	}
+
+	l->frames++;
+
+	if (l->ref->frame != l->test->frame || movie_hash(l->ref) != movie_hash(l->test))
+	{
+		l->diverged = 1;
+		l->at_frame = 1;
+		lockstep_snapshot(l->ref, l->ref_writes, &l->ref_at);
+		lockstep_snapshot(l->test, l->test_writes, &l->test_at);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Where and how the machines diverged, or that they did not. */
+void lockstep_report(const Lockstep *l, FILE *f)
+{
+	const struct lockstep_snapshot *a = &l->ref_at, *b = &l->test_at;
+	const uf32 n = l->steps < LOCKSTEP_HISTORY ? l->steps : LOCKSTEP_HISTORY;
+
+	if (!l->diverged)
+	{
+		fprintf(f, "lockstep: %s matches %s over %llu steps, %llu frames\n",
+				l->engine->name, lockstep_engines[0].name,
+				(unsigned long long)l->steps, (unsigned long long)l->frames);
+		return;
+	}
+
+	if (l->at_frame)
+		fprintf(f, "lockstep: %s diverged from %s in memory or display state "
+				   "by the end of frame %llu (step %llu)\n",
+				l->engine->name, lockstep_engines[0].name,
+				(unsigned long long)l->frames, (unsigned long long)l->steps);
+	else
+		fprintf(f, "lockstep: %s diverged from %s at step %llu, frame %llu\n",
+				l->engine->name, lockstep_engines[0].name,
+				(unsigned long long)l->steps, (unsigned long long)l->frames);
+
+	fputs("  last PCs:", f);
+
+	for (uf32 i = l->steps - n; i < l->steps; i++)
+		fprintf(f, " %04X", l->history[i % LOCKSTEP_HISTORY]);
+
+	fprintf(f, "\n  %-8s %16s %16s\n", "", lockstep_engines[0].name, l->engine->name);
+
+#define LOCKSTEP_FIELD(name, field, fmt)                                     \
+	fprintf(f, "%c %-8s %16ll" fmt " %16ll" fmt "\n",                        \
+			a->field != b->field ? '*' : ' ', name,                          \
+			(unsigned long long)a->field, (unsigned long long)b->field)
+
+	LOCKSTEP_FIELD("AF", af, "X");
+	LOCKSTEP_FIELD("BC", bc, "X");
+	LOCKSTEP_FIELD("DE", de, "X");
+	LOCKSTEP_FIELD("HL", hl, "X");
+	LOCKSTEP_FIELD("SP", sp, "X");
+	LOCKSTEP_FIELD("PC", pc, "X");
+	LOCKSTEP_FIELD("IF", if_, "X");
+	LOCKSTEP_FIELD("IE", ie, "X");
+	LOCKSTEP_FIELD("HALT", halt, "u");
+	LOCKSTEP_FIELD("IME", ime, "u");
+	LOCKSTEP_FIELD("LY", ly, "u");
+	LOCKSTEP_FIELD("mode", lcd_mode, "u");
+	LOCKSTEP_FIELD("cycles", cycles, "u");
+	LOCKSTEP_FIELD("writes", writes, "X");
+
+#undef LOCKSTEP_FIELD
+}
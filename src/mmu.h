@@ -1,10 +1,254 @@
 #pragma once
 
+#include <string.h>
+
 #include "gb.h"
 #include "apu.h"
+#include "timer.h"
+
+/*
+ * MBC-specific parts of read_byte() and write_byte(). Banked ROM reads
+ * need none: bank switches keep rom_bank_base up to date. Each takes the MBC
+ * as a constant; MBC_HANDLERS(n) instantiates them for MBC n, leaving only
+ * that MBC's code, and gb_init() picks the cartridge's set from
+ * mbc_handlers.
+ */
+/* Sets rom_bank_base from the bank registers, counting actual switches. */
+static inline void mbc_map_rom(Gameboy *gb, const u8 mbc)
+{
+	uf16 bank = gb->selected_rom_bank;
+
+	if (mbc == 1 && gb->cart_mode_select)
+		bank &= 0x1F;
+
+	if (gb->rom_bank_base != (u32)bank * ROM_BANK_SIZE)
+		STATS_INC(gb->stats, rom_bank_switches);
+
+	gb->rom_bank_base = (u32)bank * ROM_BANK_SIZE;
+}
+
+/* Selects the cartridge RAM (or MBC3 RTC) bank, counting actual switches. */
+static inline void mbc_map_ram(Gameboy *gb, const u8 bank)
+{
+	if (gb->cart_ram_bank != bank)
+		STATS_INC(gb->stats, ram_bank_switches);
+
+	gb->cart_ram_bank = bank;
+}
+
+static inline u8 mbc_read_ram(Gameboy *gb, const uf16 address, const u8 mbc)
+{
+	if (mbc == 3 && gb->cart_ram_bank >= 0x08)
+		return gb->cart_rtc[gb->cart_ram_bank - 0x08];
+	else if ((gb->cart_mode_select || mbc != 1) &&
+			 gb->cart_ram_bank < gb->num_ram_banks)
+	{
+		return gb->read_ram(gb, address - CART_RAM_ADDR +
+									(gb->cart_ram_bank * CRAM_BANK_SIZE));
+	}
+	else
+		return gb->read_ram(gb, address - CART_RAM_ADDR);
+}
+
+static inline void mbc_write_ram(Gameboy *gb, const uf16 address, const u8 value,
+								 const u8 mbc)
+{
+	if (mbc == 3 && gb->cart_ram_bank >= 0x08)
+		gb->cart_rtc[gb->cart_ram_bank - 0x08] = value;
+	else if ((gb->cart_mode_select || mbc != 1) &&
+			 gb->cart_ram_bank < gb->num_ram_banks)
+	{
+		gb->write_ram(gb,
+					  address - CART_RAM_ADDR + (gb->cart_ram_bank * CRAM_BANK_SIZE), value);
+	}
+	else if (gb->num_ram_banks)
+		gb->write_ram(gb, address - CART_RAM_ADDR, value);
+}
+
+/* Writes to 0x0000-0x7FFF. */
+static inline void mbc_write(Gameboy *gb, const uf16 address, const u8 value,
+							 const u8 mbc)
+{
+	switch (address >> 12)
+	{
+	case 0x0:
+	case 0x1:
+		if (mbc == 2 && address & 0x10)
+			return;
+		else if (mbc > 0 && gb->cartridge_ram)
+			gb->enable_cart_ram = ((value & 0x0F) == 0x0A);
+
+		return;
+
+	case 0x2:
+		if (mbc == 5)
+		{
+			gb->selected_rom_bank = (gb->selected_rom_bank & 0x100) | value;
+			gb->selected_rom_bank =
+				gb->selected_rom_bank % gb->num_rom_banks;
+			mbc_map_rom(gb, mbc);
+			return;
+		}
+		// Fall through
+
+	case 0x3:
+		if (mbc == 1)
+		{
+
+			gb->selected_rom_bank = (value & 0x1F) | (gb->selected_rom_bank & 0x60);
+
+			if ((gb->selected_rom_bank & 0x1F) == 0x00)
+				gb->selected_rom_bank++;
+		}
+		else if (mbc == 2 && address & 0x10)
+		{
+			gb->selected_rom_bank = value & 0x0F;
+
+			if (!gb->selected_rom_bank)
+				gb->selected_rom_bank++;
+		}
+		else if (mbc == 3)
+		{
+			gb->selected_rom_bank = value & 0x7F;
+
+			if (!gb->selected_rom_bank)
+				gb->selected_rom_bank++;
+		}
+		else if (mbc == 5)
+			gb->selected_rom_bank = (value & 0x01) << 8 | (gb->selected_rom_bank & 0xFF);
+
+		gb->selected_rom_bank = gb->selected_rom_bank % gb->num_rom_banks;
+		mbc_map_rom(gb, mbc);
+		return;
+
+	case 0x4:
+	case 0x5:
+		if (mbc == 1)
+		{
+			mbc_map_ram(gb, value & 3);
+			gb->selected_rom_bank = ((value & 3) << 5) | (gb->selected_rom_bank & 0x1F);
+			gb->selected_rom_bank = gb->selected_rom_bank % gb->num_rom_banks;
+			mbc_map_rom(gb, mbc);
+		}
+		else if (mbc == 3)
+			mbc_map_ram(gb, value);
+		else if (mbc == 5)
+			mbc_map_ram(gb, value & 0x0F);
+
+		return;
+
+	default:
+		gb->cart_mode_select = (value & 1);
+
+		if (mbc == 1)
+			mbc_map_rom(gb, mbc);
+
+		return;
+	}
+}
+
+#define MBC_HANDLERS(n)                                                        \
+	static u8 mbc##n##_read_ram(Gameboy *gb, const uf16 address)              \
+	{                                                                          \
+		return mbc_read_ram(gb, address, n);                                   \
+	}                                                                          \
+	static void mbc##n##_write_ram(Gameboy *gb, const uf16 address,           \
+								   const u8 value)                             \
+	{                                                                          \
+		mbc_write_ram(gb, address, value, n);                                  \
+	}                                                                          \
+	static void mbc##n##_write(Gameboy *gb, const uf16 address, const u8 value) \
+	{                                                                          \
+		mbc_write(gb, address, value, n);                                      \
+	}
+
+MBC_HANDLERS(0)
+MBC_HANDLERS(1)
+MBC_HANDLERS(2)
+MBC_HANDLERS(3)
+MBC_HANDLERS(5)
+
+#undef MBC_HANDLERS
+
+struct mbc_handlers
+{
+	u8 (*read_ram)(Gameboy *, const uf16 address);
+	void (*write_ram)(Gameboy *, const uf16 address, const u8 value);
+	void (*write)(Gameboy *, const uf16 address, const u8 value);
+};
+
+#define MBC_ENTRY(n) \
+	[n] = {mbc##n##_read_ram, mbc##n##_write_ram, mbc##n##_write}
+
+/* By gb->mbc; MBC4 does not exist. */
+static const struct mbc_handlers mbc_handlers[] = {
+	MBC_ENTRY(0), MBC_ENTRY(1), MBC_ENTRY(2), MBC_ENTRY(3), MBC_ENTRY(5)};
+
+#undef MBC_ENTRY
+
+void mbc_select(Gameboy *gb)
+{
+	const struct mbc_handlers *h = &mbc_handlers[gb->mbc];
+
+	gb->mbc_read_ram = h->read_ram;
+	gb->mbc_write_ram = h->write_ram;
+	gb->mbc_write = h->write;
+}
+
+/* The input lines 0xFF00 reads: 0 for a pressed button in a selected group. */
+static inline u8 joypad_read_lines(const Gameboy *gb)
+{
+	u8 lines = 0x0F;
+
+	if ((gb->hw_reg.P1 & 0x10) == 0)
+		lines &= gb->direct.joypad >> 4;
+
+	if ((gb->hw_reg.P1 & 0x20) == 0)
+		lines &= gb->direct.joypad & 0x0F;
+
+	return lines;
+}
+
+/*
+ * Takes in a change to direct.joypad or to the group selection. A line
+ * going low requests the joypad interrupt.
+ */
+void joypad_update(Gameboy *gb)
+{
+	const u8 lines = joypad_read_lines(gb);
+
+	if (gb->joypad_lines & ~lines)
+		gb->hw_reg.IF |= CONTROL_INTR;
+
+	gb->joypad_lines = lines;
+}
+
+/*
+ * During OAM DMA, OAM is unreachable and the bus the DMA reads from is busy:
+ * VRAM has a bus of its own and everything else below OAM shares the
+ * external one. An access on the other bus goes through.
+ */
+static bool dma_conflict(const Gameboy *gb, const uf16 address)
+{
+	const bool vram = (address >> 13) == (VRAM_ADDR >> 13);
+	const bool src_vram = (gb->hw_reg.DMA >> 5) == (VRAM_ADDR >> 13);
+
+	return address >= OAM_ADDR || vram == src_vram;
+}
 
 u8 read_byte(Gameboy *gb, const uf16 address)
 {
+	STATS_INC(gb->stats, reads[stats_region(address)]);
+
+	/* A read on the busy bus sees the byte being transferred. */
+	if (gb->timer.dma_count && address < IO_ADDR && dma_conflict(gb, address))
+	{
+		if (address >= OAM_ADDR)
+			return 0xFF;
+
+		return gb->oam[MIN((DMA_CYCLES - gb->timer.dma_count) / 4, OAM_SIZE - 1)];
+	}
+
 	switch (address >> 12)
 	{
 	case 0x0:
@@ -12,17 +256,19 @@ u8 read_byte(Gameboy *gb, const uf16 address)
 	case 0x1:
 	case 0x2:
 	case 0x3:
+		if (gb->direct.rom != NULL)
+			return gb->direct.rom[address];
+
 		return gb->read_rom(gb, address);
 
 	case 0x4:
 	case 0x5:
 	case 0x6:
 	case 0x7:
-		if (gb->mbc == 1 && gb->cart_mode_select)
-			return gb->read_rom(gb,
-								address + ((gb->selected_rom_bank & 0x1F) - 1) * ROM_BANK_SIZE);
-		else
-			return gb->read_rom(gb, address + (gb->selected_rom_bank - 1) * ROM_BANK_SIZE);
+		if (gb->direct.rom != NULL)
+			return gb->direct.rom[gb->rom_bank_base + (address - ROM_N_ADDR)];
+
+		return gb->read_rom(gb, gb->rom_bank_base + (address - ROM_N_ADDR));
 
 	case 0x8:
 	case 0x9:
@@ -31,18 +277,7 @@ u8 read_byte(Gameboy *gb, const uf16 address)
 	case 0xA:
 	case 0xB:
 		if (gb->cartridge_ram && gb->enable_cart_ram)
-		{
-			if (gb->mbc == 3 && gb->cart_ram_bank >= 0x08)
-				return gb->cart_rtc[gb->cart_ram_bank - 0x08];
-			else if ((gb->cart_mode_select || gb->mbc != 1) &&
-					 gb->cart_ram_bank < gb->num_ram_banks)
-			{
-				return gb->read_ram(gb, address - CART_RAM_ADDR +
-											(gb->cart_ram_bank * CRAM_BANK_SIZE));
-			}
-			else
-				return gb->read_ram(gb, address - CART_RAM_ADDR);
-		}
+			return gb->mbc_read_ram(gb, address);
 
 		return 0;
 
@@ -70,14 +305,22 @@ u8 read_byte(Gameboy *gb, const uf16 address)
 
 		if ((address >= 0xFF10) && (address <= 0xFF3F))
 		{
-			return audio_read(address);
+			return audio_read(&gb->apu, address);
 		}
 
 		switch (address & 0xFF)
 		{
 
 		case 0x00:
-			return 0xC0 | gb->hw_reg.P1;
+			if (gb->joypad_poll != NULL &&
+				gb->timer.cycles - gb->joypad_polled >= JOYPAD_POLL_CYCLES)
+			{
+				gb->joypad_polled = gb->timer.cycles;
+				gb->joypad_poll(gb);
+			}
+
+			joypad_update(gb);
+			return 0xC0 | (gb->hw_reg.P1 & 0x30) | gb->joypad_lines;
 
 		case 0x01:
 			return gb->hw_reg.SB;
@@ -86,9 +329,10 @@ u8 read_byte(Gameboy *gb, const uf16 address)
 			return gb->hw_reg.SC;
 
 		case 0x04:
-			return gb->hw_reg.DIV;
+			return timer_div(gb);
 
 		case 0x05:
+			timer_sync(gb);
 			return gb->hw_reg.TIMA;
 
 		case 0x06:
@@ -149,77 +393,83 @@ u8 read_byte(Gameboy *gb, const uf16 address)
 	return 0xFF;
 }
 
-void write_byte(Gameboy *gb, const uf16 address, const u8 value)
+/*
+ * Copies 160 bytes from page * 0x100 to OAM and starts the DMA_CYCLES
+ * during which the CPU is locked out of the source's bus and OAM. The copy
+ * is done up front; nothing else can touch the source or OAM until it
+ * would end.
+ */
+static void oam_dma(Gameboy *gb, const u8 page)
 {
-	switch (address >> 12)
+	/* 0xE000-0xFFFF mirror WRAM on the DMA bus. */
+	const uf16 src = (page >= 0xE0 ? page - 0x20 : page) << 8;
+	const u8 *p = NULL;
+
+	switch (src >> 12)
 	{
 	case 0x0:
 	case 0x1:
-		if (gb->mbc == 2 && address & 0x10)
-			return;
-		else if (gb->mbc > 0 && gb->cartridge_ram)
-			gb->enable_cart_ram = ((value & 0x0F) == 0x0A);
+	case 0x2:
+	case 0x3:
+		if (gb->direct.rom != NULL)
+			p = gb->direct.rom + src;
 
-		return;
+		break;
 
-	case 0x2:
-		if (gb->mbc == 5)
-		{
-			gb->selected_rom_bank = (gb->selected_rom_bank & 0x100) | value;
-			gb->selected_rom_bank =
-				gb->selected_rom_bank % gb->num_rom_banks;
-			return;
-		}
-		// Fall through
+	case 0x4:
+	case 0x5:
+	case 0x6:
+	case 0x7:
+		if (gb->direct.rom != NULL)
+			p = gb->direct.rom + gb->rom_bank_base + (src - ROM_N_ADDR);
 
-	case 0x3:
-		if (gb->mbc == 1)
-		{
+		break;
 
-			gb->selected_rom_bank = (value & 0x1F) | (gb->selected_rom_bank & 0x60);
+	case 0x8:
+	case 0x9:
+		p = gb->vram + (src - VRAM_ADDR);
+		break;
 
-			if ((gb->selected_rom_bank & 0x1F) == 0x00)
-				gb->selected_rom_bank++;
-		}
-		else if (gb->mbc == 2 && address & 0x10)
-		{
-			gb->selected_rom_bank = value & 0x0F;
+	case 0xC:
+	case 0xD:
+		p = gb->wram + (src - WRAM_0_ADDR);
+		break;
+	}
 
-			if (!gb->selected_rom_bank)
-				gb->selected_rom_bank++;
-		}
-		else if (gb->mbc == 3)
-		{
-			gb->selected_rom_bank = value & 0x7F;
+	gb->timer.dma_count = 0;
 
-			if (!gb->selected_rom_bank)
-				gb->selected_rom_bank++;
-		}
-		else if (gb->mbc == 5)
-			gb->selected_rom_bank = (value & 0x01) << 8 | (gb->selected_rom_bank & 0xFF);
+	if (p != NULL)
+		memcpy(gb->oam, p, OAM_SIZE);
+	else
+	{
+		for (uf16 i = 0; i < OAM_SIZE; i++)
+			gb->oam[i] = read_byte(gb, src + i);
+	}
 
-		gb->selected_rom_bank = gb->selected_rom_bank % gb->num_rom_banks;
-		return;
-		// Fall through
+	gb->timer.dma_count = DMA_CYCLES;
+}
 
-	case 0x4:
-	case 0x5:
-		if (gb->mbc == 1)
-		{
-			gb->cart_ram_bank = (value & 3);
-			gb->selected_rom_bank = ((value & 3) << 5) | (gb->selected_rom_bank & 0x1F);
-			gb->selected_rom_bank = gb->selected_rom_bank % gb->num_rom_banks;
-		}
-		else if (gb->mbc == 3)
-			gb->cart_ram_bank = value;
-		else if (gb->mbc == 5)
-			gb->cart_ram_bank = (value & 0x0F);
+void write_byte(Gameboy *gb, const uf16 address, const u8 value)
+{
+	STATS_INC(gb->stats, writes[stats_region(address)]);
 
+	if (gb->timer.dma_count && address < IO_ADDR && dma_conflict(gb, address))
 		return;
 
+	if (gb->write_hash != NULL)
+		*gb->write_hash = (*gb->write_hash ^ (address << 8 | value)) * 0x100000001b3ULL;
+
+	switch (address >> 12)
+	{
+	case 0x0:
+	case 0x1:
+	case 0x2:
+	case 0x3:
+	case 0x4:
+	case 0x5:
 	case 0x6:
 	case 0x7:
-		gb->cart_mode_select = (value & 1);
+		gb->mbc_write(gb, address, value);
 		return;
 
 	case 0x8:
@@ -230,18 +480,7 @@ void write_byte(Gameboy *gb, const uf16 address, const u8 value)
 	case 0xA:
 	case 0xB:
 		if (gb->cartridge_ram && gb->enable_cart_ram)
-		{
-			if (gb->mbc == 3 && gb->cart_ram_bank >= 0x08)
-				gb->cart_rtc[gb->cart_ram_bank - 0x08] = value;
-			else if (gb->cart_mode_select &&
-					 gb->cart_ram_bank < gb->num_ram_banks)
-			{
-				gb->write_ram(gb,
-							  address - CART_RAM_ADDR + (gb->cart_ram_bank * CRAM_BANK_SIZE), value);
-			}
-			else if (gb->num_ram_banks)
-				gb->write_ram(gb, address - CART_RAM_ADDR, value);
-		}
+			gb->mbc_write_ram(gb, address, value);
 
 		return;
 
@@ -281,7 +520,7 @@ void write_byte(Gameboy *gb, const uf16 address, const u8 value)
 
 		if ((address >= 0xFF10) && (address <= 0xFF3F))
 		{
-			audio_write(address, value);
+			audio_write(&gb->apu, address, value);
 			return;
 		}
 
@@ -289,15 +528,8 @@ void write_byte(Gameboy *gb, const uf16 address, const u8 value)
 		{
 
 		case 0x00:
-
-			gb->hw_reg.P1 = value;
-
-			if ((gb->hw_reg.P1 & 0b010000) == 0)
-				gb->hw_reg.P1 |= (gb->direct.joypad >> 4);
-
-			else
-				gb->hw_reg.P1 |= (gb->direct.joypad & 0x0F);
-
+			gb->hw_reg.P1 = value & 0x30;
+			joypad_update(gb);
 			return;
 
 		case 0x01:
@@ -309,19 +541,22 @@ void write_byte(Gameboy *gb, const uf16 address, const u8 value)
 			return;
 
 		case 0x04:
-			gb->hw_reg.DIV = 0x00;
+			timer_write_div(gb);
 			return;
 
 		case 0x05:
+			timer_sync(gb);
 			gb->hw_reg.TIMA = value;
+			timer_schedule(gb);
 			return;
 
 		case 0x06:
+			timer_sync(gb);
 			gb->hw_reg.TMA = value;
 			return;
 
 		case 0x07:
-			gb->hw_reg.TAC = value;
+			timer_write_tac(gb, value);
 			return;
 
 		case 0x0F:
@@ -364,11 +599,8 @@ void write_byte(Gameboy *gb, const uf16 address, const u8 value)
 			return;
 
 		case 0x46:
-			gb->hw_reg.DMA = (value % 0xF1);
-
-			for (u8 i = 0; i < OAM_SIZE; i++)
-				gb->oam[i] = read_byte(gb, (gb->hw_reg.DMA << 8) + i);
-
+			gb->hw_reg.DMA = value;
+			oam_dma(gb, value);
 			return;
 
 		case 0x47:
@@ -417,8 +649,12 @@ uf32 get_save_size(Gameboy *gb)
 	const uf16 ram_size_location = 0x0149;
 	const uf32 ram_sizes[] =
 		{
-			0x00, 0x800, 0x2000, 0x8000, 0x20000};
+			0x00, 0x800, 0x2000, 0x8000, 0x20000, 0x10000};
 	u8 ram_size = gb->read_rom(gb, ram_size_location);
+
+	if (ram_size >= sizeof(ram_sizes) / sizeof(ram_sizes[0]))
+		return 0;
+
 	return ram_sizes[ram_size];
 }
 
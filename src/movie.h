@@ -0,0 +1,491 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "glitzboy.h"
+
+/*
+ * Input movies. A movie starts from power-on or from an embedded save
+ * state and then holds the joypad for every frame, plus resets and power
+ * cycles between frames. Emulation is deterministic given those, so a
+ * replay repeats the recorded run exactly. The end marker holds a hash of
+ * the machine, which lets a replay check that it did.
+ *
+ * The joypad is stored in runs, as the XOR with the previous run's joypad
+ * and a LEB128 frame count. Held buttons cost nothing per frame.
+ *
+ * After the header, a state start has a u32 size and the state, then:
+ *   MOVIE_FRAMES delta count  count frames with joypad ^= delta
+ *   MOVIE_RESET               gb_reset() before the next frame
+ *   MOVIE_POWER               movie_power_on() before the next frame
+ *   MOVIE_END frames hash     LEB128 frame total, u64 machine hash
+ */
+
+#define MOVIE_MAGIC "GBMV"
+#define MOVIE_VERSION 10
+
+enum MovieToken
+{
+	MOVIE_END,
+	MOVIE_FRAMES,
+	MOVIE_RESET,
+	MOVIE_POWER
+};
+
+enum MovieError
+{
+	MOVIE_NO_ERROR,
+	MOVIE_INVALID_HEADER,
+	MOVIE_INVALID_VERSION,
+	MOVIE_WRONG_ROM,
+	MOVIE_INVALID_STATE
+};
+
+struct movie_header
+{
+	char magic[4];
+	u32 version;
+	u8 rom_checksum[3];
+	u8 power_on;
+};
+
+typedef struct Movie
+{
+	u8 *data;
+	size_t size;
+	size_t capacity;
+	size_t pos;
+
+	/* Frames recorded or replayed so far. */
+	u64 frames;
+
+	/* Joypad of the current run and the frames in it (recording) or left
+	 * in it (replay), and the joypad of the run before. */
+	u8 joypad;
+	u64 run;
+	u8 prev;
+
+	/* Set when a replay reaches the end; desync if the machine does not
+	 * match the recording there. */
+	bool ended;
+	bool desync;
+} Movie;
+
+void movie_free(Movie *m)
+{
+	free(m->data);
+	memset(m, 0, sizeof(*m));
+}
+
+static bool movie_reserve(Movie *m, const size_t n)
+{
+	if (m->size + n > m->capacity)
+	{
+		const size_t capacity = MAX(m->capacity * 2, m->size + n + 256);
+		u8 *const data = realloc(m->data, capacity);
+
+		if (data == NULL)
+			return 0;
+
+		m->data = data;
+		m->capacity = capacity;
+	}
+
+	return 1;
+}
+
+static bool movie_put(Movie *m, const void *p, const size_t n)
+{
+	if (!movie_reserve(m, n))
+		return 0;
+
+	memcpy(m->data + m->size, p, n);
+	m->size += n;
+	return 1;
+}
+
+static bool movie_put_byte(Movie *m, const u8 b)
+{
+	return movie_put(m, &b, 1);
+}
+
+static bool movie_put_varint(Movie *m, u64 v)
+{
+	while (v >= 0x80)
+	{
+		if (!movie_put_byte(m, (v & 0x7F) | 0x80))
+			return 0;
+
+		v >>= 7;
+	}
+
+	return movie_put_byte(m, v);
+}
+
+static bool movie_get(Movie *m, void *p, const size_t n)
+{
+	if (m->size - m->pos < n)
+		return 0;
+
+	memcpy(p, m->data + m->pos, n);
+	m->pos += n;
+	return 1;
+}
+
+static bool movie_get_varint(Movie *m, u64 *v)
+{
+	*v = 0;
+
+	for (uf8 shift = 0; shift < 64; shift += 7)
+	{
+		u8 b;
+
+		if (!movie_get(m, &b, 1))
+			return 0;
+
+		*v |= (u64)(b & 0x7F) << shift;
+
+		if (!(b & 0x80))
+			return 1;
+	}
+
+	return 0;
+}
+
+static u64 movie_hash_bytes(u64 hash, const void *p, const size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		hash = (hash ^ ((const u8 *)p)[i]) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+/* Values are hashed as eight little-endian bytes, whatever their type. */
+static u64 movie_hash_value(u64 hash, const u64 v)
+{
+	for (uf8 i = 0; i < 8; i++)
+		hash = (hash ^ (u8)(v >> (8 * i))) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+/*
+ * FNV-1a of the CPU, timers, display state, memories, the APU state the
+ * game can see and the cartridge RAM. Fields are hashed one by one so that
+ * struct padding never counts. The RTC is left out: only the SDL frontend
+ * advances it, and it keeps it frozen during movies.
+ */
+u64 movie_hash(Gameboy *gb)
+{
+	const u64 values[] = {
+		gb->halt, gb->ime, gb->frame, gb->lcd_mode,
+		gb->mbc, gb->cartridge_ram, gb->num_rom_banks, gb->num_ram_banks,
+		gb->selected_rom_bank, gb->cart_ram_bank, gb->enable_cart_ram,
+		gb->cart_mode_select, gb->rom_bank_base, gb->joypad_lines,
+		gb->cpu_reg.AF, gb->cpu_reg.BC, gb->cpu_reg.DE, gb->cpu_reg.HL,
+		gb->cpu_reg.SP, gb->cpu_reg.PC,
+		gb->timer.lcd_count, gb->timer.serial_count, gb->timer.apu_count,
+		gb->timer.dma_count, gb->timer.cycles, gb->timer.div_base,
+		gb->timer.tima_sync, gb->timer.tima_event,
+		gb->display.window_clear, gb->display.WY,
+		gb->apu.length[0], gb->apu.length[1], gb->apu.length[2],
+		gb->apu.length[3]};
+	const uf32 cart_ram_size = get_save_size(gb);
+	u64 hash = 0xcbf29ce484222325ULL;
+
+	for (uf8 i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+		hash = movie_hash_value(hash, values[i]);
+
+	/* All u8, so without padding. */
+	hash = movie_hash_bytes(hash, &gb->hw_reg, sizeof(gb->hw_reg));
+	hash = movie_hash_bytes(hash, gb->display.bg_palette, sizeof(gb->display.bg_palette));
+	hash = movie_hash_bytes(hash, gb->display.sp_palette, sizeof(gb->display.sp_palette));
+	hash = movie_hash_bytes(hash, gb->wram, WRAM_SIZE);
+	hash = movie_hash_bytes(hash, gb->vram, VRAM_SIZE);
+	hash = movie_hash_bytes(hash, gb->hram, HRAM_SIZE);
+	hash = movie_hash_bytes(hash, gb->oam, OAM_SIZE);
+	hash = movie_hash_bytes(hash, gb->apu.memory, sizeof(gb->apu.memory));
+
+	for (uf32 i = 0; i < cart_ram_size; i++)
+	{
+		const u8 b = gb->direct.cart_ram != NULL ? gb->direct.cart_ram[i]
+												 : gb->read_ram(gb, i);
+
+		hash = movie_hash_bytes(hash, &b, 1);
+	}
+
+	return hash;
+}
+
+/*
+ * Power cycle: everything gb_reset() leaves alone is cleared as well, and
+ * cartridge RAM is filled with 0xFF as if the battery were flat.
+ */
+void movie_power_on(Gameboy *gb)
+{
+	const uf32 cart_ram_size = get_save_size(gb);
+
+	memset(gb->cart_rtc, 0, sizeof(gb->cart_rtc));
+	memset(&gb->cpu_reg, 0, sizeof(gb->cpu_reg));
+	memset(&gb->hw_reg, 0, sizeof(gb->hw_reg));
+	memset(&gb->timer, 0, sizeof(gb->timer));
+	memset(gb->wram, 0, WRAM_SIZE);
+	memset(gb->vram, 0, VRAM_SIZE);
+	memset(gb->hram, 0, HRAM_SIZE);
+	memset(gb->oam, 0, OAM_SIZE);
+
+	gb->frame = 0;
+	gb->display.window_clear = 0;
+	gb->display.WY = 0;
+	gb->display.frame_skip_count = 0;
+	gb->display.interlace_count = 0;
+
+	if (gb->direct.cart_ram != NULL)
+		memset(gb->direct.cart_ram, 0xFF, cart_ram_size);
+	else
+	{
+		for (uf32 i = 0; i < cart_ram_size; i++)
+			gb->write_ram(gb, i, 0xFF);
+	}
+
+	gb_reset(gb);
+}
+
+/*
+ * Starts recording from power-on, which is done to gb here, or from the
+ * current state of gb. Returns 0 if out of memory.
+ */
+bool movie_record(Movie *m, Gameboy *gb, const bool power_on)
+{
+	struct movie_header h;
+
+	memset(m, 0, sizeof(*m));
+	m->prev = 0xFF;
+
+	memcpy(h.magic, MOVIE_MAGIC, sizeof(h.magic));
+	h.version = MOVIE_VERSION;
+	h.power_on = power_on;
+
+	for (u8 i = 0; i < 3; i++)
+		h.rom_checksum[i] = gb->read_rom(gb, 0x014D + i);
+
+	if (!movie_put(m, &h, sizeof(h)))
+		return 0;
+
+	if (power_on)
+	{
+		movie_power_on(gb);
+		return 1;
+	}
+
+	{
+		const u32 state_size = gb_state_size(gb);
+
+		if (!movie_put(m, &state_size, sizeof(state_size)) ||
+			!movie_reserve(m, state_size))
+			return 0;
+
+		m->size += gb_state_save(gb, m->data + m->size, state_size);
+	}
+
+	return 1;
+}
+
+static bool movie_flush(Movie *m)
+{
+	if (m->run == 0)
+		return 1;
+
+	if (!movie_put_byte(m, MOVIE_FRAMES) || !movie_put_byte(m, m->joypad ^ m->prev) ||
+		!movie_put_varint(m, m->run))
+		return 0;
+
+	m->prev = m->joypad;
+	m->run = 0;
+	return 1;
+}
+
+/* Call before running each frame with the joypad it will see. */
+bool movie_record_frame(Movie *m, const u8 joypad)
+{
+	if (m->run && joypad != m->joypad && !movie_flush(m))
+		return 0;
+
+	m->joypad = joypad;
+	m->run++;
+	m->frames++;
+	return 1;
+}
+
+/* Resets or power cycles gb and records that. */
+bool movie_record_reset(Movie *m, Gameboy *gb, const bool power)
+{
+	if (!movie_flush(m) || !movie_put_byte(m, power ? MOVIE_POWER : MOVIE_RESET))
+		return 0;
+
+	if (power)
+		movie_power_on(gb);
+	else
+		gb_reset(gb);
+
+	return 1;
+}
+
+/* Ends the recording after the last frame has run. */
+bool movie_finish(Movie *m, Gameboy *gb)
+{
+	const u64 hash = movie_hash(gb);
+	u8 le[8];
+
+	for (uf8 i = 0; i < 8; i++)
+		le[i] = hash >> (8 * i);
+
+	return movie_flush(m) && movie_put_byte(m, MOVIE_END) &&
+		   movie_put_varint(m, m->frames) && movie_put(m, le, sizeof(le));
+}
+
+/* Loads gb with the start of the movie and rewinds it for replay. */
+enum MovieError movie_play(Movie *m, Gameboy *gb)
+{
+	struct movie_header h;
+
+	m->pos = 0;
+	m->frames = 0;
+	m->joypad = 0xFF;
+	m->run = 0;
+	m->ended = 0;
+	m->desync = 0;
+
+	if (!movie_get(m, &h, sizeof(h)) ||
+		memcmp(h.magic, MOVIE_MAGIC, sizeof(h.magic)) != 0)
+		return MOVIE_INVALID_HEADER;
+
+	if (h.version != MOVIE_VERSION)
+		return MOVIE_INVALID_VERSION;
+
+	for (u8 i = 0; i < 3; i++)
+	{
+		if (h.rom_checksum[i] != gb->read_rom(gb, 0x014D + i))
+			return MOVIE_WRONG_ROM;
+	}
+
+	if (h.power_on)
+		movie_power_on(gb);
+	else
+	{
+		u32 state_size;
+
+		if (!movie_get(m, &state_size, sizeof(state_size)) ||
+			m->size - m->pos < state_size ||
+			gb_state_load(gb, m->data + m->pos, state_size) != STATE_NO_ERROR)
+			return MOVIE_INVALID_STATE;
+
+		m->pos += state_size;
+	}
+
+	return MOVIE_NO_ERROR;
+}
+
+/*
+ * Call before running each frame: applies any reset and sets the joypad.
+ * Returns 0 once the movie has ended, with desync set if the machine does
+ * not match the recording or the movie is damaged.
+ */
+bool movie_play_frame(Movie *m, Gameboy *gb)
+{
+	if (m->ended)
+		return 0;
+
+	while (m->run == 0)
+	{
+		u8 token = MOVIE_END;
+		u8 delta;
+		u64 frames;
+		u8 le[8];
+		u64 hash = 0;
+
+		if (!movie_get(m, &token, 1))
+			token = 0xFF;
+
+		switch (token)
+		{
+		case MOVIE_FRAMES:
+			if (!movie_get(m, &delta, 1) || !movie_get_varint(m, &m->run) ||
+				m->run == 0)
+				goto damaged;
+
+			m->joypad ^= delta;
+			break;
+
+		case MOVIE_RESET:
+			gb_reset(gb);
+			break;
+
+		case MOVIE_POWER:
+			movie_power_on(gb);
+			break;
+
+		case MOVIE_END:
+			if (!movie_get_varint(m, &frames) || !movie_get(m, le, sizeof(le)))
+				goto damaged;
+
+			for (uf8 i = 0; i < 8; i++)
+				hash |= (u64)le[i] << (8 * i);
+
+			m->ended = 1;
+			m->desync = frames != m->frames || hash != movie_hash(gb);
+			return 0;
+
+		default:
+			goto damaged;
+		}
+	}
+
+	gb->direct.joypad = m->joypad;
+	m->run--;
+	m->frames++;
+	return 1;
+
+damaged:
+	m->ended = 1;
+	m->desync = 1;
+	return 0;
+}
+
+bool movie_write(const Movie *m, const char *file_name)
+{
+	FILE *f = fopen(file_name, "wb");
+	bool ok;
+
+	if (f == NULL)
+		return 0;
+
+	ok = fwrite(m->data, 1, m->size, f) == m->size;
+	return fclose(f) == 0 && ok;
+}
+
+bool movie_read(Movie *m, const char *file_name)
+{
+	FILE *f = fopen(file_name, "rb");
+	long size;
+
+	memset(m, 0, sizeof(*m));
+
+	if (f == NULL)
+		return 0;
+
+	if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 ||
+		fseek(f, 0, SEEK_SET) != 0 || (m->data = malloc(size + 1)) == NULL ||
+		fread(m->data, 1, size, f) != (size_t)size)
+	{
+		fclose(f);
+		movie_free(m);
+		return 0;
+	}
+
+	fclose(f);
+	m->size = m->capacity = size;
+	return 1;
+}
@@ -0,0 +1,278 @@
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+
+#include "defs.h"
+
+/*
+ * Host hardware counters from Linux perf events: cycles, instructions,
+ * branch misses and L1d read misses of the calling thread in user space.
+ * They are opened as one group, so a single read() returns all of them
+ * for the same interval. Counters the CPU or kernel does not offer are
+ * left out; if none can be opened (another OS, a VM without a PMU,
+ * perf_event_paranoid > 2), perf_open() fails and callers go on without.
+ *
+ * syscall() needs _DEFAULT_SOURCE or _GNU_SOURCE. Without either,
+ * perf_open() always fails.
+ */
+
+#if defined(__linux__) && defined(_DEFAULT_SOURCE)
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define PERF_EVENTS 1
+#endif
+
+enum PerfCounter
+{
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_BRANCH_MISSES,
+	PERF_L1D_MISSES,
+
+	PERF_COUNTERS
+};
+
+struct perf_sample
+{
+	u64 v[PERF_COUNTERS];
+	/* ns the group was enabled and actually counting; they differ when
+	 * the kernel multiplexes it with other events. */
+	u64 enabled;
+	u64 running;
+};
+
+typedef struct Perf
+{
+	int fd[PERF_COUNTERS];
+	int leader;
+
+	/* Bit n is set if counter n is open; slot is its place in a read. */
+	u8 mask;
+	uf8 slot[PERF_COUNTERS];
+	uf8 count;
+
+	/* errno of the last counter that failed to open, or -1 if perf
+	 * events are not built in. */
+	int error;
+} Perf;
+
+void perf_close(Perf *p)
+{
+#ifdef PERF_EVENTS
+	for (uf8 i = 0; i < PERF_COUNTERS; i++)
+	{
+		if (p->mask & 1 << i)
+			close(p->fd[i]);
+	}
+#endif
+
+	for (uf8 i = 0; i < PERF_COUNTERS; i++)
+		p->fd[i] = -1;
+
+	p->leader = -1;
+	p->mask = 0;
+	p->count = 0;
+}
+
+/* Returns 0 if no counter could be opened. */
+bool perf_open(Perf *p)
+{
+	memset(p, 0, sizeof(*p));
+	perf_close(p);
+
+#ifdef PERF_EVENTS
+	{
+		static const struct
+		{
+			u32 type;
+			u64 config;
+		} events[PERF_COUNTERS] = {
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+			{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+									 PERF_COUNT_HW_CACHE_OP_READ << 8 |
+									 PERF_COUNT_HW_CACHE_RESULT_MISS << 16}};
+
+		for (uf8 i = 0; i < PERF_COUNTERS; i++)
+		{
+			struct perf_event_attr attr;
+
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = events[i].type;
+			attr.config = events[i].config;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+							   PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+			p->fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, p->leader, 0);
+
+			if (p->fd[i] < 0)
+			{
+				p->error = errno;
+				continue;
+			}
+
+			if (p->leader < 0)
+				p->leader = p->fd[i];
+
+			p->mask |= 1 << i;
+			p->slot[i] = p->count++;
+		}
+	}
+#else
+	p->error = -1;
+#endif
+
+	return p->count != 0;
+}
+
+const char *perf_strerror(const Perf *p)
+{
+	return p->error < 0 ? "perf events not built in" : strerror(p->error);
+}
+
+/*
+ * Current raw counts. perf_accumulate() scales the difference of two for
+ * multiplexing. Returns 0, with s zeroed, if they cannot be read.
+ */
+bool perf_read(const Perf *p, struct perf_sample *s)
+{
+	memset(s, 0, sizeof(*s));
+
+#ifdef PERF_EVENTS
+	{
+		/* nr, time enabled, time running, then the values. */
+		u64 buf[3 + PERF_COUNTERS];
+		const ssize_t size = (3 + p->count) * sizeof(u64);
+
+		if (!p->count || read(p->leader, buf, sizeof(buf)) < size)
+			return 0;
+
+		for (uf8 i = 0; i < PERF_COUNTERS; i++)
+		{
+			if (p->mask & 1 << i)
+				s->v[i] = buf[3 + p->slot[i]];
+		}
+
+		s->enabled = buf[1];
+		s->running = buf[2];
+		return 1;
+	}
+#else
+	(void)p;
+	return 0;
+#endif
+}
+
+/*
+ * to += end - start, scaled up by the share of the interval the group was
+ * not counting. A failed read (all zero) adds nothing.
+ */
+void perf_accumulate(struct perf_sample *to, const struct perf_sample *end,
+					 const struct perf_sample *start)
+{
+	const u64 enabled = end->enabled > start->enabled ? end->enabled - start->enabled : 0;
+	const u64 running = end->running > start->running ? end->running - start->running : 0;
+
+	for (uf8 i = 0; i < PERF_COUNTERS; i++)
+	{
+		u64 d = end->v[i] > start->v[i] ? end->v[i] - start->v[i] : 0;
+
+		if (running && running < enabled)
+			d = (double)d * enabled / running;
+
+		to->v[i] += d;
+	}
+
+	to->enabled += enabled;
+	to->running += running;
+}
+
+/* to = a - b, not below zero. */
+void perf_difference(struct perf_sample *to, const struct perf_sample *a,
+					 const struct perf_sample *b)
+{
+	for (uf8 i = 0; i < PERF_COUNTERS; i++)
+		to->v[i] = a->v[i] > b->v[i] ? a->v[i] - b->v[i] : 0;
+}
+
+/*
+ * One JSON object: per-frame counts, IPC and misses per thousand
+ * instructions. Counters not in mask are null.
+ */
+void perf_print_json(FILE *f, const u8 mask, const struct perf_sample *s,
+					 const u64 frames)
+{
+	static const char *const names[PERF_COUNTERS] = {
+		"cycles", "instructions", "branch_misses", "l1d_misses"};
+	const double n = frames ? (double)frames : 1.0;
+	const bool ipc = (mask & 1 << PERF_CYCLES) && (mask & 1 << PERF_INSTRUCTIONS);
+	const double instructions = s->v[PERF_INSTRUCTIONS] ? s->v[PERF_INSTRUCTIONS] : 1;
+
+	fputc('{', f);
+
+	for (uf8 i = 0; i < PERF_COUNTERS; i++)
+	{
+		if (mask & 1 << i)
+			fprintf(f, "\"%s\":%.1f,", names[i], s->v[i] / n);
+		else
+			fprintf(f, "\"%s\":null,", names[i]);
+	}
+
+	if (ipc && s->v[PERF_CYCLES])
+		fprintf(f, "\"ipc\":%.3f,", (double)s->v[PERF_INSTRUCTIONS] / s->v[PERF_CYCLES]);
+	else
+		fputs("\"ipc\":null,", f);
+
+	for (uf8 i = PERF_BRANCH_MISSES; i < PERF_COUNTERS; i++)
+	{
+		if ((mask & 1 << i) && (mask & 1 << PERF_INSTRUCTIONS))
+			fprintf(f, "\"%s_pki\":%.3f", names[i], 1000.0 * s->v[i] / instructions);
+		else
+			fprintf(f, "\"%s_pki\":null", names[i]);
+
+		fputc(i + 1 < PERF_COUNTERS ? ',' : '}', f);
+	}
+}
+
+/* One line with the same figures as perf_print_json(). */
+void perf_print(FILE *f, const char *name, const u8 mask,
+				const struct perf_sample *s, const u64 frames)
+{
+	static const char *const names[PERF_COUNTERS] = {
+		"", "", "branch misses", "L1d misses"};
+	const double n = frames ? (double)frames : 1.0;
+	const double instructions = s->v[PERF_INSTRUCTIONS] ? s->v[PERF_INSTRUCTIONS] : 1;
+
+	fprintf(f, "  %-8s", name);
+
+	if (mask & 1 << PERF_CYCLES)
+		fprintf(f, " %12.0f cycles", s->v[PERF_CYCLES] / n);
+
+	if (mask & 1 << PERF_INSTRUCTIONS)
+		fprintf(f, " %12.0f instructions", s->v[PERF_INSTRUCTIONS] / n);
+
+	if ((mask & 1 << PERF_CYCLES) && (mask & 1 << PERF_INSTRUCTIONS) &&
+		s->v[PERF_CYCLES])
+		fprintf(f, "  IPC %.2f", (double)s->v[PERF_INSTRUCTIONS] / s->v[PERF_CYCLES]);
+
+	for (uf8 i = PERF_BRANCH_MISSES; i < PERF_COUNTERS; i++)
+	{
+		if (!(mask & 1 << i))
+			continue;
+
+		fprintf(f, "  %s %.0f", names[i], s->v[i] / n);
+
+		if (mask & 1 << PERF_INSTRUCTIONS)
+			fprintf(f, " (%.2f/k)", 1000.0 * s->v[i] / instructions);
+	}
+
+	fputc('\n', f);
+}
@@ -0,0 +1,496 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "gb.h"
+
+/*
+ * Guest sampling profiler. Attached to gb->profiler, it takes a sample of
+ * the ROM bank and PC of the instruction being run every `period` emulated
+ * cycles. Samples are counted per (bank, PC) for a hotspot table and per
+ * call stack for flame graphs.
+ *
+ * The call stack is a shadow of the guest's: CALL, RST and interrupt entry
+ * push the target, RET and RETI pop. Each frame remembers the SP below its
+ * return address, so frames the guest has dropped by resetting or popping
+ * its stack are dropped too.
+ *
+ * Addresses print as BB:AAAA, or as the nearest label from an RGBDS .sym
+ * file.
+ */
+
+#define PROFILER_MAX_DEPTH 64
+
+/* Bank in the top 16 bits, address in the bottom. */
+typedef u32 profiler_loc;
+
+struct profiler_frame
+{
+	profiler_loc target;
+	u16 sp;
+};
+
+struct profiler_count
+{
+	profiler_loc loc;
+	u64 samples;
+};
+
+struct profiler_stack
+{
+	u64 hash;
+	size_t frames;
+	uf8 depth;
+	u64 samples;
+};
+
+struct profiler_symbol
+{
+	profiler_loc loc;
+	char *name;
+};
+
+typedef struct Profiler
+{
+	u32 period;
+	int countdown;
+	u64 samples;
+
+	struct profiler_frame stack[PROFILER_MAX_DEPTH];
+	uf8 depth;
+	/* Calls beyond PROFILER_MAX_DEPTH, not kept. */
+	u32 overflow;
+
+	/* Open-addressed tables, sized to powers of two. */
+	struct profiler_count *counts;
+	size_t count_size;
+	size_t count_used;
+
+	struct profiler_stack *stacks;
+	size_t stack_size;
+	size_t stack_used;
+
+	/* Frames of the stacks in the table, leaf last. */
+	profiler_loc *frames;
+	size_t frame_used;
+	size_t frame_size;
+
+	/* Sorted by loc. */
+	struct profiler_symbol *symbols;
+	size_t symbol_count;
+} Profiler;
+
+static const u8 profiler_calls[0x100] = {
+	[0xC4] = 1, [0xCC] = 1, [0xCD] = 1, [0xD4] = 1, [0xDC] = 1,
+	[0xC7] = 1, [0xCF] = 1, [0xD7] = 1, [0xDF] = 1,
+	[0xE7] = 1, [0xEF] = 1, [0xF7] = 1, [0xFF] = 1,
+	[0xC0] = 2, [0xC8] = 2, [0xC9] = 2, [0xD0] = 2, [0xD8] = 2, [0xD9] = 2};
+
+void profiler_free(Profiler *p)
+{
+	for (size_t i = 0; i < p->symbol_count; i++)
+		free(p->symbols[i].name);
+
+	free(p->symbols);
+	free(p->counts);
+	free(p->stacks);
+	free(p->frames);
+	memset(p, 0, sizeof(*p));
+}
+
+/* Sample every period cycles. Returns 0 if out of memory. */
+bool profiler_init(Profiler *p, const u32 period)
+{
+	memset(p, 0, sizeof(*p));
+	p->period = period ? period : 1;
+	p->countdown = p->period;
+	p->count_size = 1 << 12;
+	p->stack_size = 1 << 12;
+	p->frame_size = 1 << 14;
+	p->counts = calloc(p->count_size, sizeof(*p->counts));
+	p->stacks = calloc(p->stack_size, sizeof(*p->stacks));
+	p->frames = malloc(p->frame_size * sizeof(*p->frames));
+
+	if (p->counts == NULL || p->stacks == NULL || p->frames == NULL)
+	{
+		profiler_free(p);
+		return 0;
+	}
+
+	return 1;
+}
+
+static profiler_loc profiler_locate(const Gameboy *gb, const uf16 address)
+{
+	uf16 bank = 0;
+
+	if (address >= 0x4000 && address < 0x8000)
+		bank = gb->rom_bank_base / ROM_BANK_SIZE;
+
+	return (profiler_loc)bank << 16 | address;
+}
+
+static u64 profiler_mix(u64 h, const profiler_loc loc)
+{
+	return (h ^ loc) * 0x100000001b3ULL;
+}
+
+/* Doubles the (bank, PC) table. Returns 0 if out of memory. */
+static bool profiler_grow_counts(Profiler *p)
+{
+	const size_t size = 2 * p->count_size;
+	struct profiler_count *grown = calloc(size, sizeof(*grown));
+
+	if (grown == NULL)
+		return 0;
+
+	for (size_t i = 0; i < p->count_size; i++)
+	{
+		size_t j;
+
+		if (!p->counts[i].samples)
+			continue;
+
+		for (j = profiler_mix(0, p->counts[i].loc) & (size - 1); grown[j].samples;
+			 j = (j + 1) & (size - 1))
+			;
+
+		grown[j] = p->counts[i];
+	}
+
+	free(p->counts);
+	p->counts = grown;
+	p->count_size = size;
+	return 1;
+}
+
+/* Doubles the stack table. Returns 0 if out of memory. */
+static bool profiler_grow_stacks(Profiler *p)
+{
+	const size_t size = 2 * p->stack_size;
+	struct profiler_stack *grown = calloc(size, sizeof(*grown));
+
+	if (grown == NULL)
+		return 0;
+
+	for (size_t i = 0; i < p->stack_size; i++)
+	{
+		size_t j;
+
+		if (!p->stacks[i].samples)
+			continue;
+
+		for (j = p->stacks[i].hash & (size - 1); grown[j].samples;
+			 j = (j + 1) & (size - 1))
+			;
+
+		grown[j] = p->stacks[i];
+	}
+
+	free(p->stacks);
+	p->stacks = grown;
+	p->stack_size = size;
+	return 1;
+}
+
+static void profiler_count(Profiler *p, const profiler_loc loc)
+{
+	size_t i;
+
+	if (2 * (p->count_used + 1) > p->count_size && !profiler_grow_counts(p))
+		return;
+
+	for (i = profiler_mix(0, loc) & (p->count_size - 1);
+		 p->counts[i].samples && p->counts[i].loc != loc;
+		 i = (i + 1) & (p->count_size - 1))
+		;
+
+	p->count_used += !p->counts[i].samples;
+	p->counts[i].loc = loc;
+	p->counts[i].samples++;
+}
+
+static void profiler_count_stack(Profiler *p, const profiler_loc leaf)
+{
+	const uf8 depth = p->depth + 1;
+	u64 hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (uf8 d = 0; d < p->depth; d++)
+		hash = profiler_mix(hash, p->stack[d].target);
+
+	hash = profiler_mix(hash, leaf);
+
+	if (2 * (p->stack_used + 1) > p->stack_size && !profiler_grow_stacks(p))
+		return;
+
+	for (i = hash & (p->stack_size - 1); p->stacks[i].samples;
+		 i = (i + 1) & (p->stack_size - 1))
+	{
+		const struct profiler_stack *s = &p->stacks[i];
+		uf8 d = 0;
+
+		if (s->hash != hash || s->depth != depth)
+			continue;
+
+		while (d < p->depth && p->frames[s->frames + d] == p->stack[d].target)
+			d++;
+
+		if (d == p->depth && p->frames[s->frames + d] == leaf)
+			break;
+	}
+
+	if (!p->stacks[i].samples)
+	{
+		if (p->frame_used + depth > p->frame_size)
+		{
+			profiler_loc *frames =
+				realloc(p->frames, 2 * p->frame_size * sizeof(*frames));
+
+			if (frames == NULL)
+				return;
+
+			p->frames = frames;
+			p->frame_size *= 2;
+		}
+
+		for (uf8 d = 0; d < p->depth; d++)
+			p->frames[p->frame_used + d] = p->stack[d].target;
+
+		p->frames[p->frame_used + p->depth] = leaf;
+		p->stacks[i].hash = hash;
+		p->stacks[i].frames = p->frame_used;
+		p->stacks[i].depth = depth;
+		p->frame_used += depth;
+		p->stack_used++;
+	}
+
+	p->stacks[i].samples++;
+}
+
+/* Drops the frames whose return address is no longer on the stack. */
+static void profiler_unwind(Profiler *p, const uf16 sp)
+{
+	if (p->overflow)
+	{
+		/* Only an approximation below the kept frames. */
+		p->overflow--;
+		return;
+	}
+
+	while (p->depth && p->stack[p->depth - 1].sp < sp)
+		p->depth--;
+}
+
+/* After the CPU has pushed PC and jumped; called for interrupts too. */
+void profiler_call(Profiler *p, const Gameboy *gb)
+{
+	const uf16 sp = gb->cpu_reg.SP;
+
+	/* The guest may have moved SP up without returning. */
+	while (p->depth && p->stack[p->depth - 1].sp <= sp)
+		p->depth--;
+
+	if (p->depth == PROFILER_MAX_DEPTH)
+	{
+		p->overflow++;
+		return;
+	}
+
+	p->stack[p->depth].target = profiler_locate(gb, gb->cpu_reg.PC);
+	p->stack[p->depth].sp = sp;
+	p->depth++;
+}
+
+/*
+ * After each instruction: pc and sp are from before it. Follows calls and
+ * returns, and samples once every period cycles.
+ */
+void profiler_step(Profiler *p, const Gameboy *gb, const u8 opcode,
+				   const uf16 pc, const uf16 sp, const uf8 cycles)
+{
+	if (profiler_calls[opcode] == 1 && gb->cpu_reg.SP == ((sp - 2) & 0xFFFF))
+		profiler_call(p, gb);
+	else if (profiler_calls[opcode] == 2 && gb->cpu_reg.SP == ((sp + 2) & 0xFFFF))
+		profiler_unwind(p, gb->cpu_reg.SP);
+
+	if ((p->countdown -= cycles) > 0)
+		return;
+
+	p->countdown += p->period;
+	p->samples++;
+
+	{
+		const profiler_loc loc = profiler_locate(gb, pc);
+
+		profiler_count(p, loc);
+		profiler_count_stack(p, loc);
+	}
+}
+
+static int profiler_compare_symbols(const void *a, const void *b)
+{
+	const profiler_loc x = ((const struct profiler_symbol *)a)->loc;
+	const profiler_loc y = ((const struct profiler_symbol *)b)->loc;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Loads an RGBDS .sym file: "BB:AAAA Name" per line, ';' comments.
+ * Returns 0 if it cannot be read.
+ */
+bool profiler_load_symbols(Profiler *p, const char *file_name)
+{
+	FILE *f = fopen(file_name, "r");
+	size_t cap = p->symbol_count;
+	char line[512];
+
+	if (f == NULL)
+		return 0;
+
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		unsigned bank, address;
+		char name[256];
+
+		if (sscanf(line, "%x:%x %255s", &bank, &address, name) != 3 ||
+			name[0] == ';')
+			continue;
+
+		if (p->symbol_count == cap)
+		{
+			struct profiler_symbol *grown;
+
+			cap = cap ? 2 * cap : 256;
+
+			if ((grown = realloc(p->symbols, cap * sizeof(*grown))) == NULL)
+				break;
+
+			p->symbols = grown;
+		}
+
+		if ((p->symbols[p->symbol_count].name = malloc(strlen(name) + 1)) == NULL)
+			break;
+
+		strcpy(p->symbols[p->symbol_count].name, name);
+		p->symbols[p->symbol_count].loc = (profiler_loc)bank << 16 | (address & 0xFFFF);
+		p->symbol_count++;
+	}
+
+	fclose(f);
+	qsort(p->symbols, p->symbol_count, sizeof(*p->symbols),
+		  profiler_compare_symbols);
+	return 1;
+}
+
+/* Nearest symbol at or below loc in its bank, or NULL. */
+static const struct profiler_symbol *profiler_symbol(const Profiler *p,
+													 const profiler_loc loc)
+{
+	size_t lo = 0, hi = p->symbol_count;
+
+	while (lo < hi)
+	{
+		const size_t mid = lo + (hi - lo) / 2;
+
+		if (p->symbols[mid].loc <= loc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == 0 || p->symbols[lo - 1].loc >> 16 != loc >> 16)
+		return NULL;
+
+	return &p->symbols[lo - 1];
+}
+
+/* "Name+off" (or "Name") with symbols, else "BB:AAAA". */
+static void profiler_name(const Profiler *p, const profiler_loc loc,
+						  const bool offset, char *buf, const size_t len)
+{
+	const struct profiler_symbol *s = profiler_symbol(p, loc);
+
+	if (s == NULL)
+		snprintf(buf, len, "%02X:%04X", (unsigned)(loc >> 16),
+				 (unsigned)(loc & 0xFFFF));
+	else if (offset && s->loc != loc)
+		snprintf(buf, len, "%s+0x%X", s->name, (unsigned)(loc - s->loc));
+	else
+		snprintf(buf, len, "%s", s->name);
+}
+
+static int profiler_compare_counts(const void *a, const void *b)
+{
+	const u64 x = ((const struct profiler_count *)a)->samples;
+	const u64 y = ((const struct profiler_count *)b)->samples;
+
+	return (x < y) - (x > y);
+}
+
+/* The top `rows` (bank, PC) pairs by samples. */
+void profiler_print_hotspots(const Profiler *p, FILE *f, const uf32 rows)
+{
+	struct profiler_count *sorted = malloc(p->count_used * sizeof(*sorted) + 1);
+	size_t n = 0;
+
+	if (sorted == NULL)
+		return;
+
+	for (size_t i = 0; i < p->count_size; i++)
+	{
+		if (p->counts[i].samples)
+			sorted[n++] = p->counts[i];
+	}
+
+	qsort(sorted, n, sizeof(*sorted), profiler_compare_counts);
+	fprintf(f, "%llu samples every %lu cycles\n",
+			(unsigned long long)p->samples, (unsigned long)p->period);
+
+	for (size_t i = 0; i < n && i < rows; i++)
+	{
+		char name[300] = "";
+
+		if (profiler_symbol(p, sorted[i].loc) != NULL)
+			profiler_name(p, sorted[i].loc, 1, name, sizeof(name));
+
+		fprintf(f, "%10llu %6.2f%%  %02X:%04X  %s\n",
+				(unsigned long long)sorted[i].samples,
+				100.0 * sorted[i].samples / (p->samples ? p->samples : 1),
+				(unsigned)(sorted[i].loc >> 16),
+				(unsigned)(sorted[i].loc & 0xFFFF), name);
+	}
+
+	free(sorted);
+}
+
+/*
+ * Collapsed stacks, "outer;inner;leaf count" per line, for flamegraph.pl
+ * and compatible tools. Frames are call targets; the leaf is the sampled
+ * PC, or its function when symbols are loaded. Identical lines may repeat
+ * and are meant to be summed.
+ */
+void profiler_write_collapsed(const Profiler *p, FILE *f)
+{
+	for (size_t i = 0; i < p->stack_size; i++)
+	{
+		const struct profiler_stack *s = &p->stacks[i];
+
+		if (!s->samples)
+			continue;
+
+		for (uf8 d = 0; d < s->depth; d++)
+		{
+			char name[300];
+
+			profiler_name(p, p->frames[s->frames + d], 0, name, sizeof(name));
+			fprintf(f, "%s%s", d ? ";" : "", name);
+		}
+
+		fprintf(f, " %llu\n", (unsigned long long)s->samples);
+	}
+}
@@ -0,0 +1,302 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "gb.h"
+#include "state.h"
+
+/*
+ * Rewind buffer. rewind_push() saves a state after each frame and stores
+ * it XORed with the previous one, so the parts that did not change (most
+ * of WRAM and VRAM) become runs of zeros, which are then run-length
+ * encoded. Every REWIND_KEYFRAME_INTERVAL entries a keyframe is stored
+ * against zeros instead. Entries live in a ring of bytes; once it is full
+ * the oldest keyframe and its deltas are dropped together.
+ *
+ * Stepping back decodes from the nearest keyframe, so it costs at most
+ * REWIND_KEYFRAME_INTERVAL decodes of a few microseconds each.
+ */
+
+#define REWIND_KEYFRAME_INTERVAL 60
+#define REWIND_MIN_RUN 4
+#define REWIND_MAX_RUN 0xFFFF
+
+struct rewind_entry
+{
+	size_t offset;
+	u32 size;
+	u32 keyframe;
+};
+
+typedef struct Rewind
+{
+	u8 *pool;
+	size_t pool_size;
+	size_t used;
+
+	struct rewind_entry *entries;
+	uf32 max_entries;
+	uf32 first;
+	uf32 count;
+	uf32 since_keyframe;
+
+	/* Decoded newest entry, the state being pushed, zeros for keyframes
+	 * and the encoder output. */
+	size_t state_size;
+	u8 *state;
+	u8 *next;
+	u8 *zero;
+	u8 *enc;
+} Rewind;
+
+/*
+ * Tokens of a little-endian u16 count of unchanged bytes, a u16 count of
+ * changed bytes and the changed bytes XORed with base. Short runs of
+ * unchanged bytes stay inside the literals.
+ */
+static size_t rewind_encode(u8 *restrict out, const u8 *restrict cur,
+							const u8 *restrict base, const size_t n)
+{
+	size_t i = 0, o = 0;
+
+	while (i < n)
+	{
+		size_t skip = i, end, run = 0;
+
+		while (skip + 8 <= n && skip + 8 - i <= REWIND_MAX_RUN)
+		{
+			uint64_t a, b;
+
+			memcpy(&a, cur + skip, 8);
+			memcpy(&b, base + skip, 8);
+
+			if (a != b)
+				break;
+
+			skip += 8;
+		}
+
+		while (skip < n && skip - i < REWIND_MAX_RUN && cur[skip] == base[skip])
+			skip++;
+
+		end = skip;
+
+		for (size_t j = skip; j < n && j - skip < REWIND_MAX_RUN; j++)
+		{
+			if (cur[j] != base[j])
+			{
+				end = j + 1;
+				run = 0;
+			}
+			else if (++run == REWIND_MIN_RUN)
+				break;
+		}
+
+		out[o++] = (skip - i) & 0xFF;
+		out[o++] = (skip - i) >> 8;
+		out[o++] = (end - skip) & 0xFF;
+		out[o++] = (end - skip) >> 8;
+
+		for (size_t j = skip; j < end; j++)
+			out[o++] = cur[j] ^ base[j];
+
+		i = end;
+	}
+
+	return o;
+}
+
+/* XORs an encoded entry into dst. */
+static void rewind_decode(u8 *restrict dst, const u8 *restrict in,
+						  const size_t len)
+{
+	const u8 *const in_end = in + len;
+
+	while (in < in_end)
+	{
+		const size_t skip = in[0] | (in[1] << 8);
+		const size_t lit = in[2] | (in[3] << 8);
+
+		in += 4;
+		dst += skip;
+
+		for (size_t j = 0; j < lit; j++)
+			dst[j] ^= in[j];
+
+		dst += lit;
+		in += lit;
+	}
+}
+
+void rewind_free(Rewind *rw)
+{
+	free(rw->pool);
+	free(rw->entries);
+	free(rw->state);
+	free(rw->next);
+	free(rw->zero);
+	free(rw->enc);
+	memset(rw, 0, sizeof(*rw));
+}
+
+/*
+ * Keep up to pool_size bytes and max_entries frames of history. Returns 0
+ * if out of memory.
+ */
+bool rewind_init(Rewind *rw, Gameboy *gb, size_t pool_size, const uf32 max_entries)
+{
+	const size_t state_size = gb_state_size(gb);
+	const size_t enc_size = 2 * state_size + 16;
+
+	memset(rw, 0, sizeof(*rw));
+
+	pool_size = MAX(pool_size, 2 * enc_size);
+
+	rw->pool = malloc(pool_size);
+	rw->entries = malloc(MAX(max_entries, 2) * sizeof(*rw->entries));
+	rw->state = malloc(state_size);
+	rw->next = malloc(state_size);
+	rw->zero = calloc(1, state_size);
+	rw->enc = malloc(enc_size);
+
+	if (rw->pool == NULL || rw->entries == NULL || rw->state == NULL ||
+		rw->next == NULL || rw->zero == NULL || rw->enc == NULL)
+	{
+		rewind_free(rw);
+		return 0;
+	}
+
+	rw->pool_size = pool_size;
+	rw->max_entries = MAX(max_entries, 2);
+	rw->state_size = state_size;
+
+	return 1;
+}
+
+static struct rewind_entry *rewind_entry(const Rewind *rw, const uf32 i)
+{
+	return &rw->entries[(rw->first + i) % rw->max_entries];
+}
+
+/* Drops the oldest keyframe and the deltas that depend on it. */
+static void rewind_evict(Rewind *rw)
+{
+	do
+	{
+		rw->used -= rewind_entry(rw, 0)->size;
+		rw->first = (rw->first + 1) % rw->max_entries;
+		rw->count--;
+	} while (rw->count && !rewind_entry(rw, 0)->keyframe);
+}
+
+/* Offset where size bytes fit after the newest entry, or -1. */
+static long rewind_space(const Rewind *rw, const size_t size)
+{
+	size_t oldest, end;
+
+	if (rw->count == 0)
+		return 0;
+
+	if (rw->count == rw->max_entries)
+		return -1;
+
+	oldest = rewind_entry(rw, 0)->offset;
+	end = rewind_entry(rw, rw->count - 1)->offset +
+		  rewind_entry(rw, rw->count - 1)->size;
+
+	if (end > oldest)
+	{
+		if (end + size <= rw->pool_size)
+			return end;
+
+		return size <= oldest ? 0 : -1;
+	}
+
+	return end + size <= oldest ? (long)end : -1;
+}
+
+void rewind_push(Rewind *rw, Gameboy *gb)
+{
+	bool keyframe = rw->count == 0 ||
+					rw->since_keyframe >= REWIND_KEYFRAME_INTERVAL;
+	size_t size;
+	long offset;
+	struct rewind_entry *e;
+
+	gb_state_save(gb, rw->next, rw->state_size);
+	size = rewind_encode(rw->enc, rw->next, keyframe ? rw->zero : rw->state,
+						 rw->state_size);
+
+	while ((offset = rewind_space(rw, size)) < 0)
+	{
+		rewind_evict(rw);
+
+		if (rw->count == 0 && !keyframe)
+		{
+			keyframe = 1;
+			size = rewind_encode(rw->enc, rw->next, rw->zero, rw->state_size);
+		}
+	}
+
+	memcpy(rw->pool + offset, rw->enc, size);
+
+	e = &rw->entries[(rw->first + rw->count) % rw->max_entries];
+	e->offset = offset;
+	e->size = size;
+	e->keyframe = keyframe;
+	rw->count++;
+	rw->used += size;
+	rw->since_keyframe = keyframe ? 1 : rw->since_keyframe + 1;
+
+	{
+		u8 *const t = rw->state;
+
+		rw->state = rw->next;
+		rw->next = t;
+	}
+}
+
+/*
+ * Drops the newest entry and loads the one before it. Returns 0 once the
+ * oldest entry is reached.
+ */
+bool rewind_step(Rewind *rw, Gameboy *gb)
+{
+	uf32 key;
+
+	if (rw->count < 2)
+		return 0;
+
+	rw->used -= rewind_entry(rw, rw->count - 1)->size;
+	rw->count--;
+
+	for (key = rw->count - 1; !rewind_entry(rw, key)->keyframe; key--)
+		;
+
+	memset(rw->state, 0, rw->state_size);
+
+	for (uf32 i = key; i < rw->count; i++)
+	{
+		const struct rewind_entry *e = rewind_entry(rw, i);
+
+		rewind_decode(rw->state, rw->pool + e->offset, e->size);
+	}
+
+	rw->since_keyframe = rw->count - key;
+
+	return gb_state_load(gb, rw->state, rw->state_size) == STATE_NO_ERROR;
+}
+
+/* Seconds of history held. */
+f32 rewind_seconds(const Rewind *rw)
+{
+	return rw->count / VERTICAL_SYNC;
+}
+
+/* Bytes used per minute of history at the compression seen so far. */
+size_t rewind_bytes_per_minute(const Rewind *rw)
+{
+	return rw->count ? (size_t)(rw->used * 60.0 * VERTICAL_SYNC / rw->count) : 0;
+}
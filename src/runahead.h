@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include "defs.h"
+#include "gb.h"
+#include "cpu.h"
+#include "state.h"
+
+/*
+ * Run-ahead. Games usually react to input a frame or more after reading
+ * it. After each real frame the state is saved and the game is run
+ * `frames` frames further with the same input; only the last of those is
+ * drawn, and the saved state is loaded again. What is shown is then what
+ * the game would show `frames` frames later, hiding that much of its
+ * internal lag, for about (frames + 1) times the CPU cost.
+ *
+ * With a second instance the frames ahead run on a copy instead, so the
+ * main instance is never rewound. Its APU is then never touched, which
+ * matters when an audio callback reads it from another thread. The second
+ * instance needs its own cartridge RAM.
+ */
+
+typedef struct RunAhead
+{
+	uf32 frames;
+	Gameboy *ahead;
+
+	size_t state_size;
+	u8 *state;
+} RunAhead;
+
+/* ahead is an initialised second instance of the same ROM, or NULL. */
+bool runahead_init(RunAhead *ra, Gameboy *gb, const uf32 frames, Gameboy *ahead)
+{
+	ra->frames = frames;
+	ra->ahead = ahead;
+	ra->state_size = gb_state_size(gb);
+
+	if (ahead != NULL)
+		audio_set_synth(&ahead->apu, 0);
+
+	return (ra->state = malloc(ra->state_size)) != NULL;
+}
+
+void runahead_free(RunAhead *ra)
+{
+	free(ra->state);
+	ra->state = NULL;
+}
+
+/* Runs a frame without drawing it. Use it for the real frames. */
+void run_cpu_hidden(Gameboy *gb)
+{
+	void (*const draw_line)(struct Gameboy *, const u8 pixels[static 160],
+							const uf8 line) = gb->display.gpu_draw_line;
+
+	gb->display.gpu_draw_line = NULL;
+	run_frame(gb);
+	gb->display.gpu_draw_line = draw_line;
+}
+
+/*
+ * Draws the frame `frames` (at least 1) frames ahead of gb with the
+ * current input. Without a second instance the audio of gb must not be
+ * rendered while this runs.
+ */
+void runahead_show(RunAhead *ra, Gameboy *gb)
+{
+	Gameboy *const target = ra->ahead != NULL ? ra->ahead : gb;
+	const u32 synth = gb->apu.synth;
+
+	gb_state_save(gb, ra->state, ra->state_size);
+
+	if (ra->ahead != NULL)
+		gb_state_load(ra->ahead, ra->state, ra->state_size);
+	else
+		audio_set_synth(&gb->apu, 0);
+
+	for (uf32 i = 1; i < ra->frames; i++)
+		run_cpu_hidden(target);
+
+	run_frame(target);
+
+	/* The load puts back the channels as they were, so synthesis goes on
+	 * from there rather than being rebuilt by audio_set_synth(). */
+	if (ra->ahead == NULL)
+	{
+		gb_state_load(gb, ra->state, ra->state_size);
+		gb->apu.synth = synth;
+	}
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <stddef.h>
+#include <string.h>
+
+#include "defs.h"
+#include "gb.h"
+#include "mmu.h"
+
+/*
+ * Save states. A state is a fixed header followed by the emulated state
+ * copied straight out of the Gameboy: everything between the callbacks and
+ * the display, the display's palettes and window state, WRAM/VRAM/HRAM/OAM,
+ * the APU channels and the cartridge RAM. Host settings (callbacks, audio
+ * rate and synthesis, frame skipping and interlacing) are left alone by a
+ * load; the saving side's audio rate is recorded so the channel timing can
+ * be converted to ours.
+ *
+ * Since the structs are copied as they are in memory, a state can only be
+ * loaded by a build with the same layout. The header records the version,
+ * the size of each section and the ROM's checksums so that anything else
+ * is refused rather than misread.
+ */
+
+#define STATE_MAGIC "GBST"
+#define STATE_VERSION 8
+
+enum StateError
+{
+	STATE_NO_ERROR,
+	STATE_INVALID_SIZE,
+	STATE_INVALID_HEADER,
+	STATE_INVALID_VERSION,
+	STATE_INVALID_LAYOUT,
+	STATE_WRONG_ROM
+};
+
+struct state_header
+{
+	char magic[4];
+	u32 version;
+	u32 core_size;
+	u32 display_size;
+	u32 apu_size;
+	u32 cart_ram_size;
+	u8 rom_checksum[3];
+	u8 padding;
+};
+
+/* From the CPU flags up to the display; this skips the callbacks. */
+#define STATE_CORE_START \
+	(offsetof(Gameboy, serial_recv) + sizeof(((Gameboy *)0)->serial_recv))
+#define STATE_CORE_SIZE (offsetof(Gameboy, display) - STATE_CORE_START)
+#define STATE_DISPLAY_START offsetof(Display, bg_palette)
+/* Up to WY; the frame skip and interlace counters after it are host state. */
+#define STATE_DISPLAY_SIZE \
+	(offsetof(Display, WY) + sizeof(((Display *)0)->WY) - STATE_DISPLAY_START)
+#define STATE_MEMORY_START offsetof(Gameboy, wram)
+#define STATE_MEMORY_SIZE (offsetof(Gameboy, oam) + OAM_SIZE - STATE_MEMORY_START)
+#define STATE_APU_SIZE (offsetof(Apu, right) + sizeof(((Apu *)0)->right))
+
+static void state_fill_header(Gameboy *gb, struct state_header *h)
+{
+	memcpy(h->magic, STATE_MAGIC, sizeof(h->magic));
+	h->version = STATE_VERSION;
+	h->core_size = STATE_CORE_SIZE;
+	h->display_size = STATE_DISPLAY_SIZE;
+	h->apu_size = STATE_APU_SIZE;
+	h->cart_ram_size = get_save_size(gb);
+	h->padding = 0;
+
+	for (u8 i = 0; i < 3; i++)
+		h->rom_checksum[i] = gb->read_rom(gb, 0x014D + i);
+}
+
+/* Bytes needed to save the state of this cartridge. */
+size_t gb_state_size(Gameboy *gb)
+{
+	return sizeof(struct state_header) + STATE_CORE_SIZE + STATE_DISPLAY_SIZE +
+		   STATE_MEMORY_SIZE + STATE_APU_SIZE + sizeof(gb->apu.length) +
+		   sizeof(gb->apu.rate) + sizeof(gb->direct.joypad) +
+		   get_save_size(gb);
+}
+
+/* Returns the number of bytes written, or 0 if len is too small. */
+size_t gb_state_save(Gameboy *gb, void *buf, const size_t len)
+{
+	const uf32 cart_ram_size = get_save_size(gb);
+	u8 *p = buf;
+	struct state_header h;
+
+	if (len < gb_state_size(gb))
+		return 0;
+
+	state_fill_header(gb, &h);
+	memcpy(p, &h, sizeof(h));
+	p += sizeof(h);
+
+	memcpy(p, (const u8 *)gb + STATE_CORE_START, STATE_CORE_SIZE);
+	p += STATE_CORE_SIZE;
+	memcpy(p, (const u8 *)&gb->display + STATE_DISPLAY_START, STATE_DISPLAY_SIZE);
+	p += STATE_DISPLAY_SIZE;
+	memcpy(p, (const u8 *)gb + STATE_MEMORY_START, STATE_MEMORY_SIZE);
+	p += STATE_MEMORY_SIZE;
+	memcpy(p, &gb->apu, STATE_APU_SIZE);
+	p += STATE_APU_SIZE;
+	memcpy(p, gb->apu.length, sizeof(gb->apu.length));
+	p += sizeof(gb->apu.length);
+	memcpy(p, &gb->apu.rate, sizeof(gb->apu.rate));
+	p += sizeof(gb->apu.rate);
+	*p++ = gb->direct.joypad;
+
+	if (gb->direct.cart_ram != NULL)
+		memcpy(p, gb->direct.cart_ram, cart_ram_size);
+	else
+	{
+		for (uf32 i = 0; i < cart_ram_size; i++)
+			p[i] = gb->read_ram(gb, i);
+	}
+
+	p += cart_ram_size;
+
+	return p - (u8 *)buf;
+}
+
+enum StateError gb_state_load(Gameboy *gb, const void *buf, const size_t len)
+{
+	const u8 *p = buf;
+	struct state_header h, expect;
+	f32 rate;
+
+	if (len < sizeof(h))
+		return STATE_INVALID_SIZE;
+
+	memcpy(&h, p, sizeof(h));
+	p += sizeof(h);
+	state_fill_header(gb, &expect);
+
+	if (memcmp(h.magic, expect.magic, sizeof(h.magic)) != 0)
+		return STATE_INVALID_HEADER;
+
+	if (h.version != expect.version)
+		return STATE_INVALID_VERSION;
+
+	if (h.core_size != expect.core_size || h.display_size != expect.display_size ||
+		h.apu_size != expect.apu_size || h.cart_ram_size != expect.cart_ram_size)
+		return STATE_INVALID_LAYOUT;
+
+	if (memcmp(h.rom_checksum, expect.rom_checksum, sizeof(h.rom_checksum)) != 0)
+		return STATE_WRONG_ROM;
+
+	if (len < gb_state_size(gb))
+		return STATE_INVALID_SIZE;
+
+	memcpy((u8 *)gb + STATE_CORE_START, p, STATE_CORE_SIZE);
+	p += STATE_CORE_SIZE;
+	memcpy((u8 *)&gb->display + STATE_DISPLAY_START, p, STATE_DISPLAY_SIZE);
+	p += STATE_DISPLAY_SIZE;
+	memcpy((u8 *)gb + STATE_MEMORY_START, p, STATE_MEMORY_SIZE);
+	p += STATE_MEMORY_SIZE;
+	memcpy(&gb->apu, p, STATE_APU_SIZE);
+	p += STATE_APU_SIZE;
+	memcpy(gb->apu.length, p, sizeof(gb->apu.length));
+	p += sizeof(gb->apu.length);
+	memcpy(&rate, p, sizeof(rate));
+	p += sizeof(rate);
+	audio_rescale(&gb->apu, rate);
+	gb->direct.joypad = *p++;
+
+	if (gb->direct.cart_ram != NULL)
+		memcpy(gb->direct.cart_ram, p, h.cart_ram_size);
+	else
+	{
+		for (uf32 i = 0; i < h.cart_ram_size; i++)
+			gb->write_ram(gb, i, p[i]);
+	}
+
+	return STATE_NO_ERROR;
+}
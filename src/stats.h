@@ -0,0 +1,238 @@
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+
+#include "defs.h"
+
+/*
+ * Profiling counters, built only with -DGB_STATS. Without it the STATS_
+ * macros expand to nothing (or to the timed statement alone) and neither
+ * struct is part of Gameboy or Apu.
+ *
+ * Host time is read with rdtsc on x86 and clock() elsewhere. It is split
+ * into the PPU (draw_line), the APU (audio_render and audio_skip), the
+ * rest of run_cpu/run_frame (CPU) and the time between frames
+ * (frontend). When audio is rendered on the main thread it counts under
+ * both APU and frontend. Frame times are only taken by run_cpu and
+ * run_frame.
+ */
+
+enum StatsRegion
+{
+	STATS_ROM0,
+	STATS_ROMX,
+	STATS_VRAM,
+	STATS_CART_RAM,
+	STATS_WRAM,
+	STATS_ECHO,
+	STATS_OAM,
+	STATS_UNUSED,
+	STATS_IO,
+	STATS_HRAM,
+	STATS_IE,
+
+	STATS_REGIONS
+};
+
+enum StatsSubsystem
+{
+	STATS_CPU,
+	STATS_PPU,
+	STATS_APU,
+	STATS_FRONTEND,
+
+	STATS_SUBSYSTEMS
+};
+
+struct gb_stats
+{
+	u64 opcodes[0x100];
+	u64 cb_opcodes[0x100];
+	u64 halted_steps;
+
+	u64 reads[STATS_REGIONS];
+	u64 writes[STATS_REGIONS];
+	u64 rom_bank_switches;
+	u64 ram_bank_switches;
+
+	u64 lines_drawn;
+	u64 lines_skipped;
+	u64 sprites_drawn;
+
+	u64 frames;
+	u64 host[STATS_SUBSYSTEMS];
+
+	/* Host time at the start of the current frame and the end of the last
+	 * one, and PPU time at the start of the frame. */
+	u64 frame_start;
+	u64 frame_end;
+	u64 frame_ppu;
+};
+
+/* Kept in Apu, as the audio callback only sees that. */
+struct apu_stats
+{
+	u64 samples;
+	u64 host;
+};
+
+#ifdef GB_STATS
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+#define STATS_CLOCK_UNIT "cycles"
+
+static inline u64 stats_clock(void)
+{
+	return __rdtsc();
+}
+#else
+#include <time.h>
+
+#define STATS_CLOCK_UNIT "clock ticks"
+
+static inline u64 stats_clock(void)
+{
+	return clock();
+}
+#endif
+
+#define STATS_INC(s, field) ((s).field++)
+#define STATS_ADD(s, field, n) ((s).field += (n))
+#define STATS_TIME(counter, stmt)                \
+	do                                           \
+	{                                            \
+		const u64 stats_start_ = stats_clock();  \
+		stmt;                                    \
+		(counter) += stats_clock() - stats_start_; \
+	} while (0)
+
+static inline enum StatsRegion stats_region(const uf16 address)
+{
+	static const u8 regions[16] = {
+		STATS_ROM0, STATS_ROM0, STATS_ROM0, STATS_ROM0,
+		STATS_ROMX, STATS_ROMX, STATS_ROMX, STATS_ROMX,
+		STATS_VRAM, STATS_VRAM, STATS_CART_RAM, STATS_CART_RAM,
+		STATS_WRAM, STATS_WRAM, STATS_ECHO, STATS_ECHO};
+
+	if (address < 0xFE00)
+		return regions[address >> 12];
+
+	if (address < 0xFEA0)
+		return STATS_OAM;
+
+	if (address < 0xFF00)
+		return STATS_UNUSED;
+
+	if (address < 0xFF80)
+		return STATS_IO;
+
+	return address < 0xFFFF ? STATS_HRAM : STATS_IE;
+}
+
+static void stats_frame_begin(struct gb_stats *s, const u64 ppu)
+{
+	s->frame_start = stats_clock();
+	s->frame_ppu = ppu;
+
+	if (s->frame_end)
+		s->host[STATS_FRONTEND] += s->frame_start - s->frame_end;
+}
+
+static void stats_frame_end(struct gb_stats *s)
+{
+	s->frame_end = stats_clock();
+	s->host[STATS_CPU] += s->frame_end - s->frame_start -
+						  (s->host[STATS_PPU] - s->frame_ppu);
+	s->frames++;
+}
+
+#else
+
+#define STATS_INC(s, field) ((void)0)
+#define STATS_ADD(s, field, n) ((void)0)
+#define STATS_TIME(counter, stmt) \
+	do                            \
+	{                             \
+		stmt;                     \
+	} while (0)
+
+#endif
+
+/* Clears the counters, e.g. after loading a ROM. */
+void gb_stats_reset(struct gb_stats *s, struct apu_stats *a)
+{
+	memset(s, 0, sizeof(*s));
+	memset(a, 0, sizeof(*a));
+}
+
+/* Human-readable report; opcodes that never ran are left out. */
+void gb_stats_dump(FILE *f, const struct gb_stats *s, const struct apu_stats *a)
+{
+	static const char *const regions[STATS_REGIONS] = {
+		"rom0", "romx", "vram", "cart ram", "wram", "echo",
+		"oam", "unused", "io", "hram", "ie"};
+	static const char *const subsystems[STATS_SUBSYSTEMS] = {
+		"cpu", "ppu", "apu", "frontend"};
+	const u64 frames = s->frames ? s->frames : 1;
+	u64 instructions = 0, host = 0;
+
+	for (uf16 i = 0; i < 0x100; i++)
+		instructions += s->opcodes[i];
+
+	fprintf(f, "instructions: %llu (%llu halted steps)\n",
+			(unsigned long long)instructions,
+			(unsigned long long)s->halted_steps);
+
+	for (uf16 i = 0; i < 0x100; i++)
+	{
+		if (s->opcodes[i])
+			fprintf(f, "  %02X     %12llu %6.2f%%\n", (unsigned)i,
+					(unsigned long long)s->opcodes[i],
+					100.0 * s->opcodes[i] / instructions);
+	}
+
+	for (uf16 i = 0; i < 0x100; i++)
+	{
+		if (s->cb_opcodes[i])
+			fprintf(f, "  CB %02X  %12llu %6.2f%%\n", (unsigned)i,
+					(unsigned long long)s->cb_opcodes[i],
+					100.0 * s->cb_opcodes[i] / instructions);
+	}
+
+	fputs("memory:        reads       writes\n", f);
+
+	for (uf8 r = 0; r < STATS_REGIONS; r++)
+	{
+		fprintf(f, "  %-8s %12llu %12llu\n", regions[r],
+				(unsigned long long)s->reads[r],
+				(unsigned long long)s->writes[r]);
+	}
+
+	fprintf(f, "bank switches: %llu rom, %llu ram\n",
+			(unsigned long long)s->rom_bank_switches,
+			(unsigned long long)s->ram_bank_switches);
+	fprintf(f, "lines: %llu drawn, %llu skipped; %llu sprites drawn\n",
+			(unsigned long long)s->lines_drawn,
+			(unsigned long long)s->lines_skipped,
+			(unsigned long long)s->sprites_drawn);
+	fprintf(f, "apu samples: %llu\n", (unsigned long long)a->samples);
+
+#ifdef GB_STATS
+	fprintf(f, "host " STATS_CLOCK_UNIT " per frame over %llu frames:\n",
+			(unsigned long long)s->frames);
+#endif
+
+	for (uf8 i = 0; i < STATS_SUBSYSTEMS; i++)
+		host += i == STATS_APU ? a->host : s->host[i];
+
+	for (uf8 i = 0; i < STATS_SUBSYSTEMS; i++)
+	{
+		const u64 t = i == STATS_APU ? a->host : s->host[i];
+
+		fprintf(f, "  %-8s %12.0f %6.2f%%\n", subsystems[i], (double)t / frames,
+				host ? 100.0 * t / host : 0.0);
+	}
+}
@@ -1,8 +1,112 @@
 #pragma once
 
+#include <stdbool.h>
+
 #include "defs.h"
 #include "gb.h"
 
+/*
+ * DIV and TIMA are worked out from timer.cycles when needed rather than
+ * counted on every step. DIV is the high byte of a 16-bit divider that
+ * was zero at div_base. TIMA counts falling edges of the divider bit that
+ * TAC selects. It is brought up to date by timer_sync() when it is read,
+ * when TIMA, TMA, TAC or DIV are written, and at tima_event, the cycle of
+ * its next overflow, which is all cpu_step() checks for.
+ */
+
+/* log2 of the TIMA period for each TAC rate. */
+static const uf8 TAC_SHIFT[4] = {10, 4, 6, 8};
+
+static inline uf16 timer_divider(const Gameboy *gb)
+{
+	return (u16)(gb->timer.cycles - gb->timer.div_base);
+}
+
+static inline u8 timer_div(const Gameboy *gb)
+{
+	return timer_divider(gb) >> 8;
+}
+
+/* Advances TIMA by ticks, reloading it from TMA on overflow. */
+static void timer_tick(Gameboy *gb, u64 ticks)
+{
+	if (ticks < 256u - gb->hw_reg.TIMA)
+	{
+		gb->hw_reg.TIMA += ticks;
+		return;
+	}
+
+	ticks -= 256u - gb->hw_reg.TIMA;
+	gb->hw_reg.IF |= TIMER_INTR;
+	gb->hw_reg.TIMA = gb->hw_reg.TMA + ticks % (256u - gb->hw_reg.TMA);
+}
+
+/* Sets tima_event from tima_sync and the current TIMA and TAC. */
+static void timer_schedule(Gameboy *gb)
+{
+	const uf8 shift = TAC_SHIFT[gb->hw_reg.rate];
+	const u64 since = gb->timer.tima_sync - gb->timer.div_base;
+	const u64 first = gb->timer.tima_sync + ((u64)1 << shift) -
+					  (since & (((u64)1 << shift) - 1));
+
+	if (!gb->hw_reg.enable)
+	{
+		gb->timer.tima_event = UINT64_MAX;
+		return;
+	}
+
+	gb->timer.tima_event = first + ((u64)(255u - gb->hw_reg.TIMA) << shift);
+}
+
+/* Applies the TIMA ticks since tima_sync. */
+void timer_sync(Gameboy *gb)
+{
+	if (gb->hw_reg.enable)
+	{
+		const uf8 shift = TAC_SHIFT[gb->hw_reg.rate];
+
+		timer_tick(gb, ((gb->timer.cycles - gb->timer.div_base) >> shift) -
+						   ((gb->timer.tima_sync - gb->timer.div_base) >> shift));
+	}
+
+	gb->timer.tima_sync = gb->timer.cycles;
+	timer_schedule(gb);
+}
+
+/* The divider bit TIMA counts the falling edges of, if it is running. */
+static inline bool timer_input(const Gameboy *gb)
+{
+	return gb->hw_reg.enable &&
+		   (timer_divider(gb) >> (TAC_SHIFT[gb->hw_reg.rate] - 1) & 1);
+}
+
+void timer_write_div(Gameboy *gb)
+{
+	timer_sync(gb);
+
+	/* Clearing the divider is a falling edge if the bit was set. */
+	if (timer_input(gb))
+		timer_tick(gb, 1);
+
+	gb->timer.div_base = gb->timer.cycles;
+	timer_schedule(gb);
+}
+
+void timer_write_tac(Gameboy *gb, const u8 value)
+{
+	bool input;
+
+	timer_sync(gb);
+	input = timer_input(gb);
+	gb->hw_reg.TAC = value;
+
+	/* So is switching from a set bit to a clear one, or stopping. */
+	if (input && !timer_input(gb))
+		timer_tick(gb, 1);
+
+	timer_schedule(gb);
+}
+
 void tick(Gameboy *gb)
 {
 
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "defs.h"
+
+/*
+ * Execution trace, built only with -DGB_TRACE. cpu_step writes one
+ * 16-byte record per step to a ring of GB_TRACE_SIZE records, holding the
+ * state before the instruction. Halted steps are only recorded once every
+ * 128 cycles, as opcode 0x00 at an unchanged PC, so that a long HALT does
+ * not flush the ring. Without GB_TRACE, TRACE_STEP expands to nothing and
+ * struct gb_trace is not part of Gameboy.
+ *
+ * gb_trace_save() writes the ring, oldest first, after a trace_header.
+ * glitzboy-trace decodes it.
+ */
+
+#ifndef GB_TRACE_SIZE
+#define GB_TRACE_SIZE 4096
+#endif
+
+#define TRACE_MAGIC "GBTR"
+#define TRACE_VERSION 1
+
+/* af to sp are in the order of Registers, to be copied in one go. */
+struct trace_record
+{
+	u16 pc;
+	/* ROM bank mapped at 0x4000, as the profiler counts it, truncated to
+	 * 8 bits to keep records at 16 bytes: MBC5 banks 256 and up show as
+	 * bank - 256. */
+	u8 bank;
+	u8 opcode;
+	u16 af;
+	u16 bc;
+	u16 de;
+	u16 hl;
+	u16 sp;
+	/* Low byte of timer.cycles; records are always under 256 cycles apart. */
+	u8 cycles;
+	u8 ly;
+};
+
+struct trace_header
+{
+	char magic[4];
+	u32 version;
+	u32 records;
+	u32 record_size;
+	/* timer.cycles when saved, for recovering the full counts. */
+	u64 cycles;
+};
+
+struct gb_trace
+{
+	struct trace_record records[GB_TRACE_SIZE];
+	/* Steps recorded in total. */
+	u64 count;
+};
+
+typedef char trace_record_size_check[sizeof(struct trace_record) == 16 ? 1 : -1];
+typedef char trace_size_check[(GB_TRACE_SIZE & (GB_TRACE_SIZE - 1)) == 0 ? 1 : -1];
+
+#ifdef GB_TRACE
+
+#define TRACE_STEP(gb, pc_, opcode_)                                            \
+	do                                                                          \
+	{                                                                           \
+		if (!(gb)->halt || ((gb)->timer.cycles & 0x7F) < 4)                     \
+		{                                                                       \
+			struct trace_record *const r_ =                                     \
+				&(gb)->trace.records[(gb)->trace.count++ & (GB_TRACE_SIZE - 1)]; \
+			r_->pc = (pc_);                                                     \
+			r_->bank = (u8)((gb)->rom_bank_base / ROM_BANK_SIZE);               \
+			r_->opcode = (opcode_);                                             \
+			memcpy(&r_->af, &(gb)->cpu_reg.AF, 5 * sizeof(u16));                \
+			r_->cycles = (u8)(gb)->timer.cycles;                                \
+			r_->ly = (gb)->hw_reg.LY;                                           \
+		}                                                                       \
+	} while (0)
+
+#else
+
+#define TRACE_STEP(gb, pc_, opcode_) ((void)0)
+
+#endif
+
+/* Writes the ring to file_name. Returns 0 on failure. */
+bool gb_trace_save(const struct gb_trace *t, const u64 cycles,
+				   const char *file_name)
+{
+	const u64 n = t->count < GB_TRACE_SIZE ? t->count : GB_TRACE_SIZE;
+	const u64 first = t->count - n;
+	struct trace_header h;
+	FILE *f = fopen(file_name, "wb");
+	bool ok = 1;
+
+	if (f == NULL)
+		return 0;
+
+	memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+	h.version = TRACE_VERSION;
+	h.records = n;
+	h.record_size = sizeof(struct trace_record);
+	h.cycles = cycles;
+
+	ok = fwrite(&h, sizeof(h), 1, f) == 1;
+
+	for (u64 i = first; ok && i < t->count; i++)
+		ok = fwrite(&t->records[i & (GB_TRACE_SIZE - 1)], sizeof(struct trace_record), 1, f) == 1;
+
+	return fclose(f) == 0 && ok;
+}
@@ -0,0 +1,129 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "trace.h"
+
+/*
+ * Decodes a trace written by gb_trace_save(): one line per step, oldest
+ * first, with the full cycle count, bank:address, opcode and the
+ * registers and LY before the step.
+ */
+
+static const char *const mnemonics[0x100] = {
+    "NOP", "LD BC,d16", "LD (BC),A", "INC BC", "INC B", "DEC B", "LD B,d8", "RLCA",
+    "LD (a16),SP", "ADD HL,BC", "LD A,(BC)", "DEC BC", "INC C", "DEC C", "LD C,d8", "RRCA",
+    "STOP", "LD DE,d16", "LD (DE),A", "INC DE", "INC D", "DEC D", "LD D,d8", "RLA",
+    "JR r8", "ADD HL,DE", "LD A,(DE)", "DEC DE", "INC E", "DEC E", "LD E,d8", "RRA",
+    "JR NZ,r8", "LD HL,d16", "LD (HL+),A", "INC HL", "INC H", "DEC H", "LD H,d8", "DAA",
+    "JR Z,r8", "ADD HL,HL", "LD A,(HL+)", "DEC HL", "INC L", "DEC L", "LD L,d8", "CPL",
+    "JR NC,r8", "LD SP,d16", "LD (HL-),A", "INC SP", "INC (HL)", "DEC (HL)", "LD (HL),d8", "SCF",
+    "JR C,r8", "ADD HL,SP", "LD A,(HL-)", "DEC SP", "INC A", "DEC A", "LD A,d8", "CCF",
+    "LD B,B", "LD B,C", "LD B,D", "LD B,E", "LD B,H", "LD B,L", "LD B,(HL)", "LD B,A",
+    "LD C,B", "LD C,C", "LD C,D", "LD C,E", "LD C,H", "LD C,L", "LD C,(HL)", "LD C,A",
+    "LD D,B", "LD D,C", "LD D,D", "LD D,E", "LD D,H", "LD D,L", "LD D,(HL)", "LD D,A",
+    "LD E,B", "LD E,C", "LD E,D", "LD E,E", "LD E,H", "LD E,L", "LD E,(HL)", "LD E,A",
+    "LD H,B", "LD H,C", "LD H,D", "LD H,E", "LD H,H", "LD H,L", "LD H,(HL)", "LD H,A",
+    "LD L,B", "LD L,C", "LD L,D", "LD L,E", "LD L,H", "LD L,L", "LD L,(HL)", "LD L,A",
+    "LD (HL),B", "LD (HL),C", "LD (HL),D", "LD (HL),E", "LD (HL),H", "LD (HL),L", "HALT", "LD (HL),A",
+    "LD A,B", "LD A,C", "LD A,D", "LD A,E", "LD A,H", "LD A,L", "LD A,(HL)", "LD A,A",
+    "ADD A,B", "ADD A,C", "ADD A,D", "ADD A,E", "ADD A,H", "ADD A,L", "ADD A,(HL)", "ADD A,A",
+    "ADC A,B", "ADC A,C", "ADC A,D", "ADC A,E", "ADC A,H", "ADC A,L", "ADC A,(HL)", "ADC A,A",
+    "SUB B", "SUB C", "SUB D", "SUB E", "SUB H", "SUB L", "SUB (HL)", "SUB A",
+    "SBC A,B", "SBC A,C", "SBC A,D", "SBC A,E", "SBC A,H", "SBC A,L", "SBC A,(HL)", "SBC A,A",
+    "AND B", "AND C", "AND D", "AND E", "AND H", "AND L", "AND (HL)", "AND A",
+    "XOR B", "XOR C", "XOR D", "XOR E", "XOR H", "XOR L", "XOR (HL)", "XOR A",
+    "OR B", "OR C", "OR D", "OR E", "OR H", "OR L", "OR (HL)", "OR A",
+    "CP B", "CP C", "CP D", "CP E", "CP H", "CP L", "CP (HL)", "CP A",
+    "RET NZ", "POP BC", "JP NZ,a16", "JP a16", "CALL NZ,a16", "PUSH BC", "ADD A,d8", "RST 00H",
+    "RET Z", "RET", "JP Z,a16", "PREFIX CB", "CALL Z,a16", "CALL a16", "ADC A,d8", "RST 08H",
+    "RET NC", "POP DE", "JP NC,a16", NULL, "CALL NC,a16", "PUSH DE", "SUB d8", "RST 10H",
+    "RET C", "RETI", "JP C,a16", NULL, "CALL C,a16", NULL, "SBC A,d8", "RST 18H",
+    "LDH (a8),A", "POP HL", "LD (C),A", NULL, NULL, "PUSH HL", "AND d8", "RST 20H",
+    "ADD SP,r8", "JP (HL)", "LD (a16),A", NULL, NULL, NULL, "XOR d8", "RST 28H",
+    "LDH A,(a8)", "POP AF", "LD A,(C)", "DI", NULL, "PUSH AF", "OR d8", "RST 30H",
+    "LD HL,SP+r8", "LD SP,HL", "LD A,(a16)", "EI", NULL, NULL, "CP d8", "RST 38H"};
+
+int main(int argc, char **argv)
+{
+  struct trace_header h;
+  struct trace_record *records = NULL;
+  u64 *cycles = NULL;
+  FILE *f;
+  int ret = EXIT_SUCCESS;
+
+  if (argc != 2)
+  {
+    printf("Usage: %s TRACE\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if ((f = fopen(argv[1], "rb")) == NULL)
+  {
+    printf("%s: %s\n", argv[1], strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  if (fread(&h, sizeof(h), 1, f) != 1 ||
+      memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0 ||
+      h.version != TRACE_VERSION || h.record_size != sizeof(*records))
+  {
+    printf("%s: not a version %d trace\n", argv[1], TRACE_VERSION);
+    ret = EXIT_FAILURE;
+    goto out;
+  }
+
+  if ((records = malloc(h.records * sizeof(*records) + 1)) == NULL ||
+      (cycles = malloc(h.records * sizeof(*cycles) + 1)) == NULL)
+  {
+    printf("%d: %s\n", __LINE__, strerror(errno));
+    ret = EXIT_FAILURE;
+    goto out;
+  }
+
+  if (fread(records, sizeof(*records), h.records, f) != h.records)
+  {
+    printf("%s: truncated\n", argv[1]);
+    ret = EXIT_FAILURE;
+    goto out;
+  }
+
+  /* Full counts, back from the newest step, which ran shortly before the
+   * trace was saved. */
+  for (u32 i = h.records; i-- > 0;)
+  {
+    const u64 next = i + 1 < h.records ? cycles[i + 1] : h.cycles;
+
+    cycles[i] = next - (u8)(next - records[i].cycles);
+  }
+
+  puts("          cycles  bank:pc  op  instruction   AF   BC   DE   HL   SP  "
+       "flags  LY");
+
+  for (u32 i = 0; i < h.records; i++)
+  {
+    const struct trace_record *r = &records[i];
+    const char *name = mnemonics[r->opcode] ? mnemonics[r->opcode] : "invalid";
+    /* A halted step repeats the PC after HALT. */
+    const int halted = i && r->opcode == 0x00 &&
+                       ((records[i - 1].opcode == 0x76 &&
+                         r->pc == ((records[i - 1].pc + 1) & 0xFFFF)) ||
+                        (records[i - 1].opcode == 0x00 && r->pc == records[i - 1].pc));
+
+    printf("%16llu  %02X:%04X  %02X  %-12s %04X %04X %04X %04X %04X  %c%c%c%c  "
+           "%3u\n",
+           (unsigned long long)cycles[i],
+           r->pc >= 0x4000 && r->pc < 0x8000 ? r->bank : 0, r->pc, r->opcode,
+           halted ? "(halted)" : name, r->af, r->bc, r->de, r->hl, r->sp,
+           r->af & 0x80 ? 'Z' : '-', r->af & 0x40 ? 'N' : '-',
+           r->af & 0x20 ? 'H' : '-', r->af & 0x10 ? 'C' : '-', r->ly);
+  }
+
+out:
+  fclose(f);
+  free(records);
+  free(cycles);
+  return ret;
+}